@@ -8,6 +8,9 @@
 #include "kokos/idt.h"
 #include "kokos/gdt.h"
 #include "kokos/memory.h"
+#include "kokos/fpu.h"
+#include "kokos/time.h"
+#include "kokos/idle.h"
 
 inline struct cpu_id_result cpu_id(unsigned int function)
 {
@@ -19,6 +22,16 @@ inline struct cpu_id_result cpu_id(unsigned int function)
     return result;
 }
 
+inline struct cpu_id_result cpu_id_subleaf(unsigned int function, unsigned int subleaf)
+{
+    struct cpu_id_result result;
+    asm volatile("cpuid"
+                 : "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx), "=d"(result.edx)
+                 : "a"(function), "c"(subleaf)
+                 :);
+    return result;
+}
+
 inline unsigned long cpu_timestamp()
 {
     unsigned long upper;
@@ -32,8 +45,9 @@ inline unsigned long cpu_timestamp()
 
 inline unsigned long cpu_wait_microsecond()
 {
+    unsigned long cycles = time_ns_to_cycles(1000ul);
     unsigned long start = cpu_timestamp(), current = start;
-    while (current - start < 10000ull) // ~1us
+    while (current - start < cycles)
     {
         current = cpu_timestamp();
         asm volatile("pause");
@@ -42,8 +56,9 @@ inline unsigned long cpu_wait_microsecond()
 
 inline unsigned long cpu_wait_millisecond()
 {
+    unsigned long cycles = time_ns_to_cycles(1000000ul);
     unsigned long start = cpu_timestamp(), current = start;
-    while (current - start < 10000000ull) // ~1ms
+    while (current - start < cycles)
     {
         current = cpu_timestamp();
         asm volatile("pause");
@@ -66,6 +81,25 @@ inline unsigned long cpu_write_msr(unsigned int register_index, unsigned long va
                  :);
 }
 
+unsigned long cpu_disable_interrupts()
+{
+    unsigned long rflags;
+    asm volatile("pushfq\n"
+                 "pop %0\n"
+                 "cli"
+                 : "=r"(rflags)
+                 :
+                 : "memory");
+    return rflags;
+}
+
+void cpu_restore_interrupts(unsigned long rflags)
+{
+    if (rflags & CPU_RFLAGS_INTERRUPT)
+        asm volatile("sti" ::
+                         : "memory");
+}
+
 inline struct cpu *cpu_get_current()
 {
     struct cpu *cpu;
@@ -89,8 +123,37 @@ inline void cpu_panic(const char *message)
 }
 
 static int current_cpu_id = 0;
+// The first and last cpu in the list of cpus, linked together using next
+static struct cpu *first_cpu = 0;
+static struct cpu *last_cpu = 0;
 extern unsigned long max_memory_address;
 
+struct cpu *cpu_iterate(struct cpu *previous)
+{
+    if (!previous)
+    {
+        return first_cpu;
+    }
+    return previous->next;
+}
+
+void cpu_send_interrupt(struct cpu *cpu, unsigned char vector)
+{
+    unsigned long rflags = cpu_disable_interrupts();
+
+    // Wait until the previous interrupt was sent
+    while (CPU_APIC->interrupt_command0 & CPU_APIC_DELIVERY_PENDING)
+    {
+        asm volatile("pause");
+    }
+
+    // interrupt_command1 must be written first because the interrupt will be sent when interrupt_command0 has been written to
+    CPU_APIC->interrupt_command1 = cpu->apic_id << 24;
+    CPU_APIC->interrupt_command0 = vector;
+
+    cpu_restore_interrupts(rflags);
+}
+
 struct cpu *cpu_initialize(void (*entrypoint)())
 {
     // The FS segment register will point to cpu-specific information
@@ -98,6 +161,34 @@ struct cpu *cpu_initialize(void (*entrypoint)())
     cpu->address = cpu;
     cpu->id = current_cpu_id++;
     cpu->interrupt_descriptor_table = 0;
+    cpu->current_process = 0;
+    cpu->current_thread = 0;
+    cpu->next = 0;
+    cpu->scheduler_lock = 0;
+    cpu->thread_count = 0;
+    cpu->idle_thread = 0;
+    cpu->fair_queue.root = 0;
+    cpu->fair_queue.min_vruntime = 0;
+    cpu->fair_queue.load = 0;
+    cpu->deadline_queue.ready = 0;
+    cpu->deadline_queue.waiting = 0;
+    cpu->deadline_queue.utilization = 0;
+    scheduler_wheel_initialize(&cpu->wheel, cpu_timestamp());
+    cpu->scheduler_ticks = 0;
+    cpu->timer_tsc_deadline = 0;
+    cpu->timer_ticks_per_megacycle = 0;
+    cpu->timer_stopped = 0;
+    cpu->timer_event = 0;
+    cpu->balance_request = 0;
+    cpu->steals = 0;
+    cpu->migrations = 0;
+    cpu->switch_start = 0;
+    cpu->switches = 0;
+    cpu->switch_cycles = 0;
+    cpu->address_space_switches = 0;
+    cpu->fpu_owner = 0;
+    cpu->fpu_loads = 0;
+    cpu->flush_request = 0;
     cpu_write_msr(CPU_MSR_FS_BASE, cpu);
 
     console_print("[cpu] set up GDT\n");
@@ -107,26 +198,35 @@ struct cpu *cpu_initialize(void (*entrypoint)())
     console_print("[cpu] set up IDT\n");
     idt_initialize();
 
+    console_print("[cpu] set up FPU\n");
+    fpu_initialize_cpu();
+
+    console_print("[cpu] set up idle loop\n");
+    idle_initialize_cpu();
+
     console_print("[cpu] set up dummy process\n");
 
     // Create dummy process, required for paging to work
     struct scheduler_process *dummy_process = memory_physical_allocate();
-    dummy_process->saved_instruction_pointer = 0;
-    dummy_process->saved_stack_pointer = (unsigned char *)memory_physical_allocate() + 4096;
     dummy_process->id = 20;
-    dummy_process->next = dummy_process;
-    dummy_process->previous = dummy_process;
-
-    dummy_process->paging_context.level4_table = memory_physical_allocate();
-    memory_zero(dummy_process->paging_context.level4_table, 4096);
-    dummy_process->paging_context.level3_table = 0;
-    dummy_process->paging_context.level2_table = 0;
-    dummy_process->paging_context.level1_table = 0;
-    dummy_process->paging_context.level4_index = 0;
-    dummy_process->paging_context.level3_index = 0;
-    dummy_process->paging_context.level2_index = 0;
-    dummy_process->paging_context.level1_index = 0;
+    dummy_process->thread_count = 1;
+    dummy_process->affinity = CPU_MASK_ALL;
+
+    // The thread of the dummy process runs on the stack allocated below, its stack pointer is saved when it is switched out for the first time
+    struct scheduler_thread *idle_thread = memory_physical_allocate();
+    idle_thread->saved_stack_pointer = 0;
+    idle_thread->id = 20;
+    idle_thread->process = dummy_process;
+    idle_thread->state = SCHEDULER_THREAD_RUNNABLE;
+    idle_thread->cpu = cpu;
+    idle_thread->affinity = CPU_MASK(cpu->id);
+    idle_thread->fpu_state = fpu_create_state();
+
+    paging_context_initialize(&dummy_process->paging_context);
+    paging_initialize_cpu();
     cpu->current_process = dummy_process;
+    cpu->current_thread = idle_thread;
+    cpu->idle_thread = idle_thread;
 
     // Identity map whole RAM
     if (paging_get_hugepages_supported())
@@ -134,7 +234,7 @@ struct cpu *cpu_initialize(void (*entrypoint)())
         console_print("[paging] identity map using 1GiB pages\n");
 
         // Identity map whole memory using 1GB huge pages
-        paging_map_physical_at(&dummy_process->paging_context, 0, 0, ALIGN_TO_NEXT(max_memory_address, 0x40000000ul), PAGING_FLAG_1GB | PAGING_FLAG_READ | PAGING_FLAG_WRITE);
+        paging_map_physical_at(&dummy_process->paging_context, 0, 0, ALIGN_TO_NEXT(max_memory_address, 0x40000000ul), PAGING_FLAG_1GB | PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_EXECUTE | PAGING_FLAG_GLOBAL);
 
         console_print("[paging] done\n");
     }
@@ -143,7 +243,7 @@ struct cpu *cpu_initialize(void (*entrypoint)())
         console_print("[paging] identity map using 2MiB pages (1GiB pages not supported)\n");
 
         // Identity map whole memory using 2MB huge pages
-        paging_map_physical_at(&dummy_process->paging_context, 0, 0, ALIGN_TO_NEXT(max_memory_address, 0x200000ul), PAGING_FLAG_2MB | PAGING_FLAG_READ | PAGING_FLAG_WRITE);
+        paging_map_physical_at(&dummy_process->paging_context, 0, 0, ALIGN_TO_NEXT(max_memory_address, 0x200000ul), PAGING_FLAG_2MB | PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_EXECUTE | PAGING_FLAG_GLOBAL);
 
         console_print("[paging] done\n");
     }
@@ -164,7 +264,7 @@ struct cpu *cpu_initialize(void (*entrypoint)())
     }
 
     cpu->local_apic_physical = local_apic_physical;
-    if (!paging_map_physical_at(&dummy_process->paging_context, local_apic_physical, CPU_APIC_ADDRESS, sizeof(struct apic), PAGING_FLAG_WRITE | PAGING_FLAG_READ))
+    if (!paging_map_physical_at(&dummy_process->paging_context, local_apic_physical, CPU_APIC_ADDRESS, sizeof(struct apic), PAGING_FLAG_WRITE | PAGING_FLAG_READ | PAGING_FLAG_GLOBAL | PAGING_FLAG_UNCACHED))
     {
         cpu_panic("could not map local apic");
         return;
@@ -177,8 +277,18 @@ struct cpu *cpu_initialize(void (*entrypoint)())
     // Tell cpu to use new page table
     asm volatile("mov cr3, %0" ::"a"(cpu->current_process->paging_context.level4_table)
                  :);
+    cpu->apic_id = CPU_APIC->id >> 24;
     console_print("[cpu] apic id ");
-    console_print_u64(CPU_APIC->id >> 24, 10);
+    console_print_u64(cpu->apic_id, 10);
+    console_new_line();
+
+    cpu_topology_detect(&cpu->topology);
+    console_print("[cpu] package ");
+    console_print_u64(cpu->topology.package_id, 10);
+    console_print(", core ");
+    console_print_u64(cpu->topology.core_id, 10);
+    console_print(", thread ");
+    console_print_u64(cpu->topology.thread_id, 10);
     console_new_line();
 
     // Enable APIC after interrupt vectors were intialized
@@ -197,6 +307,15 @@ struct cpu *cpu_initialize(void (*entrypoint)())
     console_print("[cpu] set up scheduler\n");
     scheduler_initialize();
 
+    // Add this cpu to the list of cpus, from now on scheduler_execute can start processes on it and it receives TLB flush requests
+    // Processors are started one at a time, see kernel_start in main.c
+    // The stack was switched, so the cpu variable is not used anymore
+    if (last_cpu)
+        last_cpu->next = cpu_get_current();
+    else
+        first_cpu = cpu_get_current();
+    last_cpu = cpu_get_current();
+
     // Enable hardware interrupts
     asm volatile("sti");
 
@@ -205,8 +324,6 @@ struct cpu *cpu_initialize(void (*entrypoint)())
         entrypoint_saved();
     }
 
-    while (1)
-    {
-        asm volatile("hlt");
-    }
+    // From now on, this is the idle thread of this cpu
+    idle_loop();
 }
@@ -0,0 +1,197 @@
+#include "kokos/cpu_topology.h"
+#include "kokos/cpu.h"
+#include "kokos/console.h"
+
+// Returns the amount of bits needed to number count things
+static unsigned int cpu_topology_bits(unsigned int count)
+{
+    unsigned int bits = 0;
+    while ((1u << bits) < count)
+        bits++;
+    return bits;
+}
+
+// Reads the shifts from the extended topology leaf (0xB or 0x1F), every sub-leaf describes a level starting at the lowest (SMT).
+// The shift of a level is the amount of x2APIC id bits of that level and the levels below it, the last level ends where the package bits start
+static void cpu_topology_read_extended(struct cpu_topology *topology, unsigned int leaf)
+{
+    for (unsigned int subleaf = 0; subleaf < 8; subleaf++)
+    {
+        struct cpu_id_result level = cpu_id_subleaf(leaf, subleaf);
+        unsigned int type = (level.ecx >> 8) & 0xFF;
+        if (type == CPU_TOPOLOGY_LEVEL_INVALID)
+            break;
+
+        unsigned int shift = level.eax & 0x1F;
+        if (type == CPU_TOPOLOGY_LEVEL_SMT)
+            topology->smt_shift = shift;
+        // Levels between the core and the package (modules, tiles, dies) are counted as part of the package
+        topology->core_shift = shift;
+        topology->x2apic_id = level.edx;
+    }
+}
+
+// Reads the shifts from the AMD extended APIC id leaf
+static void cpu_topology_read_amd(struct cpu_topology *topology)
+{
+    struct cpu_id_result ids = cpu_id(0x8000001E);
+    topology->x2apic_id = ids.eax;
+    topology->smt_shift = cpu_topology_bits(((ids.ebx >> 8) & 0xFF) + 1);
+
+    // ECX[15:12] of leaf 0x80000008 is the amount of APIC id bits of the cores in a package, when it is 0 it must be derived from the amount of cores in ECX[7:0]
+    unsigned int size = cpu_id(0x80000008).ecx;
+    topology->core_shift = (size >> 12) & 0xF;
+    if (!topology->core_shift)
+        topology->core_shift = cpu_topology_bits((size & 0xFF) + 1);
+}
+
+// Derives the shifts from the amount of logical cpus per package (leaf 0x1) and the amount of cores per package (leaf 0x4)
+static void cpu_topology_read_legacy(struct cpu_topology *topology, unsigned int max_leaf)
+{
+    struct cpu_id_result features = cpu_id(0x1);
+    topology->x2apic_id = features.ebx >> 24;
+    unsigned int logical = features.edx & CPU_ID_HYPER_THREADING_EDX ? (features.ebx >> 16) & 0xFF : 1;
+    unsigned int cores = max_leaf >= 0x4 ? (cpu_id_subleaf(0x4, 0).eax >> 26) + 1 : 1;
+    if (logical < cores)
+        logical = cores;
+    topology->core_shift = cpu_topology_bits(logical);
+    topology->smt_shift = cpu_topology_bits(logical / cores);
+}
+
+// Reads the amount of x2APIC id bits of the cpus that share the highest level cache from a deterministic cache parameters leaf (0x4 or 0x8000001D).
+// Returns 0 if the leaf does not describe any cache
+static int cpu_topology_read_llc(struct cpu_topology *topology, unsigned int leaf)
+{
+    unsigned int highest_level = 0;
+    for (unsigned int subleaf = 0; subleaf < 16; subleaf++)
+    {
+        struct cpu_id_result cache = cpu_id_subleaf(leaf, subleaf);
+        // Type 0 means there are no more caches
+        if (!(cache.eax & 0x1F))
+            break;
+
+        unsigned int level = (cache.eax >> 5) & 0b111;
+        if (level >= highest_level)
+        {
+            highest_level = level;
+            topology->llc_shift = cpu_topology_bits(((cache.eax >> 14) & 0xFFF) + 1);
+        }
+    }
+    return highest_level != 0;
+}
+
+void cpu_topology_detect(struct cpu_topology *topology)
+{
+    unsigned int max_leaf = cpu_id(CPU_ID_FUNCTION_0).eax;
+    unsigned int max_extended_leaf = cpu_id(0x80000000).eax;
+    int topology_extensions = max_extended_leaf >= 0x80000001 && (cpu_id(0x80000001).ecx & CPU_ID_TOPOLOGY_EXTENSIONS_ECX);
+
+    topology->smt_shift = 0;
+    topology->core_shift = 0;
+
+    // A leaf that is not supported returns zeros, EBX of the first level is the amount of cpus in it
+    if (max_leaf >= 0x1F && cpu_id_subleaf(0x1F, 0).ebx)
+        topology->leaf = 0x1F;
+    else if (max_leaf >= 0xB && cpu_id_subleaf(0xB, 0).ebx)
+        topology->leaf = 0xB;
+    else if (topology_extensions && max_extended_leaf >= 0x8000001E)
+        topology->leaf = 0x8000001E;
+    else
+        topology->leaf = 0x1;
+
+    if (topology->leaf == 0x8000001E)
+        cpu_topology_read_amd(topology);
+    else if (topology->leaf == 0x1)
+        cpu_topology_read_legacy(topology, max_leaf);
+    else
+        cpu_topology_read_extended(topology, topology->leaf);
+
+    // Without cache information, assume the package shares its last level cache
+    topology->llc_shift = topology->core_shift;
+    if (!(max_leaf >= 0x4 && cpu_topology_read_llc(topology, 0x4)) && topology_extensions && max_extended_leaf >= 0x8000001D)
+        cpu_topology_read_llc(topology, 0x8000001D);
+    // The last level cache is shared by at least a core and by at most a package. EAX[25:14] of leaf 0x4 is rounded up to a power of two
+    // and can be larger than the package, then llc_id would be the same for cpus in different packages
+    if (topology->llc_shift < topology->smt_shift)
+        topology->llc_shift = topology->smt_shift;
+    if (topology->llc_shift > topology->core_shift)
+        topology->llc_shift = topology->core_shift;
+
+    topology->thread_id = topology->x2apic_id & ((1u << topology->smt_shift) - 1);
+    topology->core_id = topology->x2apic_id >> topology->smt_shift;
+    topology->llc_id = topology->x2apic_id >> topology->llc_shift;
+    topology->package_id = topology->x2apic_id >> topology->core_shift;
+}
+
+int cpu_topology_distance(struct cpu *a, struct cpu *b)
+{
+    if (a == b)
+        return CPU_TOPOLOGY_SAME_CPU;
+    if (a->topology.core_id == b->topology.core_id)
+        return CPU_TOPOLOGY_SAME_CORE;
+    if (a->topology.llc_id == b->topology.llc_id)
+        return CPU_TOPOLOGY_SAME_LLC;
+    if (a->topology.package_id == b->topology.package_id)
+        return CPU_TOPOLOGY_SAME_PACKAGE;
+    return CPU_TOPOLOGY_OTHER_PACKAGE;
+}
+
+// Returns 1 if no cpu before cpu in the list of cpus shares level with it, so every group of that level is printed once
+static int cpu_topology_first_of(struct cpu *cpu, int level)
+{
+    struct cpu *other = 0;
+    while ((other = cpu_iterate(other)) != cpu)
+    {
+        if (cpu_topology_distance(other, cpu) <= level)
+            return 0;
+    }
+    return 1;
+}
+
+void cpu_topology_debug()
+{
+    struct cpu *package = 0;
+    while (package = cpu_iterate(package))
+    {
+        if (!cpu_topology_first_of(package, CPU_TOPOLOGY_SAME_PACKAGE))
+            continue;
+        console_print("[topology] package ");
+        console_print_u64(package->topology.package_id, 10);
+        console_print(" (cpuid leaf 0x");
+        console_print_u64(package->topology.leaf, 16);
+        console_print(")\n");
+
+        struct cpu *llc = 0;
+        while (llc = cpu_iterate(llc))
+        {
+            if (cpu_topology_distance(llc, package) > CPU_TOPOLOGY_SAME_PACKAGE || !cpu_topology_first_of(llc, CPU_TOPOLOGY_SAME_LLC))
+                continue;
+            console_print("[topology]   last level cache ");
+            console_print_u64(llc->topology.llc_id, 10);
+            console_new_line();
+
+            struct cpu *core = 0;
+            while (core = cpu_iterate(core))
+            {
+                if (cpu_topology_distance(core, llc) > CPU_TOPOLOGY_SAME_LLC || !cpu_topology_first_of(core, CPU_TOPOLOGY_SAME_CORE))
+                    continue;
+                console_print("[topology]     core ");
+                console_print_u64(core->topology.core_id, 10);
+                console_print(":");
+
+                struct cpu *thread = 0;
+                while (thread = cpu_iterate(thread))
+                {
+                    if (cpu_topology_distance(thread, core) > CPU_TOPOLOGY_SAME_CORE)
+                        continue;
+                    console_print(" cpu ");
+                    console_print_u64(thread->id, 10);
+                    console_print(" (x2apic ");
+                    console_print_u64(thread->topology.x2apic_id, 10);
+                    console_print(")");
+                }
+                console_new_line();
+            }
+        }
+    }
+}
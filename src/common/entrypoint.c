@@ -4,59 +4,24 @@
 #include "kokos/memory_physical.h"
 #include "kokos/idt.h"
 
-extern unsigned short cpu_startup_increment;
-extern unsigned short cpu_startup_done;
+extern volatile unsigned short cpu_startup_increment;
+extern unsigned long *cpu_startup_page_table;
 
-void cpu_entrypoint()
+// Called by cpu_initialize on the new stack of this processor
+static void cpu_entrypoint_started()
 {
-
-    // console_print("[cpu] starting cpu\n");
-    // cpu_startup_increment = 1;
-    // return;
-
-    // struct cpu *cpu_info = cpu_initialize();
-    // idt_initialize();
-
-    cpu_wait_millisecond();
-
-    // console_print("[cpu] cpu info at 0x");
-    // console_print_u32(cpu_info, 16);
-    // console_print(" and fs is 0x");
-    // console_print_u32(cpu_read_msr(CPU_MSR_FS_BASE), 16);
-    // console_print(" or 0x");
-    // console_print_u32(cpu_get_current(), 16);
-    // console_new_line();
-
-    // console_print("[cpu] current cpu id ");
-    // console_print_u32(cpu_info->id, 10);
-    // console_print(" and fs is ");
-    // console_print_u32(cpu_get_current()->id, 10);
-    // console_new_line();
-
-    // console_print("[cpu] enabling schedule interrupt\n");
-
-    // asm volatile("cli");
-    // idt_register_interrupt(0x22, interrupt_schedule, IDT_GATE_TYPE_INTERRUPT);
-    // asm volatile("sti");
-
-    // Enable local APIC by setting bit 8 in the spurious_interrupt_vector register
-    // cpu_info->local_apic_physical->spurious_interrupt_vector = 0x1FF;
-    // cpu_info->local_apic_physical->timer_initial_count = 10000000;
-    // cpu_info->local_apic_physical->timer_divide_config = 0b1010;
-    // cpu_info->local_apic_physical->timer_vector = 0x22 | (1 << 17);
-
-    // console_print("[cpu] done\n");
-
-    // unsigned long rip;
-    // asm volatile("push rip; pop %0"
-    //              : "=r"(rip)::);
-    // console_print("[cpu] rip = 0x");
-    // console_print_u64(rip, 16);
-    // console_new_line();
-
+    // The startup stack in cpu.asm is not used anymore, the next processor can be started
     cpu_startup_increment = 1;
-    while (1)
-    {
-        asm volatile("hlt");
-    }
-}
\ No newline at end of file
+}
+
+// Application processors enter here after cpu_startup16 (see cpu.asm) switched to long mode
+void cpu_entrypoint()
+{
+    // The startup page table only maps the first 1GiB, use the address space of the boot processor until cpu_initialize created one
+    asm volatile("mov cr3, %0" ::"r"(cpu_startup_page_table)
+                 : "memory");
+
+    // Set up the GDT, IDT, dummy process, stack and scheduler timer of this processor, processes are started on it using scheduler_execute.
+    // This does not return, the dummy process halts until the scheduler timer switches to another process
+    cpu_initialize(cpu_entrypoint_started);
+}
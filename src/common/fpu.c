@@ -0,0 +1,220 @@
+#include "kokos/fpu.h"
+#include "kokos/cpu.h"
+#include "kokos/idt.h"
+#include "kokos/memory.h"
+#include "kokos/memory_physical.h"
+#include "kokos/console.h"
+#include "kokos/core.h"
+
+enum fpu_save_type
+{
+    FPU_SAVE_FXSAVE = 0,
+    FPU_SAVE_XSAVE = 1,
+    FPU_SAVE_XSAVEOPT = 2,
+    FPU_SAVE_XSAVES = 3,
+};
+
+static const char *save_type_names[] = {"FXSAVE", "XSAVE", "XSAVEOPT", "XSAVES"};
+
+// These are decided by the first cpu, every cpu is assumed to support the same
+static enum fpu_save_type save_type = FPU_SAVE_FXSAVE;
+// The state components that are enabled in XCR0 and switched
+static unsigned long state_components = FPU_XCR0_X87 | FPU_XCR0_SSE;
+// The size of the saved state
+static unsigned long state_size = FPU_FXSAVE_SIZE;
+// The state of a thread that did not use the FPU yet, copied into new states
+static void *initial_state = 0;
+
+static void fpu_save(void *state)
+{
+    unsigned int lower = state_components;
+    unsigned int upper = state_components >> 32;
+    switch (save_type)
+    {
+    case FPU_SAVE_XSAVES:
+        asm volatile("xsaves64 [%0]" ::"r"(state), "a"(lower), "d"(upper)
+                     : "memory");
+        break;
+    case FPU_SAVE_XSAVEOPT:
+        asm volatile("xsaveopt64 [%0]" ::"r"(state), "a"(lower), "d"(upper)
+                     : "memory");
+        break;
+    case FPU_SAVE_XSAVE:
+        asm volatile("xsave64 [%0]" ::"r"(state), "a"(lower), "d"(upper)
+                     : "memory");
+        break;
+    default:
+        asm volatile("fxsave64 [%0]" ::"r"(state)
+                     : "memory");
+        break;
+    }
+}
+
+static void fpu_restore(void *state)
+{
+    unsigned int lower = state_components;
+    unsigned int upper = state_components >> 32;
+    switch (save_type)
+    {
+    case FPU_SAVE_XSAVES:
+        asm volatile("xrstors64 [%0]" ::"r"(state), "a"(lower), "d"(upper)
+                     : "memory");
+        break;
+    case FPU_SAVE_XSAVEOPT:
+    case FPU_SAVE_XSAVE:
+        asm volatile("xrstor64 [%0]" ::"r"(state), "a"(lower), "d"(upper)
+                     : "memory");
+        break;
+    default:
+        asm volatile("fxrstor64 [%0]" ::"r"(state)
+                     : "memory");
+        break;
+    }
+}
+
+static inline void fpu_set_task_switched()
+{
+    unsigned long cr0;
+    asm volatile("mov %0, cr0"
+                 : "=r"(cr0));
+    if (!(cr0 & CPU_CR0_TASK_SWITCHED))
+        asm volatile("mov cr0, %0" ::"r"(cr0 | CPU_CR0_TASK_SWITCHED));
+}
+
+// Raised by the first FPU instruction after CR0.TS was set, see fpu_switch
+ATTRIBUTE_INTERRUPT
+static void fpu_handle_device_not_available(struct idt_stack_frame *frame)
+{
+    struct cpu *cpu = cpu_get_current();
+    asm volatile("clts");
+
+    // While the cpu is initialized there is no thread yet, the registers do not belong to anyone
+    struct scheduler_thread *current = cpu->current_thread;
+    if (!current || cpu->fpu_owner == current)
+        return;
+
+    // Move the registers from the previous owner to the current thread
+    if (cpu->fpu_owner)
+        fpu_save(cpu->fpu_owner->fpu_state);
+    fpu_restore(current->fpu_state);
+    cpu->fpu_owner = current;
+    cpu->fpu_loads++;
+}
+
+void fpu_initialize_cpu()
+{
+    struct cpu *cpu = cpu_get_current();
+
+    // Use the FPU natively (no emulation), SSE instructions and SIMD floating point exceptions
+    unsigned long cr0;
+    asm volatile("mov %0, cr0"
+                 : "=r"(cr0));
+    asm volatile("mov cr0, %0" ::"r"((cr0 & ~CPU_CR0_EMULATION) | CPU_CR0_MONITOR_COPROCESSOR));
+
+    unsigned long cr4;
+    asm volatile("mov %0, cr4"
+                 : "=r"(cr4));
+    cr4 |= CPU_CR4_OSFXSR | CPU_CR4_OSXMMEXCPT;
+
+    int xsave_supported = cpu_id(0x1).ecx & CPU_ID_XSAVE_ECX;
+    if (xsave_supported)
+        cr4 |= CPU_CR4_OSXSAVE;
+    asm volatile("mov cr4, %0" ::"r"(cr4));
+
+    if (xsave_supported)
+    {
+        // Enable every supported component that is switched, CPUID leaf 0xD sub-leaf 0 contains the components that XCR0 supports
+        struct cpu_id_result components = cpu_id_subleaf(0xD, 0);
+        unsigned long supported = ((unsigned long)components.edx << 32) | components.eax;
+        unsigned long enabled = supported & (FPU_XCR0_X87 | FPU_XCR0_SSE | FPU_XCR0_AVX | FPU_XCR0_AVX512);
+        // The AVX-512 components can only be enabled together
+        if ((enabled & FPU_XCR0_AVX512) != FPU_XCR0_AVX512)
+            enabled &= ~FPU_XCR0_AVX512;
+        asm volatile("xsetbv" ::"c"(0), "a"((unsigned int)enabled), "d"((unsigned int)(enabled >> 32)));
+
+        if (!initial_state)
+        {
+            state_components = enabled;
+
+            // Sub-leaf 1 tells which save instructions are supported, XSAVES uses the compacted format which has a different size
+            struct cpu_id_result extensions = cpu_id_subleaf(0xD, 1);
+            if (extensions.eax & CPU_ID_XSAVES_EAX)
+            {
+                save_type = FPU_SAVE_XSAVES;
+                cpu_write_msr(CPU_MSR_XSS, 0);
+                state_size = cpu_id_subleaf(0xD, 1).ebx;
+            }
+            else
+            {
+                save_type = extensions.eax & CPU_ID_XSAVEOPT_EAX ? FPU_SAVE_XSAVEOPT : FPU_SAVE_XSAVE;
+                // Sub-leaf 0 EBX is the size of the standard format for the components that are enabled in XCR0
+                state_size = cpu_id_subleaf(0xD, 0).ebx;
+            }
+        }
+        else if (save_type == FPU_SAVE_XSAVES)
+        {
+            cpu_write_msr(CPU_MSR_XSS, 0);
+        }
+    }
+
+    if (!initial_state)
+    {
+        if (state_size > 4096)
+        {
+            cpu_panic("FPU state does not fit in a page");
+            return;
+        }
+
+        // Save the state right after initialization, the save instructions also fill in the header of the XSAVE area
+        unsigned int mxcsr = FPU_DEFAULT_MXCSR;
+        asm volatile("fninit\n"
+                     "ldmxcsr [%0]" ::"r"(&mxcsr)
+                     : "memory");
+        initial_state = memory_physical_allocate();
+        memory_zero(initial_state, 4096);
+        fpu_save(initial_state);
+    }
+
+    idt_register_interrupt(7, fpu_handle_device_not_available, IDT_GATE_TYPE_INTERRUPT, IDT_STACK_TYPE_CURRENT);
+
+    // No thread owns the registers yet, the first FPU instruction loads the state of the thread
+    cpu->fpu_owner = 0;
+    fpu_set_task_switched();
+}
+
+void *fpu_create_state()
+{
+    void *state = memory_physical_allocate();
+    if (!state)
+    {
+        console_print("[fpu_create_state] could not allocate state\n");
+        return 0;
+    }
+
+    memory_copy(initial_state, state, state_size);
+    return state;
+}
+
+void fpu_switch(struct cpu *cpu, struct scheduler_thread *next)
+{
+    if (next == cpu->fpu_owner)
+    {
+        // Its state is still in the registers
+        asm volatile("clts");
+    }
+    else
+    {
+        fpu_set_task_switched();
+    }
+}
+
+void fpu_debug()
+{
+    console_print("[fpu] saving state using ");
+    console_print(save_type_names[save_type]);
+    console_print(", ");
+    console_print_u64(state_size, 10);
+    console_print(" bytes, components 0x");
+    console_print_u64(state_components, 16);
+    console_new_line();
+}
@@ -0,0 +1,71 @@
+#include "kokos/fpu_test.h"
+
+int fpu_test_registers(unsigned long seed, unsigned long cycles)
+{
+    // 2 quadwords per register
+    unsigned long pattern[FPU_TEST_REGISTERS * 2];
+    unsigned long result[FPU_TEST_REGISTERS * 2];
+    for (int i = 0; i < FPU_TEST_REGISTERS * 2; i++)
+    {
+        // Every quadword differs, so registers that are swapped are detected too
+        pattern[i] = (seed + i) * 0x9E3779B97F4A7C15ul;
+        result[i] = 0;
+    }
+
+    // The registers are loaded, waited on and stored in a single asm statement, otherwise the compiler could use them in between
+    asm volatile("movdqu xmm0, [%0 + 0]\n"
+                 "movdqu xmm1, [%0 + 16]\n"
+                 "movdqu xmm2, [%0 + 32]\n"
+                 "movdqu xmm3, [%0 + 48]\n"
+                 "movdqu xmm4, [%0 + 64]\n"
+                 "movdqu xmm5, [%0 + 80]\n"
+                 "movdqu xmm6, [%0 + 96]\n"
+                 "movdqu xmm7, [%0 + 112]\n"
+                 "movdqu xmm8, [%0 + 128]\n"
+                 "movdqu xmm9, [%0 + 144]\n"
+                 "movdqu xmm10, [%0 + 160]\n"
+                 "movdqu xmm11, [%0 + 176]\n"
+                 "movdqu xmm12, [%0 + 192]\n"
+                 "movdqu xmm13, [%0 + 208]\n"
+                 "movdqu xmm14, [%0 + 224]\n"
+                 "movdqu xmm15, [%0 + 240]\n"
+                 "rdtsc\n"
+                 "shl rdx, 32\n"
+                 "or rax, rdx\n"
+                 "mov rcx, rax\n"
+                 "1:\n"
+                 "pause\n"
+                 "rdtsc\n"
+                 "shl rdx, 32\n"
+                 "or rax, rdx\n"
+                 "sub rax, rcx\n"
+                 "cmp rax, %2\n"
+                 "jb 1b\n"
+                 "movdqu [%1 + 0], xmm0\n"
+                 "movdqu [%1 + 16], xmm1\n"
+                 "movdqu [%1 + 32], xmm2\n"
+                 "movdqu [%1 + 48], xmm3\n"
+                 "movdqu [%1 + 64], xmm4\n"
+                 "movdqu [%1 + 80], xmm5\n"
+                 "movdqu [%1 + 96], xmm6\n"
+                 "movdqu [%1 + 112], xmm7\n"
+                 "movdqu [%1 + 128], xmm8\n"
+                 "movdqu [%1 + 144], xmm9\n"
+                 "movdqu [%1 + 160], xmm10\n"
+                 "movdqu [%1 + 176], xmm11\n"
+                 "movdqu [%1 + 192], xmm12\n"
+                 "movdqu [%1 + 208], xmm13\n"
+                 "movdqu [%1 + 224], xmm14\n"
+                 "movdqu [%1 + 240], xmm15\n" ::"r"(pattern),
+                 "r"(result), "r"(cycles)
+                 : "rax", "rcx", "rdx", "cc", "memory",
+                   "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+                   "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15");
+
+    for (int i = 0; i < FPU_TEST_REGISTERS * 2; i++)
+    {
+        if (result[i] != pattern[i])
+            return 0;
+    }
+    return 1;
+}
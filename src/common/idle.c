@@ -0,0 +1,234 @@
+#include "kokos/idle.h"
+#include "kokos/cpu.h"
+#include "kokos/scheduler.h"
+#include "kokos/console.h"
+#include "kokos/time.h"
+
+// A state the idle loop can wait in
+struct idle_state
+{
+    const char *name;
+    // The MWAIT hint: the C-state minus 1 in bits 4 ... 7, the sub-state in bits 0 ... 3
+    unsigned int hint;
+    // The idle period (in nanoseconds) from which this state saves more power than the shallower ones, see the note on idling
+    unsigned long target_residency;
+};
+
+static const char *mwait_state_names[] = {"C0", "C1", "C2", "C3", "C4", "C5", "C6", "C7"};
+// The default target residency of each MWAIT C-state in nanoseconds, indexed by C-state
+static const unsigned long mwait_target_residencies[] = {0, 0, 20000ul, 100000ul, 200000ul, 400000ul, 800000ul, 1600000ul};
+
+// These are decided by the first cpu, every cpu is assumed to support the same
+static int mwait_supported = 0;
+// The available states from shallow to deep
+static struct idle_state states[IDLE_MAX_STATES];
+static int state_count = 0;
+
+void idle_initialize_cpu()
+{
+    struct cpu *cpu = cpu_get_current();
+    cpu->idle.wake = 0;
+    cpu->idle.sleeping = 0;
+    cpu->idle.enter = 0;
+    cpu->idle.state = 0;
+    cpu->idle.average = 0;
+    cpu->idle.wake_request = 0;
+    for (int i = 0; i < IDLE_MAX_STATES; i++)
+    {
+        cpu->idle.usage[i] = 0;
+        cpu->idle.residency[i] = 0;
+    }
+    cpu->idle.wakeups = 0;
+    cpu->idle.flag_wakeups = 0;
+    cpu->idle.wakeup_cycles = 0;
+
+    if (state_count)
+        return;
+
+    if ((cpu_id(0x1).ecx & CPU_ID_MONITOR_ECX) && cpu_id(CPU_ID_FUNCTION_0).eax >= 0x5)
+    {
+        struct cpu_id_result mwait = cpu_id(0x5);
+        if (mwait.ecx & CPU_ID_MWAIT_EXTENSIONS_ECX)
+        {
+            // EDX contains the amount of sub-states of each C-state in 4 bits, starting at C0
+            for (int c_state = 1; c_state < IDLE_MAX_STATES; c_state++)
+            {
+                if (!((mwait.edx >> (c_state * 4)) & 0xF))
+                    continue;
+                states[state_count].name = mwait_state_names[c_state];
+                states[state_count].hint = (c_state - 1) << 4;
+                states[state_count].target_residency = mwait_target_residencies[c_state];
+                state_count++;
+            }
+        }
+        if (!state_count)
+        {
+            // The available C-states are not enumerated, only C1 is certainly supported
+            states[0].name = mwait_state_names[1];
+            states[0].hint = 0;
+            states[0].target_residency = 0;
+            state_count = 1;
+        }
+        mwait_supported = 1;
+    }
+    else
+    {
+        states[0].name = "HLT";
+        states[0].hint = 0;
+        states[0].target_residency = 0;
+        state_count = 1;
+    }
+}
+
+// Returns the deepest state whose target residency fits in the predicted idle period of cpu, see the note on idling
+static int idle_select(struct cpu *cpu, unsigned long now)
+{
+    // A stopped scheduler timer does not end the idle period, the cpu waits until another cpu or a device interrupts it
+    unsigned long predicted = 0xFFFFFFFFFFFFFFFFul;
+    if (cpu->timer_event)
+        predicted = cpu->timer_event > now ? cpu->timer_event - now : 0;
+    if (cpu->idle.average && cpu->idle.average < predicted)
+        predicted = cpu->idle.average;
+
+    unsigned long predicted_ns = predicted == 0xFFFFFFFFFFFFFFFFul ? predicted : time_cycles_to_ns(predicted);
+    int state = 0;
+    for (int i = 1; i < state_count; i++)
+    {
+        if (states[i].target_residency <= predicted_ns)
+            state = i;
+    }
+    return state;
+}
+
+int idle_exit(struct cpu *cpu, unsigned long now)
+{
+    if (!cpu->idle.sleeping)
+        return 0;
+    cpu->idle.sleeping = 0;
+    int woken = cpu->idle.wake;
+    cpu->idle.wake = 0;
+
+    unsigned long duration = now - cpu->idle.enter;
+    cpu->idle.residency[cpu->idle.state] += duration;
+    if (cpu->idle.average)
+        cpu->idle.average = cpu->idle.average - (cpu->idle.average >> IDLE_AVERAGE_SHIFT) + (duration >> IDLE_AVERAGE_SHIFT);
+    else
+        cpu->idle.average = duration;
+
+    unsigned long request = cpu->idle.wake_request;
+    if (request)
+    {
+        cpu->idle.wake_request = 0;
+        cpu->idle.wakeups++;
+        if (woken)
+            cpu->idle.flag_wakeups++;
+        // The time stamp counters of the cpus are synchronized, but the request could have been written right after now was read
+        if (now > request)
+            cpu->idle.wakeup_cycles += now - request;
+    }
+    return woken;
+}
+
+void idle_wake(struct cpu *cpu)
+{
+    // The first request is used to measure the wake up latency, it does not matter if another cpu overwrites it at the same time
+    if (cpu->idle.sleeping && !cpu->idle.wake_request)
+        cpu->idle.wake_request = cpu_timestamp();
+
+    if (mwait_supported)
+    {
+        // The idle loop sets sleeping before it checks the wake flag, this cpu writes the wake flag before it checks sleeping.
+        // So either the idle loop sees the wake flag, or this cpu sees that the idle loop stopped waiting and sends an interrupt
+        cpu->idle.wake = 1;
+        asm volatile("mfence" ::
+                         : "memory");
+        if (cpu->idle.sleeping)
+            return;
+    }
+
+    cpu_send_interrupt(cpu, SCHEDULER_VECTOR);
+}
+
+void idle_loop()
+{
+    while (1)
+    {
+        // The idle thread is never migrated, so cpu stays the same even when the interrupts below switch to other threads
+        asm volatile("cli");
+        struct cpu *cpu = cpu_get_current();
+        unsigned long now = cpu_timestamp();
+        int state = idle_select(cpu, now);
+        cpu->idle.state = state;
+        cpu->idle.usage[state]++;
+        cpu->idle.enter = now;
+        cpu->idle.sleeping = 1;
+        asm volatile("mfence" ::
+                         : "memory");
+
+        // sti only enables interrupts after the next instruction, so an interrupt that arrives in between ends the wait instead of being handled before it
+        if (mwait_supported)
+        {
+            // A write to the monitored line after monitor ends mwait, so a wake flag written after the check below is not missed
+            asm volatile("monitor" ::"a"(&cpu->idle.wake), "c"(0), "d"(0)
+                         : "memory");
+            if (!cpu->idle.wake)
+                asm volatile("sti\n"
+                             "mwait" ::"a"(states[state].hint),
+                             "c"(0)
+                             : "memory");
+            else
+                asm volatile("sti" ::
+                                 : "memory");
+        }
+        else
+        {
+            asm volatile("sti\n"
+                         "hlt" ::
+                             : "memory");
+        }
+
+        // The interrupt that ended the wait has been handled now, if it was the scheduler interrupt it already called idle_exit
+        asm volatile("cli");
+        int woken = idle_exit(cpu, cpu_timestamp());
+        asm volatile("sti");
+        if (woken)
+            scheduler_yield();
+    }
+}
+
+void idle_debug()
+{
+    console_print("[idle] waiting using ");
+    console_print(mwait_supported ? "MWAIT, states" : "HLT, states");
+    for (int i = 0; i < state_count; i++)
+    {
+        console_print(" ");
+        console_print(states[i].name);
+    }
+    console_new_line();
+
+    struct cpu *cpu = 0;
+    while (cpu = cpu_iterate(cpu))
+    {
+        console_print("[idle] cpu ");
+        console_print_u64(cpu->id, 10);
+        console_print(":");
+        for (int i = 0; i < state_count; i++)
+        {
+            console_print(" ");
+            console_print(states[i].name);
+            console_print(" ");
+            console_print_u64(cpu->idle.usage[i], 10);
+            console_print(" times ");
+            console_print_u64(time_cycles_to_ns(cpu->idle.residency[i]) / 1000ul, 10);
+            console_print(" us,");
+        }
+        console_print(" ");
+        console_print_u64(cpu->idle.wakeups, 10);
+        console_print(" wake ups (");
+        console_print_u64(cpu->idle.flag_wakeups, 10);
+        console_print(" without interrupt) of ");
+        console_print_u64(cpu->idle.wakeups ? time_cycles_to_ns(cpu->idle.wakeup_cycles / cpu->idle.wakeups) : 0, 10);
+        console_print(" ns on average\n");
+    }
+}
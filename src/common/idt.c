@@ -179,6 +179,14 @@ static void idt_handle_page_fault(struct idt_stack_frame *frame, unsigned long e
                  :);
     // When a page fault happens, the error code (which contains how the page fault happened), is pushed onto the stack by the processor.
     // Note: only interrupt vectors 8, 10, 11, 12, 13, 14, 17 push an error code onto the stack
+
+    // Pages of on demand and copy-on-write mappings are created here, the faulting instruction is retried after returning
+    struct cpu *cpu = cpu_get_current();
+    if (cpu->current_process && paging_handle_fault(&cpu->current_process->paging_context, (void *)fault_address, error_code))
+    {
+        return;
+    }
+
     console_print("interrupt: page fault! process at 0x");
     console_print_u64(frame->instruction_pointer, 16);
     console_print(" tried to access 0x");
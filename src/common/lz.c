@@ -0,0 +1,160 @@
+#include "kokos/lz.h"
+
+static inline unsigned int lz_read32(const unsigned char *pointer)
+{
+    return (unsigned int)pointer[0] | ((unsigned int)pointer[1] << 8) | ((unsigned int)pointer[2] << 16) | ((unsigned int)pointer[3] << 24);
+}
+
+// Hashes 4 bytes to an index into the hash table (Knuth's multiplicative hash)
+static inline unsigned int lz_hash(unsigned int sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the extra length bytes of a length that did not fit in the token, returns 0 if there is no room in the output
+static int lz_write_length(unsigned long length, unsigned char *output, unsigned long *output_index, unsigned long output_capacity)
+{
+    while (1)
+    {
+        if (*output_index >= output_capacity)
+            return 0;
+
+        if (length >= 255)
+        {
+            output[(*output_index)++] = 255;
+            length -= 255;
+        }
+        else
+        {
+            output[(*output_index)++] = length;
+            return 1;
+        }
+    }
+}
+
+// Writes a sequence of literal_count literals followed by a match, a match_length of 0 means no match (the last sequence)
+static int lz_write_sequence(const unsigned char *literals, unsigned long literal_count, unsigned long offset, unsigned long match_length, unsigned char *output, unsigned long *output_index, unsigned long output_capacity)
+{
+    if (*output_index >= output_capacity)
+        return 0;
+
+    unsigned long match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+    unsigned long token_index = (*output_index)++;
+    output[token_index] = ((literal_count >= 15 ? 15 : literal_count) << 4) | (match_code >= 15 ? 15 : match_code);
+
+    if (literal_count >= 15 && !lz_write_length(literal_count - 15, output, output_index, output_capacity))
+        return 0;
+
+    if (*output_index + literal_count > output_capacity)
+        return 0;
+    for (unsigned long i = 0; i < literal_count; i++)
+        output[(*output_index)++] = literals[i];
+
+    if (!match_length)
+        return 1;
+
+    if (*output_index + 2 > output_capacity)
+        return 0;
+    output[(*output_index)++] = offset & 0xFF;
+    output[(*output_index)++] = offset >> 8;
+
+    if (match_code >= 15 && !lz_write_length(match_code - 15, output, output_index, output_capacity))
+        return 0;
+    return 1;
+}
+
+unsigned long lz_compress(const unsigned char *input, unsigned long input_size, unsigned char *output, unsigned long output_capacity)
+{
+    // Positions + 1 of the last occurrence of each hash, 0 means empty
+    unsigned short table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        table[i] = 0;
+
+    unsigned long output_index = 0;
+    unsigned long anchor = 0;
+    unsigned long position = 0;
+    while (position + LZ_MIN_MATCH <= input_size)
+    {
+        unsigned int sequence = lz_read32(input + position);
+        unsigned int hash = lz_hash(sequence);
+        unsigned long candidate = table[hash];
+        table[hash] = position + 1;
+
+        if (!candidate || position - (candidate - 1) > LZ_MAX_OFFSET || lz_read32(input + candidate - 1) != sequence)
+        {
+            position++;
+            continue;
+        }
+
+        // Extend the match as far as possible
+        unsigned long match = candidate - 1;
+        unsigned long length = LZ_MIN_MATCH;
+        while (position + length < input_size && input[match + length] == input[position + length])
+            length++;
+
+        if (!lz_write_sequence(input + anchor, position - anchor, position - match, length, output, &output_index, output_capacity))
+            return 0;
+
+        position += length;
+        anchor = position;
+    }
+
+    // The remaining bytes are stored as literals
+    if (!lz_write_sequence(input + anchor, input_size - anchor, 0, 0, output, &output_index, output_capacity))
+        return 0;
+    return output_index;
+}
+
+// Reads the extra length bytes of a length in a token, returns 0 if the input ends
+static int lz_read_length(const unsigned char *input, unsigned long input_size, unsigned long *input_index, unsigned long *length)
+{
+    unsigned char value;
+    do
+    {
+        if (*input_index >= input_size)
+            return 0;
+        value = input[(*input_index)++];
+        *length += value;
+    } while (value == 255);
+    return 1;
+}
+
+unsigned long lz_decompress(const unsigned char *input, unsigned long input_size, unsigned char *output, unsigned long output_capacity)
+{
+    unsigned long input_index = 0;
+    unsigned long output_index = 0;
+    while (input_index < input_size)
+    {
+        unsigned char token = input[input_index++];
+
+        unsigned long literal_count = token >> 4;
+        if (literal_count == 15 && !lz_read_length(input, input_size, &input_index, &literal_count))
+            return 0;
+        if (input_index + literal_count > input_size || output_index + literal_count > output_capacity)
+            return 0;
+        for (unsigned long i = 0; i < literal_count; i++)
+            output[output_index++] = input[input_index++];
+
+        // The last sequence has no match
+        if (input_index >= input_size)
+            break;
+
+        if (input_index + 2 > input_size)
+            return 0;
+        unsigned long offset = input[input_index] | ((unsigned long)input[input_index + 1] << 8);
+        input_index += 2;
+
+        unsigned long length = token & 0xF;
+        if (length == 15 && !lz_read_length(input, input_size, &input_index, &length))
+            return 0;
+        length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > output_index || output_index + length > output_capacity)
+            return 0;
+
+        // The match can overlap with the bytes that are being written, so copy byte by byte
+        for (unsigned long i = 0; i < length; i++, output_index++)
+            output[output_index] = output[output_index - offset];
+    }
+    return output_index;
+}
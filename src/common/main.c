@@ -6,6 +6,8 @@
 #include "kokos/keyboard.h"
 #include "kokos/apic.h"
 #include "kokos/paging.h"
+#include "kokos/paging_merge.h"
+#include "kokos/paging_swap.h"
 #include "kokos/multiboot2.h"
 #include "kokos/memory_physical.h"
 #include "kokos/idt.h"
@@ -14,6 +16,8 @@
 #include "kokos/port.h"
 #include "kokos/serial.h"
 #include "kokos/scheduler.h"
+#include "kokos/time.h"
+#include "kokos/fpu_test.h"
 
 #define uint8 unsigned char
 #define int8 signed char
@@ -30,8 +34,10 @@
 
 extern volatile unsigned long page_table_level4[512];
 extern void(cpu_startup16)();
-unsigned short cpu_startup_increment = 0;
+volatile unsigned short cpu_startup_increment = 0;
 unsigned short cpu_startup_done = 0;
+// The level 4 table that application processors use until cpu_initialize created their own, see cpu_entrypoint
+unsigned long *cpu_startup_page_table = 0;
 
 unsigned long max_memory_address;
 struct ioapic *ioapic;
@@ -110,8 +116,7 @@ void test_program()
         console_print("[program1] add counter = ");
         console_print_u64(counter, 10);
         console_new_line();
-        for (int i = 0; i < 100; i++)
-            cpu_wait_millisecond();
+        scheduler_sleep(100000000ul); // 100 ms
         counter++;
     }
 }
@@ -125,8 +130,7 @@ void test_program2()
         console_print("[program2] mul counter = ");
         console_print_u64(counter, 10);
         console_new_line();
-        for (int i = 0; i < 100; i++)
-            cpu_wait_millisecond();
+        scheduler_sleep(100000000ul); // 100 ms
 
         counter *= 2;
         if (counter >= 1ul << 63)
@@ -145,17 +149,222 @@ void test_program3()
         console_print("[program3] add123 counter = ");
         console_print_u64(counter, 10);
         console_new_line();
-        for (int i = 0; i < 100; i++)
-            cpu_wait_millisecond();
+        scheduler_sleep(100000000ul); // 100 ms
         counter += 123;
     }
 }
 
+void test_deadline_program()
+{
+    console_print("[deadline] start\n");
+    unsigned long jobs = 0;
+    while (1)
+    {
+        // Simulate polling a device, then wait for the next period
+        for (int i = 0; i < 100; i++)
+            cpu_wait_microsecond();
+        jobs++;
+        if (jobs % 1000 == 0)
+            scheduler_debug();
+        scheduler_wait_period();
+    }
+}
+
+// Maps memory on demand, reads it (which maps the zero page) and writes every other page (which copies it to a private page)
+void test_on_demand_program()
+{
+    console_print("[on demand test] start\n");
+    struct paging_context *context = &cpu_get_current()->current_process->paging_context;
+    unsigned long pages = 64;
+    unsigned long used_before = memory_physical_used_pages();
+    unsigned char *memory = paging_map(context, pages * 4096ul, PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_USER | PAGING_FLAG_ON_DEMAND);
+    if (!memory)
+    {
+        console_print("[on demand test] could not map\n");
+        while (1)
+            scheduler_sleep(1000000000ul);
+    }
+
+    int passed = 1;
+    for (unsigned long i = 0; i < pages * 4096ul; i++)
+    {
+        if (memory[i] != 0)
+            passed = 0;
+    }
+    // Other cpus allocate too, so this is only an indication that reads did not allocate
+    console_print("[on demand test] physical pages used by reading: ");
+    console_print_u64(memory_physical_used_pages() - used_before, 10);
+    console_new_line();
+
+    for (unsigned long page = 0; page < pages; page += 2)
+        memory_set(memory + page * 4096ul, 4096, (unsigned char)(page + 1));
+    for (unsigned long page = 0; page < pages; page++)
+    {
+        unsigned char expected = page % 2 == 0 ? (unsigned char)(page + 1) : 0;
+        for (unsigned long i = 0; i < 4096; i++)
+        {
+            if (memory[page * 4096ul + i] != expected)
+                passed = 0;
+        }
+    }
+
+    paging_unmap(context, memory, pages * 4096ul);
+    console_print(passed ? "[on demand test] passed\n" : "[on demand test] failed, memory did not contain what was written\n");
+    while (1)
+        scheduler_sleep(1000000000ul);
+}
+
+// Fills mergeable pages with the same contents, waits until the merge worker shared them and checks that writing one page does not change the others
+void test_merge_program()
+{
+    console_print("[merge test] start\n");
+    struct paging_context *context = &cpu_get_current()->current_process->paging_context;
+    unsigned long pages = 32;
+    unsigned char *memory = paging_map(context, pages * 4096ul, PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_USER | PAGING_FLAG_MERGEABLE);
+    if (!memory)
+    {
+        console_print("[merge test] could not map\n");
+        while (1)
+            scheduler_sleep(1000000000ul);
+    }
+
+    for (unsigned long page = 0; page < pages; page++)
+        memory_set(memory + page * 4096ul, 4096, 0x5A);
+
+    // A page is merged in the scan after the one that saw its hash first
+    scheduler_sleep(PAGING_MERGE_INTERVAL * 3ul * 1000000ul);
+    paging_merge_debug();
+
+    // Merged pages of this mapping share the physical page of the first page
+    void *shared_page = paging_get_physical_address(context, memory);
+    unsigned long merged = 0;
+    for (unsigned long page = 1; page < pages; page++)
+    {
+        if (shared_page && paging_get_physical_address(context, memory + page * 4096ul) == shared_page)
+            merged++;
+    }
+    console_print("[merge test] pages sharing the first page: ");
+    console_print_u64(merged, 10);
+    console_new_line();
+
+    // The first write to a merged page copies it
+    memory_set(memory, 4096, 0xA5);
+    int passed = merged > 0;
+    for (unsigned long page = 0; page < pages; page++)
+    {
+        unsigned char expected = page == 0 ? 0xA5 : 0x5A;
+        for (unsigned long i = 0; i < 4096; i++)
+        {
+            if (memory[page * 4096ul + i] != expected)
+                passed = 0;
+        }
+    }
+
+    paging_unmap(context, memory, pages * 4096ul);
+    console_print(passed ? "[merge test] passed\n" : "[merge test] failed, no page was merged or a write changed another merged page\n");
+    while (1)
+        scheduler_sleep(1000000000ul);
+}
+
+// Writes swappable pages, swaps them out (memory rarely runs low in QEMU, so it does not wait for the swap worker) and checks that they are loaded back unchanged
+void test_swap_program()
+{
+    console_print("[swap test] start\n");
+    struct paging_context *context = &cpu_get_current()->current_process->paging_context;
+    unsigned long pages = 16;
+    unsigned char *memory = paging_map(context, pages * 4096ul, PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_USER | PAGING_FLAG_SWAPPABLE);
+    if (!memory)
+    {
+        console_print("[swap test] could not map\n");
+        while (1)
+            scheduler_sleep(1000000000ul);
+    }
+
+    for (unsigned long page = 0; page < pages; page++)
+    {
+        for (unsigned long i = 0; i < 4096; i++)
+            memory[page * 4096ul + i] = (unsigned char)(page * 7 + i / 64);
+    }
+
+    // Let the swap worker start and age the pages
+    scheduler_sleep(PAGING_SWAP_INTERVAL * 2ul * 1000000ul);
+    // The reclaim can pick pages of any process, only the swapped out pages of this mapping (which have no physical address) count
+    paging_swap_reclaim(pages);
+    unsigned long swapped = 0;
+    for (unsigned long page = 0; page < pages; page++)
+    {
+        if (!paging_get_physical_address(context, memory + page * 4096ul))
+            swapped++;
+    }
+    console_print("[swap test] swapped out ");
+    console_print_u64(swapped, 10);
+    console_print(" pages of the mapping\n");
+
+    // Every access to a swapped out page faults and decompresses it
+    int passed = swapped > 0;
+    for (unsigned long page = 0; page < pages; page++)
+    {
+        for (unsigned long i = 0; i < 4096; i++)
+        {
+            if (memory[page * 4096ul + i] != (unsigned char)(page * 7 + i / 64))
+                passed = 0;
+        }
+    }
+    paging_swap_debug();
+
+    paging_unmap(context, memory, pages * 4096ul);
+    console_print(passed ? "[swap test] passed\n" : "[swap test] failed, no page was swapped out or a page changed while it was swapped out\n");
+    while (1)
+        scheduler_sleep(1000000000ul);
+}
+
+// Checks that the SSE registers of a thread survive being preempted by another thread that uses them, see fpu_test.h
+void test_fpu_program()
+{
+    console_print("[fpu test] start\n");
+    unsigned long failures = 0;
+    for (int round = 0; round < 100; round++)
+    {
+        // 20 ms is longer than the slice of 2 busy threads on one cpu, so the other thread runs while the registers are loaded
+        if (!fpu_test_registers(cpu_timestamp(), time_ns_to_cycles(20000000ul)))
+            failures++;
+    }
+    console_print(failures ? "[fpu test] failed, xmm registers changed in " : "[fpu test] passed, xmm registers changed in ");
+    console_print_u64(failures, 10);
+    console_print(" of 100 rounds\n");
+
+    // Threads cannot exit
+    while (1)
+        scheduler_sleep(1000000000ul);
+}
+
 void root_program()
 {
     // scheduler_execute(&test_program);
     // scheduler_execute(&test_program2);
     // scheduler_execute(&test_program3);
+    // scheduler_execute_deadline(&test_deadline_program, 200000ul, 1000000ul);
+    // scheduler_set_isolated(CPU_MASK(1));
+    // scheduler_execute_on(CPU_MASK(1), &test_program);
+
+    // scheduler_execute(&test_on_demand_program);
+    // scheduler_execute(&test_merge_program);
+    // scheduler_execute(&test_swap_program);
+
+    // Both FPU test processes run on this cpu, so they take the FPU registers from each other
+    // scheduler_execute_on(CPU_MASK(cpu_get_current()->id), &test_fpu_program);
+    // scheduler_execute_on(CPU_MASK(cpu_get_current()->id), &test_fpu_program);
+
+    // The workers go through the address spaces of all processes and do not need one of their own, so they run as kernel threads
+
+    // Collapse fully populated page tables of processes into 2MiB pages in the background
+    scheduler_execute_kernel(&paging_promote_worker);
+
+    // Merge identical pages of PAGING_FLAG_MERGEABLE mappings in the background
+    scheduler_execute_kernel(&paging_merge_worker);
+
+    // Compress cold pages of PAGING_FLAG_SWAPPABLE mappings when physical memory runs low
+    scheduler_execute_kernel(&paging_swap_worker);
 
     idt_debug();
     gdt_debug();
@@ -174,6 +383,10 @@ void root_program()
     console_print("[cpu] all programs started\n");
 }
 
+static void kernel_start();
+static void kernel_boot();
+static void kernel_initialize_processors();
+
 void kernel_main()
 {
     console_clear();
@@ -239,8 +452,8 @@ void kernel_main()
     console_new_line();
 
     // Find first memory region that can fit allocation table
-    // Each bit (8 per byte) in the allocation will determine if a memory region of 4096 bytes is taken or not
-    unsigned long allocation_table_size = max_memory_address / 4096 / 8;
+    // Each bit (8 per byte) in the allocation will determine if a memory region of 4096 bytes is taken or not, it is followed by information about every page
+    unsigned long allocation_table_size = memory_physical_table_size(max_memory_address);
 
     console_print("[physical memory] allocation_table_size = ");
     console_print_u64(allocation_table_size, 10);
@@ -327,8 +540,30 @@ void kernel_main()
 
     console_print("[cpu] initialize cpu context\n");
 
-    cpu_initialize(root_program);
+    cpu_initialize(kernel_start);
+}
+
+// Continues booting in a kernel thread, so it is scheduled like the other threads and can block. The idle thread of the boot processor only idles
+static void kernel_boot()
+{
+    kernel_initialize_processors();
+    root_program();
+
+    // Threads cannot exit yet
+    while (1)
+        scheduler_sleep(1000000000ul);
+}
 
+// Called by cpu_initialize on the new stack of the boot processor, before it continues as its idle thread
+static void kernel_start()
+{
+    if (!scheduler_execute_kernel(&kernel_boot))
+        cpu_panic("could not start boot thread\n");
+}
+
+// Finds the IO APIC and the other processors using ACPI and starts the other processors
+static void kernel_initialize_processors()
+{
     // for (int i = 0; i < 3; i++)
     // {
     //     console_print("[paging] identity test: 0x");
@@ -394,6 +629,9 @@ void kernel_main()
         return;
     }
 
+    // Measure the time stamp counter before the other processors start, they calibrate their scheduler timer against it
+    time_initialize(rsdt);
+
     struct acpi_dsdt *dsdt = (struct acpi_dsdt *)fadt->dsdt;
     if (!dsdt)
     {
@@ -498,7 +736,7 @@ void kernel_main()
 
         if (ioapic == 0)
         {
-            ioapic = (struct ioapic *)paging_map_physical(&cpu->current_process->paging_context, (void *)current_ioapic->io_apic_address, sizeof(struct ioapic), PAGING_FLAG_READ | PAGING_FLAG_WRITE);
+            ioapic = (struct ioapic *)paging_map_physical(&cpu->current_process->paging_context, (void *)current_ioapic->io_apic_address, sizeof(struct ioapic), PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_UNCACHED);
 
             console_print("[ioapic] version: ");
             console_print_u64(apic_io_get_version(ioapic), 10);
@@ -534,6 +772,9 @@ void kernel_main()
 
     console_clear();
 
+    // The started processors use the address space of this processor until they created their own
+    cpu_startup_page_table = cpu->current_process->paging_context.level4_table;
+
     struct acpi_madt_entry_local_apic *current_processor = 0;
     while (current_processor = acpi_madt_iterate_type(madt, current_processor, ACPI_MADT_TYPE_LOCAL_APIC))
     {
@@ -574,6 +815,7 @@ void kernel_main()
         apic->interrupt_command1 = current_processor->apic_id << 24;
         apic->interrupt_command0 = (0b1 << 14) | (0b110 << 8) | cpu_startup_vector;
 
+        // Processors are started one at a time because they share the startup stack in cpu.asm, wait until it switched to its own stack
         while (!cpu_startup_increment)
         {
             asm volatile("pause");
@@ -585,14 +827,9 @@ void kernel_main()
 
     cpu_startup_done = 1;
 
-    // console_print("[smp] started all processors in a halted state\n");
-
-    asm volatile("sti");
-
-    while (1)
-    {
-        asm volatile("hlt");
-    }
+    console_print("[smp] started all processors\n");
+    cpu_topology_debug();
+    return;
 
     // Enable APIC
     // apic->spurious_interrupt_vector = 0x1FF;
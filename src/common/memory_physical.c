@@ -1,6 +1,8 @@
 #include "kokos/memory_physical.h"
 #include "kokos/console.h"
 #include "kokos/lock.h"
+#include "kokos/util.h"
+#include "kokos/memory.h"
 
 // Points to a table that contains bits that indicate which physical chunks are allocated
 static unsigned long *allocation_table = 0;
@@ -9,9 +11,22 @@ static unsigned long allocation_index = 0;
 // The amount of unsigned long entries in the allocation table
 static unsigned long allocation_table_length = 0;
 static unsigned long used_physical_pages = 0;
+// Points to an array that contains information about every physical page, it is stored directly after the allocation table
+static struct memory_physical_page *pages = 0;
+// The amount of entries in pages
+static unsigned long pages_length = 0;
 
 static int memory_lock = 0;
 
+// Called when no physical memory is available, see memory_physical_set_reclaim
+static unsigned long (*reclaim_function)(unsigned long pages) = 0;
+
+unsigned long memory_physical_table_size(unsigned long total_memory)
+{
+    // Can store 8 bytes in each allocation table entry
+    return (total_memory / 4096) / 64 * sizeof(unsigned long) + (total_memory / 4096) * sizeof(struct memory_physical_page);
+}
+
 void memory_physical_initialize(void *allocation_table_location, unsigned long total_memory)
 {
     allocation_table = allocation_table_location;
@@ -24,6 +39,20 @@ void memory_physical_initialize(void *allocation_table_location, unsigned long t
     {
         allocation_table[i] = 0;
     }
+
+    pages = (struct memory_physical_page *)&allocation_table[allocation_table_length];
+    pages_length = total_memory / 4096;
+    memory_zero(pages, pages_length * sizeof(struct memory_physical_page));
+}
+
+struct memory_physical_page *memory_physical_get_page(void *physical_address)
+{
+    unsigned long index = ((unsigned long)physical_address) >> 12;
+    if (index >= pages_length)
+    {
+        return 0;
+    }
+    return &pages[index];
 }
 
 void memory_physical_reserve(void *physical_address, unsigned long bytes)
@@ -52,9 +81,9 @@ void memory_physical_reserve(void *physical_address, unsigned long bytes)
         unsigned char bit = index & 0b111111;
 
         // Set bit bit of allocation_table[byte] to one
-        if (!(allocation_table[byte] & (1 << bit)))
+        if (!(allocation_table[byte] & (1ul << bit)))
         {
-            allocation_table[byte] |= 1 << bit;
+            allocation_table[byte] |= 1ul << bit;
             used_physical_pages++;
         }
     }
@@ -84,9 +113,9 @@ void memory_physical_free(void *physical_address)
     }
 
     // Set bit bit of allocation_table[byte] to zero
-    if (allocation_table[byte] & (1 << bit))
+    if (allocation_table[byte] & (1ul << bit))
     {
-        allocation_table[byte] &= ~(1 << bit);
+        allocation_table[byte] &= ~(1ul << bit);
         used_physical_pages--;
     }
     else
@@ -99,16 +128,23 @@ void memory_physical_free(void *physical_address)
     lock_release(&memory_lock);
 }
 
-void *memory_physical_allocate()
+// Tries to allocate a single page, returns 0 when all pages are in use
+static void *memory_physical_try_allocate()
 {
     lock_acquire(&memory_lock);
 
-    // TODO this is infinite loop when no memory is available
     // Find first empty spot where a single bit is 0 (0xFFFFFFFFFFFFFFFFull represents all bits set to 1)
     // This will scan 64 pages per iterations for a spot (262144 bytes) (~30000 iterations worst case, when all ram is used on a 16gb pc)
+    // Every entry is checked at most once, so this stops when no memory is available
     unsigned long spot = allocation_index;
+    unsigned long checked = 0;
     while (allocation_table[spot] == 0xFFFFFFFFFFFFFFFFull)
     {
+        if (++checked >= allocation_table_length)
+        {
+            lock_release(&memory_lock);
+            return 0;
+        }
         if (++spot >= allocation_table_length)
         {
             spot = 0;
@@ -136,7 +172,7 @@ void *memory_physical_allocate()
     }
 
     // Set bit bit of allocation_table[spot] to zero
-    allocation_table[spot] |= 1 << bit;
+    allocation_table[spot] |= 1ul << bit;
     allocation_index = spot;
     used_physical_pages++;
 
@@ -145,48 +181,132 @@ void *memory_physical_allocate()
     return (void *)((((spot << 6) + bit) << 12));
 }
 
+void *memory_physical_allocate()
+{
+    void *page = memory_physical_try_allocate();
+    if (page)
+    {
+        return page;
+    }
+
+    // Ask the reclaim function to free some memory (by swapping out pages) and try again
+    if (reclaim_function && reclaim_function(MEMORY_PHYSICAL_RECLAIM_PAGES))
+    {
+        page = memory_physical_try_allocate();
+        if (page)
+        {
+            return page;
+        }
+    }
+
+    console_print("warning: memory_physical_allocate out of physical memory\n");
+    return 0;
+}
+
+void memory_physical_set_reclaim(unsigned long (*reclaim)(unsigned long pages))
+{
+    reclaim_function = reclaim;
+}
+
+unsigned long memory_physical_total_pages()
+{
+    return pages_length;
+}
+
 void *memory_physical_allocate_consecutive(unsigned long pages)
 {
     lock_acquire(&memory_lock);
 
-    // TODO this is infinite loop when no memory is available
-    unsigned long chunk_count = pages >> 6;
-    unsigned long spot = allocation_index;
-    unsigned int consecutive = 0;
+    // Each allocation table entry describes 64 pages, only whole entries are handed out
+    unsigned long chunk_count = ((pages - 1) >> 6) + 1;
+
+    // Align the chunk to its own size when it is a power of two, this makes sure a 2MiB chunk can be used as a 2MiB page
+    unsigned long alignment = (chunk_count & (chunk_count - 1)) == 0 ? chunk_count : 1;
+
+    if (chunk_count > allocation_table_length)
+    {
+        lock_release(&memory_lock);
+        return 0;
+    }
+
+    unsigned long spot = ALIGN_TO_NEXT(allocation_index, alignment);
+    if (spot + chunk_count > allocation_table_length)
+    {
+        spot = 0;
+    }
+
+    // Scan every aligned spot at most once, instead of looping forever when no memory is available
+    unsigned long start = spot;
     while (1)
     {
-        if (allocation_table[spot] == 0)
+        unsigned long consecutive = 0;
+        while (consecutive < chunk_count && allocation_table[spot + consecutive] == 0)
         {
-            if (++consecutive >= chunk_count)
-            {
-                spot -= consecutive - 1;
-                break;
-            }
+            consecutive++;
         }
-        else
+
+        if (consecutive >= chunk_count)
         {
-            consecutive = 0;
+            break;
         }
 
-        if (++spot >= allocation_table_length)
+        spot += alignment;
+        if (spot + chunk_count > allocation_table_length)
         {
             spot = 0;
-            consecutive = 0;
+        }
+
+        if (spot == start)
+        {
+            lock_release(&memory_lock);
+            console_print("warning: memory_physical_allocate_consecutive could not find ");
+            console_print_u64(pages, 10);
+            console_print(" free consecutive pages\n");
+            return 0;
         }
     }
 
     // Set all 'taken' flags
-    for (unsigned int i = 0; i < chunk_count; i++)
+    for (unsigned long i = 0; i < chunk_count; i++)
     {
         allocation_table[spot + i] = 0xFFFFFFFFFFFFFFFFull;
     }
 
+    used_physical_pages += chunk_count << 6;
+    allocation_index = spot + chunk_count;
+    if (allocation_index >= allocation_table_length)
+    {
+        allocation_index = 0;
+    }
+
     lock_release(&memory_lock);
 
-    allocation_index = spot + chunk_count;
     return (void *)(((spot << 6) << 12));
 }
 
+void memory_physical_free_consecutive(void *physical_address, unsigned long pages)
+{
+    lock_acquire(&memory_lock);
+
+    unsigned long spot = ((unsigned long)physical_address) >> 18;
+    unsigned long chunk_count = ((pages - 1) >> 6) + 1;
+
+    if (((unsigned long)physical_address & 0x3FFFFul) || spot + chunk_count > allocation_table_length)
+    {
+        lock_release(&memory_lock);
+        console_print("warning: invalid address passed to memory_physical_free_consecutive\n");
+        return;
+    }
+
+    for (unsigned long i = 0; i < chunk_count; i++)
+    {
+        allocation_table[spot + i] = 0;
+    }
+    used_physical_pages -= chunk_count << 6;
+
+    lock_release(&memory_lock);
+}
+
 int memory_physical_allocated(void *phyisical_address)
 {
     unsigned long index = ((unsigned long)phyisical_address) >> 12;
@@ -4,9 +4,22 @@
 #include "kokos/util.h"
 #include "kokos/memory.h"
 #include "kokos/memory_physical.h"
+#include "kokos/lock.h"
+#include "kokos/paging_merge.h"
+#include "kokos/paging_swap.h"
 
 static unsigned long used_virtual_pages = 0;
 static int hugepages_supported = 0;
+static int no_execute_supported = 0;
+static int global_pages_supported = 0;
+static int pat_supported = 0;
+// A page filled with zeroes, mapped read-only by read faults in PAGING_FLAG_ON_DEMAND mappings
+static void *zero_page = 0;
+
+// Statistics of the huge page promotion scanner, see paging_promote
+static unsigned long promote_scanned_tables = 0;
+static unsigned long promote_collapsed_tables = 0;
+static unsigned long promote_failed = 0;
 
 static inline void paging_clear_table(unsigned long *table)
 {
@@ -16,176 +29,311 @@ static inline void paging_clear_table(unsigned long *table)
     }
 }
 
-int paging_get_hugepages_supported()
+// Returns the physical address an entry of a table of level level points to, the low bits of a huge page entry can contain the PAT bit
+static inline unsigned long paging_entry_address(unsigned long entry, int level)
 {
-    return hugepages_supported != 0;
+    return entry & PAGING_ADDRESS_MASK & ~(PAGING_LEVEL_SIZE(level) - 1);
 }
 
-void paging_initialize()
+// Converts the flags of a 4KiB page entry to the flags of a 2MiB or 1GiB page entry, the PAT bit is at another position in huge page entries
+static inline unsigned long paging_entry_flags_to_huge(unsigned long flags)
 {
-    // Each table has 512 other tables, there are 4 types of nested tables
-    used_virtual_pages = 0;
+    if (flags & PAGING_ENTRY_FLAG_PAT)
+        flags |= PAGING_ENTRY_FLAG_HUGE_PAT;
+    return flags | PAGING_ENTRY_FLAG_SIZE;
+}
 
-    // Check if hugepages is supported using cpuid
-    // https://kokos.run/#WzAsIkFNRDY0Vm9sdW1lMy5wZGYiLDY1NCxbNjU0LDg0LDY1NCw4NF1d
-    struct cpu_id_result result = cpu_id(0x80000001);
-    hugepages_supported = result.edx & CPU_ID_1GB_PAGES_EDX;
+// Converts the flags of a 2MiB page entry to the flags of a 4KiB page entry
+static inline unsigned long paging_entry_flags_from_huge(unsigned long flags)
+{
+    flags &= ~PAGING_ENTRY_FLAG_SIZE;
+    if (flags & PAGING_ENTRY_FLAG_HUGE_PAT)
+        flags = (flags & ~PAGING_ENTRY_FLAG_HUGE_PAT) | PAGING_ENTRY_FLAG_PAT;
+    return flags;
 }
 
-// Updates the paging index so that it points to a spot where x sequential bytes of virtual memory can be allocated
-static int paging_index_find_spot(struct paging_context *index, unsigned long bytes, unsigned long flags)
+// Sets an entry in a page table and keeps the amount of non-empty entries in the table up to date, see struct memory_physical_page
+static inline void paging_set_entry(unsigned long *table, unsigned int index, unsigned long entry)
 {
-    if (bytes <= 0)
+    if (!table[index] && entry)
+    {
+        memory_physical_get_page(table)->table_entries++;
+    }
+    else if (table[index] && !entry)
     {
+        memory_physical_get_page(table)->table_entries--;
+    }
+    table[index] = entry;
+}
+
+// Allocates an empty page table and stores it at index in parent_table, returns 0 if there is no physical memory left
+static unsigned long *paging_create_table(unsigned long *parent_table, unsigned int index)
+{
+    unsigned long *table = memory_physical_allocate();
+    if (!table)
         return 0;
+    paging_clear_table(table);
+    memory_physical_get_page(table)->table_entries = 0;
+    paging_set_entry(parent_table, index, (unsigned long)table | PAGING_TABLE_ENTRY_FLAGS);
+    return table;
+}
+
+// Removes the cached translations of context from the TLB, if context is the current address space of this cpu
+static void paging_flush(struct paging_context *context)
+{
+    unsigned long current_level4_table;
+    asm volatile("mov %0, cr3"
+                 : "=r"(current_level4_table));
+    if ((current_level4_table & PAGING_ADDRESS_MASK) == (unsigned long)context->level4_table)
+    {
+        asm volatile("mov cr3, %0" ::"r"(current_level4_table)
+                     : "memory");
     }
+}
 
-    // If less than 2MiB is being allocated, it can fit in a single level1 table
-    if (bytes <= 512ul * 4096ul && index->level2_table != 0 && !(flags & PAGING_FLAG_1GB))
+// Removes all cached translations from the TLB of this cpu, including global pages, which stay cached when cr3 is written
+static void paging_flush_global()
+{
+    unsigned long cr4;
+    asm volatile("mov %0, cr4"
+                 : "=r"(cr4));
+    if (cr4 & CPU_CR4_GLOBAL_PAGES)
     {
-        // Check if it still fits in the current level1 table
-        unsigned long pages = ((bytes - 1) >> 12) + 1;
-        if (index->level1_index + pages > 512ul || index->level1_table == 0)
-        {
-            // Does not fit anymore in current level1 table, find and allocate next empty level1 table
-            while (index->level2_table[index->level2_index])
-            {
-                if (++index->level2_index >= 512ul)
-                {
-                    if (++index->level3_index >= 512ul)
-                    {
-                        if (++index->level4_index >= 512ul)
-                        {
-                            index->level4_index = 0;
-                        }
-
-                        index->level3_index = 0;
-                        index->level3_table = (unsigned long *)(index->level4_table[index->level4_index] & PAGING_ADDRESS_MASK);
-                        if (!index->level3_table)
-                        {
-                            index->level3_table = memory_physical_allocate();
-                            memory_zero(index->level3_table, 4096ul);
-                            index->level4_table[index->level4_index] = (unsigned long)index->level3_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
-                        }
-                    }
-
-                    index->level2_index = 0;
-                    index->level2_table = (unsigned long *)(index->level3_table[index->level3_index] & PAGING_ADDRESS_MASK);
-                    if (!index->level2_table)
-                    {
-                        index->level2_table = memory_physical_allocate();
-                        memory_zero(index->level2_table, 4096ul);
-                        index->level3_table[index->level3_index] = (unsigned long)index->level2_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
-                    }
-                }
-            }
+        // Toggling the global pages bit flushes the whole TLB
+        asm volatile("mov cr4, %0" ::"r"(cr4 & ~CPU_CR4_GLOBAL_PAGES)
+                     : "memory");
+        asm volatile("mov cr4, %0" ::"r"(cr4)
+                     : "memory");
+    }
+    else
+    {
+        unsigned long cr3;
+        asm volatile("mov %0, cr3"
+                     : "=r"(cr3));
+        asm volatile("mov cr3, %0" ::"r"(cr3)
+                     : "memory");
+    }
+}
 
-            if (!(flags & PAGING_FLAG_2MB))
-            {
-                index->level1_index = 0;
-                index->level1_table = memory_physical_allocate();
-                memory_zero(index->level1_table, 4096ul);
-                index->level2_table[index->level2_index] = (unsigned long)index->level1_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
-            }
-        }
+// Removes the cached translations of start ... end of context from the TLB, if context is the current address space of this cpu
+// Small ranges are invalidated page by page, for larger ranges it is cheaper to flush the whole TLB
+static void paging_flush_range(struct paging_context *context, unsigned long start, unsigned long end)
+{
+    if (end - start > PAGING_FLUSH_PAGE_LIMIT * 4096ul)
+    {
+        paging_flush(context);
+        return;
     }
-    else if (bytes <= 512ul * 512ul * 4096ul && index->level3_table != 0)
+
+    unsigned long current_level4_table;
+    asm volatile("mov %0, cr3"
+                 : "=r"(current_level4_table));
+    if ((current_level4_table & PAGING_ADDRESS_MASK) == (unsigned long)context->level4_table)
     {
-        // Check 2th level table
-        unsigned long hugepages = ((bytes - 1) >> 21) + 1;
-        if (index->level2_index + hugepages > 512 || index->level2_table == 0)
+        for (unsigned long address = start; address < end; address += 4096ul)
         {
-            // Does not fit anymore in current level2 table, find and allocate next empty level2 table
-            while (index->level3_table[index->level3_index])
-            {
-                if (++index->level3_index >= 512ul)
-                {
-                    if (++index->level4_index >= 512ul)
-                    {
-                        index->level4_index = 0;
-                    }
-
-                    index->level3_index = 0;
-                    index->level3_table = (unsigned long *)(index->level4_table[index->level4_index] & PAGING_ADDRESS_MASK);
-                    if (!index->level3_table)
-                    {
-                        index->level3_table = memory_physical_allocate();
-                        memory_zero(index->level3_table, 4096ul);
-                        index->level4_table[index->level4_index] = (unsigned long)index->level3_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
-                    }
-                }
-            }
+            asm volatile("invlpg [%0]" ::"r"(address)
+                         : "memory");
+        }
+    }
+}
 
-            if (!(flags & PAGING_FLAG_1GB))
-            {
-                index->level2_index = 0;
-                index->level2_table = memory_physical_allocate();
-                memory_zero(index->level2_table, 4096ul);
-                index->level3_table[index->level3_index] = (unsigned long)index->level2_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
+// Returns 1 if cpu must flush its TLB after context changed, every cpu must flush when context is 0 (global pages changed)
+static inline int paging_shootdown_needed(struct cpu *cpu, struct paging_context *context)
+{
+    return !context || (cpu->current_process && &cpu->current_process->paging_context == context);
+}
 
-                if (!(flags & PAGING_FLAG_2MB))
-                {
-                    index->level1_index = 0;
-                    index->level1_table = memory_physical_allocate();
-                    memory_zero(index->level1_table, 4096ul);
-                    index->level2_table[index->level2_index] = (unsigned long)index->level1_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
-                }
-            }
-        }
+// Asks the other cpus that currently use context to flush their TLB and waits until they did.
+// When context is 0, every cpu flushes all its translations, including global pages
+static void paging_shootdown(struct paging_context *context)
+{
+    struct cpu *current_cpu = cpu_get_current();
+    unsigned char request = context ? PAGING_SHOOTDOWN_LOCAL : PAGING_SHOOTDOWN_GLOBAL;
+    unsigned long rflags = cpu_disable_interrupts();
+
+    // The changed page entries must be visible to the other cpus before they flush, a cpu that switches to context after this sees them
+    asm volatile("mfence" ::
+                     : "memory");
+
+    int sent = 0;
+    struct cpu *cpu = 0;
+    while (cpu = cpu_iterate(cpu))
+    {
+        if (cpu == current_cpu || !paging_shootdown_needed(cpu, context))
+            continue;
+
+        asm volatile("lock or byte ptr [%0], %1" ::"r"(&cpu->flush_request), "q"(request)
+                     : "memory");
+        cpu_send_interrupt(cpu, PAGING_SHOOTDOWN_VECTOR);
+        sent = 1;
     }
-    else if (bytes <= 512ul * 512ul * 512ul * 4096ul)
+
+    // Handle the requests of other cpus while waiting, they could be waiting for this cpu at the same time
+    cpu = 0;
+    while (sent && (cpu = cpu_iterate(cpu)))
     {
-        // Check 3th level table
-        unsigned long hugepages = ((bytes - 1) >> 30) + 1;
-        if (index->level3_index + hugepages > 512ul || index->level3_table == 0)
+        while (cpu != current_cpu && (cpu->flush_request & request))
         {
-            // Does not fit anymore in current level3 table, find and allocate next empty level3 table
-            while (index->level4_table[index->level4_index])
-            {
-                if (++index->level4_index >= 512ul)
-                {
-                    index->level4_index = 0;
-                }
-            }
+            paging_handle_shootdown();
+            asm volatile("pause");
+        }
+    }
 
-            index->level3_index = 0;
-            index->level3_table = memory_physical_allocate();
-            memory_zero(index->level3_table, 4096ul);
-            index->level4_table[index->level4_index] = (unsigned long)index->level3_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
+    cpu_restore_interrupts(rflags);
+}
 
-            if (!(flags & PAGING_FLAG_1GB))
-            {
-                index->level2_index = 0;
-                index->level2_table = memory_physical_allocate();
-                memory_zero(index->level2_table, 4096ul);
-                index->level3_table[index->level3_index] = (unsigned long)index->level2_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
+void paging_handle_shootdown()
+{
+    struct cpu *cpu = cpu_get_current();
+    unsigned char request = cpu->flush_request;
+    if (!request)
+        return;
 
-                if (!(flags & PAGING_FLAG_2MB))
-                {
-                    index->level1_index = 0;
-                    index->level1_table = memory_physical_allocate();
-                    memory_zero(index->level1_table, 4096ul);
-                    index->level2_table[index->level2_index] = (unsigned long)index->level1_table | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_PRESENT;
-                }
-            }
-        }
+    if (request & PAGING_SHOOTDOWN_GLOBAL)
+    {
+        paging_flush_global();
     }
     else
     {
-        // Check 4th level table
-        unsigned long hugepages = ((bytes - 1) >> 39) + 1;
-        if (index->level4_index + hugepages > 512ul)
-        {
-            // Does not fit anymore in current level4 table
-            console_print("[paging_index_find_spot] exceeded available virtual memory\n");
-            return 0;
-        }
+        unsigned long cr3;
+        asm volatile("mov %0, cr3"
+                     : "=r"(cr3));
+        asm volatile("mov cr3, %0" ::"r"(cr3)
+                     : "memory");
     }
-    return 1;
+
+    // Only clear the handled requests, other cpus could have sent new ones meanwhile
+    asm volatile("lock and byte ptr [%0], %1" ::"r"(&cpu->flush_request), "q"((unsigned char)~request)
+                 : "memory");
+}
+
+ATTRIBUTE_INTERRUPT
+static void paging_interrupt_shootdown(struct idt_stack_frame *frame)
+{
+    paging_handle_shootdown();
+    CPU_APIC->end_of_interrupt = 0;
+}
+
+unsigned long paging_lock(int *lock)
+{
+    unsigned long rflags = cpu_disable_interrupts();
+    while (!lock_try_acquire(lock))
+    {
+        // The cpu that holds the lock could be waiting until this cpu flushed its TLB
+        paging_handle_shootdown();
+        asm volatile("pause");
+    }
+    return rflags;
+}
+
+int paging_try_lock(int *lock, unsigned long *rflags)
+{
+    *rflags = cpu_disable_interrupts();
+    if (lock_try_acquire(lock))
+        return 1;
+
+    cpu_restore_interrupts(*rflags);
+    return 0;
+}
+
+void paging_unlock(int *lock, unsigned long rflags)
+{
+    lock_release(lock);
+    cpu_restore_interrupts(rflags);
+}
+
+// Removes the translations of start ... end from the translation cache of context, see paging_get_physical_address
+static void paging_translation_invalidate(struct paging_context *context, unsigned long start, unsigned long end)
+{
+    start &= ~0xFFFul;
+    if (end - start > PAGING_TRANSLATION_CACHE_SIZE * 4096ul)
+    {
+        // Every cached page could be in the range
+        for (unsigned int i = 0; i < PAGING_TRANSLATION_CACHE_SIZE; i++)
+            context->translations[i].virtual_page = PAGING_TRANSLATION_INVALID;
+        return;
+    }
+
+    for (unsigned long address = start; address < end; address += 4096ul)
+    {
+        struct paging_translation *translation = &context->translations[(address >> 12) % PAGING_TRANSLATION_CACHE_SIZE];
+        if (translation->virtual_page == address)
+            translation->virtual_page = PAGING_TRANSLATION_INVALID;
+    }
+}
+
+void paging_invalidate(struct paging_context *context, unsigned long start, unsigned long end)
+{
+    paging_translation_invalidate(context, start, end);
+    paging_flush_range(context, start, end);
+    paging_shootdown(context);
+}
+
+void *paging_get_zero_page()
+{
+    return zero_page;
+}
+
+int paging_get_hugepages_supported()
+{
+    return hugepages_supported != 0;
+}
+
+void paging_initialize()
+{
+    // Each table has 512 other tables, there are 4 types of nested tables
+    used_virtual_pages = 0;
+
+    // Check if hugepages is supported using cpuid
+    // https://kokos.run/#WzAsIkFNRDY0Vm9sdW1lMy5wZGYiLDY1NCxbNjU0LDg0LDY1NCw4NF1d
+    struct cpu_id_result result = cpu_id(0x80000001);
+    hugepages_supported = result.edx & CPU_ID_1GB_PAGES_EDX;
+    no_execute_supported = result.edx & CPU_ID_NO_EXECUTE_EDX;
+
+    zero_page = memory_physical_allocate();
+    memory_zero(zero_page, 4096);
+
+    result = cpu_id(0x1);
+    global_pages_supported = result.edx & CPU_ID_GLOBAL_PAGES_EDX;
+    pat_supported = result.edx & CPU_ID_PAT_EDX;
+}
+
+void paging_initialize_cpu()
+{
+    // Make the no-execute bit in page entries usable, it is reserved (and causes a page fault) when this is disabled
+    if (no_execute_supported)
+    {
+        cpu_write_msr(CPU_MSR_EFER, cpu_read_msr(CPU_MSR_EFER) | CPU_EFER_NO_EXECUTE_ENABLE);
+    }
+
+    // Make read-only pages read-only for the kernel too, processes run in privilege level 0
+    unsigned long cr0;
+    asm volatile("mov %0, cr0"
+                 : "=r"(cr0));
+    asm volatile("mov cr0, %0" ::"r"(cr0 | CPU_CR0_WRITE_PROTECT));
+
+    // Keep the translations of global pages (the mappings that are the same in every address space) in the TLB when cr3 is written
+    if (global_pages_supported)
+    {
+        unsigned long cr4;
+        asm volatile("mov %0, cr4"
+                     : "=r"(cr4));
+        asm volatile("mov cr4, %0" ::"r"(cr4 | CPU_CR4_GLOBAL_PAGES));
+    }
+
+    // Replace the second write-back entry of the page attribute table with write-combining, see PAGING_PAT
+    if (pat_supported)
+    {
+        cpu_write_msr(CPU_MSR_PAT, PAGING_PAT);
+        paging_flush_global();
+    }
+
+    idt_register_interrupt(PAGING_SHOOTDOWN_VECTOR, paging_interrupt_shootdown, IDT_GATE_TYPE_INTERRUPT, IDT_STACK_TYPE_CURRENT);
 }
 
 // Converts mapping function flags to actual page entry flags
-static unsigned long paging_convert_flags(unsigned short flags)
+static unsigned long paging_convert_flags(unsigned long flags)
 {
     unsigned long page_entry_flags = PAGING_ENTRY_FLAG_PRESENT;
 
@@ -195,790 +343,1078 @@ static unsigned long paging_convert_flags(unsigned short flags)
     if (flags & PAGING_FLAG_USER)
         page_entry_flags |= PAGING_ENTRY_FLAG_EVERYONE_ACCESS;
 
+    if ((flags & PAGING_FLAG_GLOBAL) && global_pages_supported)
+        page_entry_flags |= PAGING_ENTRY_FLAG_GLOBAL;
+
+    // Select the memory type from the page attribute table, see PAGING_PAT
+    if (flags & PAGING_FLAG_UNCACHED)
+        page_entry_flags |= PAGING_ENTRY_FLAG_CACHE_DISABLED | PAGING_ENTRY_FLAG_WRITETHROUGH;
+    else if ((flags & PAGING_FLAG_WRITE_COMBINING) && pat_supported)
+        page_entry_flags |= PAGING_ENTRY_FLAG_PAT;
+    else if (flags & (PAGING_FLAG_WRITE_THROUGH | PAGING_FLAG_WRITE_COMBINING))
+        page_entry_flags |= PAGING_ENTRY_FLAG_WRITETHROUGH;
+
     // if (flags & PAGING_FLAG_READ)
     //     page_entry_flags |= PAGING_ENTRY_FLAG_PRESENT;
 
-    // TODO noexecute support
-    // if (!(flags & PAGING_FLAG_EXECUTE))
-    //     page_entry_flags |= PAGING_ENTRY_FLAG_NO_EXECUTE;
+    if (!(flags & PAGING_FLAG_EXECUTE) && no_execute_supported)
+        page_entry_flags |= PAGING_ENTRY_FLAG_NO_EXECUTE;
 
     return page_entry_flags;
 }
 
-static int paging_map_index_physical(void *physical_address, struct paging_context *index, unsigned long bytes, unsigned short flags)
+// Walks the entries of table (a page table of level level, which maps the virtual memory starting at table_address) that are in the range of walker
+static int paging_walk_table(struct paging_walker *walker, unsigned long *table, int level, unsigned long table_address)
 {
-    if (bytes <= 0)
-    {
-        console_print("[paging_map_index_physical] cannot map 0 bytes\n");
-        return 0;
-    }
-
-    unsigned long page_entry_flags = paging_convert_flags(flags);
+    unsigned long entry_size = PAGING_LEVEL_SIZE(level);
 
-    // Check if mapping huge pages (1GiB)
-    if ((index->level3_table[index->level3_index] & PAGING_ENTRY_FLAG_SIZE) || (flags & PAGING_FLAG_1GB))
+    unsigned int index = walker->start > table_address ? (walker->start - table_address) / entry_size : 0;
+    for (; index < 512; index++)
     {
-        if (!hugepages_supported)
+        unsigned long entry_address = table_address + entry_size * index;
+        if (entry_address >= walker->end)
+            break;
+
+        int result;
+        unsigned long entry = table[index];
+        if (!entry)
         {
-            console_print("[paging_map_index_physical] huge pages not supported (1GiB)\n");
-            return 0;
+            // The whole range this entry covers is skipped when it is absent
+            result = walker->absent ? walker->absent(walker, table, index, level, entry_address) : PAGING_WALK_CONTINUE;
         }
-
-        if ((unsigned long)physical_address & 0x3FFFFFFFul)
+        else if (level == 1 || (entry & PAGING_ENTRY_FLAG_SIZE))
         {
-            console_print("[paging_map_index_physical] physical_address must be aligned to 0x40000000 bytes (1GiB, 1073741824 bytes) when mapping 1GB page!\n");
-            return 0;
+            result = walker->leaf ? walker->leaf(walker, table, index, level, entry_address) : PAGING_WALK_CONTINUE;
         }
-
-        if (index->level3_table[index->level3_index] != 0 && !(flags & PAGING_FLAG_REPLACE))
+        else
         {
-            console_print("[paging_map_index_physical] tried to map at already mapped address (1GiB)\n");
-            return 0;
+            result = walker->table ? walker->table(walker, table, index, level, entry_address) : PAGING_WALK_DESCEND;
         }
 
-        unsigned long pages = ((bytes - 1) >> 30) + 1; // Divide by 1GiB
-        for (unsigned long i = 0; i < pages; i++)
-        {
-            index->level3_table[index->level3_index] = (((unsigned long)physical_address + 4096ul * 512ul * 512ul * i) & PAGING_ADDRESS_MASK) | page_entry_flags | PAGING_ENTRY_FLAG_SIZE;
+        if (result == PAGING_WALK_STOP)
+            return 0;
+        if (result != PAGING_WALK_DESCEND)
+            continue;
 
-            if (++index->level3_index >= 512ul)
-            {
-                if (++index->level4_index >= 512ul)
-                {
-                    console_print("[paging_map_index_physical] failed to allocate 1GiB pages, reached end of virtual address space.\n");
-                    return 0;
-                }
+        unsigned long *child_table = (unsigned long *)(table[index] & PAGING_ADDRESS_MASK);
+        struct memory_physical_page *child_info = memory_physical_get_page(child_table);
+        unsigned short child_entries = child_info->table_entries;
+        int child_result = paging_walk_table(walker, child_table, level - 1, entry_address);
 
-                index->level3_index = 0;
-                index->level3_table = index->level4_table[index->level4_index];
-                if (!index->level3_table)
-                {
-                    index->level3_table = memory_physical_allocate();
-                    memory_zero(index->level3_table, 4096ul);
-                    index->level4_table[index->level4_index] = (unsigned long)index->level3_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                }
-            }
+        // Free tables that became empty, and tables that the absent callback created for this walk that stayed empty (because the walk failed on
+        // their first entry). Other tables that were already empty could be in use by a mapping function that was interrupted
+        if ((child_entries != 0 || !entry) && child_info->table_entries == 0)
+        {
+            paging_set_entry(table, index, 0);
+            memory_physical_free(child_table);
         }
-        used_virtual_pages += pages * 512ul * 512ul;
-        return 1;
+
+        if (!child_result)
+            return 0;
     }
+    return 1;
+}
 
-    // Check if mapping huge pages (2MiB)
-    if ((index->level2_table[index->level2_index] & PAGING_ENTRY_FLAG_SIZE) || (flags & PAGING_FLAG_2MB))
+int paging_walk(struct paging_context *context, struct paging_walker *walker)
+{
+    return paging_walk_table(walker, context->level4_table, 4, 0);
+}
+
+int paging_split(unsigned long *table, unsigned int index, int level)
+{
+    unsigned long entry = table[index];
+    if (level <= 1 || !(entry & PAGING_ENTRY_FLAG_SIZE))
+    {
+        console_print("[paging_split] entry is not a huge page\n");
+        return 0;
+    }
+
+    // The smaller pages get the same flags, the page size bit only exists in level 2 and level 3 entries
+    unsigned long address = paging_entry_address(entry, level);
+    unsigned long flags = entry & ~address;
+    if (level == 2)
+        flags = paging_entry_flags_from_huge(flags);
+
+    unsigned long *child_table = memory_physical_allocate();
+    if (!child_table)
+    {
+        console_print("[paging_split] could not allocate page table\n");
+        return 0;
+    }
+    for (unsigned int i = 0; i < 512; i++)
     {
-        if ((unsigned long)physical_address & 0x1FFFFFul)
+        child_table[i] = (address + PAGING_LEVEL_SIZE(level - 1) * i) | flags;
+    }
+    memory_physical_get_page(child_table)->table_entries = 512;
+
+    table[index] = (unsigned long)child_table | PAGING_TABLE_ENTRY_FLAGS;
+    return 1;
+}
+
+// Returns the size of the pages that are used when mapping using flags
+static unsigned long paging_flags_page_size(unsigned long flags)
+{
+    if (flags & PAGING_FLAG_1GB)
+        return PAGING_LEVEL_SIZE(3);
+    if (flags & PAGING_FLAG_2MB)
+        return PAGING_LEVEL_SIZE(2);
+    return PAGING_LEVEL_SIZE(1);
+}
+
+struct paging_map_walker
+{
+    struct paging_walker base;
+    // The level of the entries that will be created (1 for 4KiB pages, 2 for 2MiB pages, 3 for 1GiB pages)
+    int leaf_level;
+    // The PAGING_FLAG_* flags passed to the mapping function
+    unsigned long flags;
+    // The page entry flags of the new entries
+    unsigned long entry_flags;
+    // 1 if new physical memory is allocated for every page, otherwise physical_address is mapped
+    int allocate;
+    unsigned long physical_address;
+    // The end of the pages that were mapped, they are unmapped again when the walk stops
+    unsigned long mapped_end;
+};
+
+// Creates the tables and pages for absent entries
+static int paging_map_absent(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_map_walker *map = (struct paging_map_walker *)walker;
+
+    if (level > map->leaf_level)
+    {
+        if (!paging_create_table(table, index))
         {
-            console_print("[paging_map_index_physical] physical_address_or_null must be aligned to 0x200000 bytes (2MiB, 2097152 bytes) when mapping 2MiB page!\n");
-            return 0;
+            console_print("[paging_map] could not allocate page table\n");
+            return PAGING_WALK_STOP;
         }
+        return PAGING_WALK_DESCEND;
+    }
 
-        if (index->level2_table[index->level2_index] != 0 && !(flags & PAGING_FLAG_REPLACE))
+    unsigned long page_size = PAGING_LEVEL_SIZE(level);
+    unsigned long physical_address;
+    unsigned long entry_flags = map->entry_flags;
+    if (map->allocate)
+    {
+        physical_address = level == 1 ? (unsigned long)memory_physical_allocate() : (unsigned long)memory_physical_allocate_consecutive(page_size >> 12);
+        if (!physical_address)
         {
-            console_print("[paging_map_index_physical] tried to map at already mapped address (2MiB)\n");
-            return 0;
+            console_print(level == 1 ? "[paging_map] could not allocate physical memory for page\n" : "[paging_map] could not allocate physical memory for huge page\n");
+            return PAGING_WALK_STOP;
         }
+        entry_flags |= PAGING_ENTRY_FLAG_OWNED;
+    }
+    else
+    {
+        physical_address = map->physical_address + (address - walker->start);
+    }
 
-        unsigned long pages = ((bytes - 1) >> 21) + 1; // Divide by 2MiB
-        for (unsigned long i = 0; i < pages; i++)
-        {
-            unsigned int x, y;
-            console_get_cursor(&x, &y);
-            // console_print_u64
-            console_set_cursor(x, y);
+    if (level > 1)
+        entry_flags = paging_entry_flags_to_huge(entry_flags);
 
-            index->level2_table[index->level2_index] = (((unsigned long)physical_address + 4096ul * 512ul * i) & PAGING_ADDRESS_MASK) | page_entry_flags | PAGING_ENTRY_FLAG_SIZE;
+    paging_set_entry(table, index, (physical_address & PAGING_ADDRESS_MASK) | entry_flags);
+    used_virtual_pages += page_size >> 12;
+    map->mapped_end = address + page_size;
+    return PAGING_WALK_CONTINUE;
+}
 
-            if (++index->level2_index >= 512ul)
-            {
-                if (++index->level3_index >= 512ul)
-                {
-                    if (++index->level4_index >= 512ul)
-                    {
-                        console_print("[paging_map_index_physical] failed to allocate 2MiB pages, reached end of virtual address space.\n");
-                        return 0;
-                    }
-
-                    index->level3_index = 0;
-                    index->level3_table = (unsigned long *)(index->level4_table[index->level4_index] & PAGING_ADDRESS_MASK);
-                    if (!index->level3_table)
-                    {
-                        index->level3_table = memory_physical_allocate();
-                        memory_zero(index->level3_table, 4096ul);
-                        index->level4_table[index->level4_index] = (unsigned long)index->level3_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                    }
-                }
+// Called when mapping over an existing page table
+static int paging_map_table(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_map_walker *map = (struct paging_map_walker *)walker;
+    if (level <= map->leaf_level)
+    {
+        console_print("[paging_map] cannot map a huge page over smaller pages\n");
+        return PAGING_WALK_STOP;
+    }
+    return PAGING_WALK_DESCEND;
+}
 
-                index->level2_index = 0;
-                index->level2_table = (unsigned long *)(index->level3_table[index->level3_index] & PAGING_ADDRESS_MASK);
-                if (!index->level2_table)
-                {
-                    index->level2_table = memory_physical_allocate();
-                    memory_zero(index->level2_table, 4096ul);
-                    index->level3_table[index->level3_index] = (unsigned long)index->level2_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                }
-            }
-        }
-        used_virtual_pages += pages * 512ul;
-        return 1;
+// Called when mapping over an existing page
+static int paging_map_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_map_walker *map = (struct paging_map_walker *)walker;
+    if (!(map->flags & PAGING_FLAG_REPLACE))
+    {
+        console_print("[paging_map] tried to map at already mapped address\n");
+        return PAGING_WALK_STOP;
     }
 
-    // Map using 4KiB pages
-    if (index->level1_table[index->level1_index] != 0)
+    if (level > map->leaf_level)
     {
-        console_print("[paging_map_index_physical] tried to map at already mapped address (4KiB)\n");
-        return 0;
+        // Only replace the part of the huge page that is in the range
+        return paging_split(table, index, level) ? PAGING_WALK_DESCEND : PAGING_WALK_STOP;
+    }
+    if (level < map->leaf_level)
+    {
+        console_print("[paging_map] cannot map a huge page over smaller pages\n");
+        return PAGING_WALK_STOP;
     }
 
-    if ((unsigned long)physical_address & 0xFFFul)
+    unsigned long entry = table[index];
+    if (PAGING_SWAP_IS_ENTRY(entry))
+    {
+        paging_swap_free(entry);
+    }
+    else if (entry & PAGING_ENTRY_FLAG_OWNED)
     {
-        console_print("[paging_map_index_physical] physical_address_or_null must be aligned to 0x1000 bytes (4KiB, 4096 bytes)!\n");
+        if (level == 1)
+            memory_physical_free((void *)paging_entry_address(entry, level));
+        else
+            memory_physical_free_consecutive((void *)paging_entry_address(entry, level), PAGING_LEVEL_SIZE(level) >> 12);
+    }
+    paging_set_entry(table, index, 0);
+    used_virtual_pages -= PAGING_LEVEL_SIZE(level) >> 12;
+    return paging_map_absent(walker, table, index, level, address);
+}
+
+static int paging_unmap_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address);
+
+// Maps bytes bytes at virtual_address, if allocate is 0, physical_address is mapped, otherwise new physical memory is allocated.
+// Returns 0 if it failed, then the pages that were already mapped are unmapped again
+static int paging_map_range(struct paging_context *context, void *physical_address, void *virtual_address, unsigned long bytes, unsigned long flags, int allocate)
+{
+    unsigned long page_size = paging_flags_page_size(flags);
+
+    if (bytes <= 0)
+    {
+        console_print("[paging_map] cannot map 0 bytes\n");
+        return 0;
+    }
+    if ((flags & PAGING_FLAG_1GB) && !hugepages_supported)
+    {
+        console_print("[paging_map] huge pages not supported (1GiB)\n");
+        return 0;
+    }
+    if (((unsigned long)virtual_address & (page_size - 1)) || (!allocate && ((unsigned long)physical_address & (page_size - 1))))
+    {
+        console_print("[paging_map] addresses must be aligned to the page size (4KiB, 2MiB or 1GiB)\n");
         return 0;
     }
 
-    unsigned long pages = ((bytes - 1) >> 12) + 1; // Divide by 4KiB
-    for (unsigned long i = 0; i < pages; i++)
+    struct paging_map_walker map = {
+        .base = {
+            .start = (unsigned long)virtual_address,
+            .end = (unsigned long)virtual_address + ALIGN_TO_NEXT(bytes, page_size),
+            .absent = paging_map_absent,
+            .table = paging_map_table,
+            .leaf = paging_map_leaf,
+        },
+        .leaf_level = (flags & PAGING_FLAG_1GB) ? 3 : ((flags & PAGING_FLAG_2MB) ? 2 : 1),
+        .flags = flags,
+        .entry_flags = paging_convert_flags(flags),
+        .allocate = allocate,
+        .physical_address = (unsigned long)physical_address,
+        .mapped_end = (unsigned long)virtual_address,
+    };
+
+    int result = paging_walk(context, &map.base);
+    if (!result && map.mapped_end > map.base.start)
     {
-        index->level1_table[index->level1_index] = ((unsigned long)(physical_address + 4096ul * i) & PAGING_ADDRESS_MASK) | page_entry_flags;
+        // The range is walked in order, so everything before mapped_end was mapped by this walk (a failed walk could have run out of memory)
+        struct paging_walker unmap = {
+            .start = map.base.start,
+            .end = map.mapped_end,
+            .leaf = paging_unmap_leaf,
+        };
+        paging_walk(context, &unmap);
+    }
+    paging_translation_invalidate(context, map.base.start, map.base.end);
 
-        if (++index->level1_index >= 512ul)
-        {
-            if (++index->level2_index >= 512ul)
-            {
-                if (++index->level3_index >= 512ul)
-                {
-                    if (++index->level4_index >= 512ul)
-                    {
-                        console_print("[paging_map_index_physical] failed to allocate 4KiB pages, reached end of virtual address space.\n");
-                        return 0;
-                    }
-
-                    index->level3_index = 0;
-                    index->level3_table = (unsigned long *)(index->level4_table[index->level4_index] & PAGING_ADDRESS_MASK);
-                    if (!index->level3_table)
-                    {
-                        index->level3_table = memory_physical_allocate();
-                        memory_zero(index->level3_table, 4096ul);
-                        index->level4_table[index->level4_index] = (unsigned long)index->level3_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                    }
-                }
+    // Replaced pages could have been global pages
+    if (flags & (PAGING_FLAG_GLOBAL | PAGING_FLAG_REPLACE))
+        paging_flush_global();
+    else
+        paging_flush(context);
 
-                index->level2_index = 0;
-                index->level2_table = (unsigned long *)(index->level3_table[index->level3_index] & PAGING_ADDRESS_MASK);
-                if (!index->level2_table)
-                {
-                    index->level2_table = memory_physical_allocate();
-                    memory_zero(index->level2_table, 4096ul);
-                    index->level3_table[index->level3_index] = (unsigned long)index->level2_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                }
-            }
+    // New pages are not cached by other cpus, only replaced pages
+    if (flags & PAGING_FLAG_REPLACE)
+        paging_shootdown(0);
+    return result;
+}
 
-            index->level1_index = 0;
-            index->level1_table = (unsigned long *)(index->level2_table[index->level2_index] & PAGING_ADDRESS_MASK);
-            if (!index->level1_table)
-            {
-                index->level1_table = memory_physical_allocate();
-                memory_zero(index->level1_table, 4096ul);
-                index->level2_table[index->level2_index] = (unsigned long)index->level1_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-            }
-        }
+int paging_context_initialize(struct paging_context *context)
+{
+    context->level4_table = memory_physical_allocate();
+    if (!context->level4_table)
+    {
+        console_print("[paging_context_initialize] could not allocate level4 table\n");
+        return 0;
     }
-    used_virtual_pages += pages;
+    paging_clear_table(context->level4_table);
+    memory_physical_get_page(context->level4_table)->table_entries = 0;
+    context->regions = 0;
+    context->lock = 0;
+    paging_translation_invalidate(context, 0, PAGING_REGION_MAXIMUM);
     return 1;
 }
 
-// Begins to map x bytes at the current location where index points to, all the tables and indices should be filled in in index
-static int paging_map_index_current(struct paging_context *context, unsigned long bytes, unsigned short flags)
+static void *paging_map_physical_locked(struct paging_context *context, void *physical_address, unsigned long bytes, unsigned long flags)
 {
-    if (bytes <= 0)
+    unsigned long page_size = paging_flags_page_size(flags);
+    struct paging_region *region = paging_region_reserve(&context->regions, ALIGN_TO_NEXT(bytes, page_size), page_size, flags);
+    if (!region)
     {
-        console_print("[paging_map_index_current] cannot map 0 bytes\n");
         return 0;
     }
 
-    unsigned long page_entry_flags = paging_convert_flags(flags);
-
-    // Check if mapping huge pages (1GiB)
-    if ((context->level3_table[context->level3_index] & PAGING_ENTRY_FLAG_SIZE) || (flags & PAGING_FLAG_1GB))
+    void *virtual_address = (void *)region->start;
+    if (!paging_map_range(context, physical_address, virtual_address, bytes, flags, 0))
     {
-        if (!hugepages_supported)
-        {
-            console_print("[paging_map_index_current] huge pages not supported (1GiB)\n");
-            return 0;
-        }
-
-        if (context->level3_table[context->level3_index] != 0 && !(flags & PAGING_FLAG_REPLACE))
-        {
-            console_print("[paging_map_index_current] tried to map at already mapped address (1GiB)\n");
-            return 0;
-        }
-
-        unsigned long pages = ((bytes - 1) >> 30) + 1; // Divide by 1GiB
-        for (unsigned long i = 0; i < pages; i++)
-        {
-            // TODO not implemented
-            // index->level3_table[index->level3_index] = ((unsigned long)memory_physical_allocate_1gb() & PAGING_ADDRESS_MASK) | page_entry_flags | PAGING_ENTRY_FLAG_SIZE;
-            console_print("[paging_map_index_current] 1GiB physical allocation not implemented yet!\n");
-            return 0;
+        // Mapping failed for some reason
+        paging_region_release(&context->regions, region->start, region->end - region->start);
+        return 0;
+    }
+    return virtual_address;
+}
 
-            if (++context->level3_index >= 512ul)
-            {
-                if (++context->level4_index >= 512ul)
-                {
-                    console_print("[paging_map_index_current] failed to allocate 1GiB pages, reached end of virtual address space.\n");
-                    return 0;
-                }
+void *paging_map_physical(struct paging_context *context, void *physical_address, unsigned long bytes, unsigned long flags)
+{
+    unsigned long rflags = paging_lock(&context->lock);
+    void *result = paging_map_physical_locked(context, physical_address, bytes, flags);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
 
-                context->level3_index = 0;
-                context->level3_table = context->level4_table[context->level4_index];
-                if (!context->level3_table)
-                {
-                    context->level3_table = memory_physical_allocate();
-                    memory_zero(context->level3_table, 4096ul);
-                    context->level4_table[context->level4_index] = (unsigned long)context->level3_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                }
-            }
-        }
-        used_virtual_pages += pages * 512ul * 512ul;
-        return 1;
+static void *paging_map_locked(struct paging_context *context, unsigned long bytes, unsigned long flags)
+{
+    if ((flags & PAGING_FLAG_ON_DEMAND) && (flags & (PAGING_FLAG_1GB | PAGING_FLAG_2MB)))
+    {
+        console_print("[paging_map] on demand mappings must use 4KiB pages\n");
+        return 0;
     }
 
-    // Check if mapping huge pages (2MiB)
-    if ((context->level2_table[context->level2_index] & PAGING_ENTRY_FLAG_SIZE) || (flags & PAGING_FLAG_2MB))
+    unsigned long page_size = paging_flags_page_size(flags);
+    struct paging_region *region = paging_region_reserve(&context->regions, ALIGN_TO_NEXT(bytes, page_size), page_size, flags);
+    if (!region)
     {
-        if (context->level2_table[context->level2_index] != 0 && !(flags & PAGING_FLAG_REPLACE))
-        {
-            console_print("[paging_map_index_current] tried to map at already mapped address (2MiB)\n");
-            return 0;
-        }
-
-        unsigned long pages = ((bytes - 1) >> 21) + 1; // Divide by 2MiB
-        for (unsigned long i = 0; i < pages; i++)
-        {
-            // TODO not implemented
-            // index->level2_table[index->level2_index] = ((unsigned long)memory_physical_allocate_2mb() & PAGING_ADDRESS_MASK) | page_entry_flags | PAGING_ENTRY_FLAG_SIZE;
-            console_print("[paging_map_index_current] 2MiB physical allocation not implemented yet!\n");
-            return 0;
-
-            if (++context->level2_index >= 512ul)
-            {
-                if (++context->level3_index >= 512ul)
-                {
-                    if (++context->level4_index >= 512ul)
-                    {
-                        console_print("[paging_map_index_current] failed to allocate 2MiB pages, reached end of virtual address space.\n");
-                        return 0;
-                    }
-
-                    context->level3_index = 0;
-                    context->level3_table = (unsigned long *)(context->level4_table[context->level4_index] & PAGING_ADDRESS_MASK);
-                    if (!context->level3_table)
-                    {
-                        context->level3_table = memory_physical_allocate();
-                        memory_zero(context->level3_table, 4096ul);
-                        context->level4_table[context->level4_index] = (unsigned long)context->level3_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                    }
-                }
+        return 0;
+    }
 
-                context->level2_index = 0;
-                context->level2_table = (unsigned long *)(context->level3_table[context->level3_index] & PAGING_ADDRESS_MASK);
-                if (!context->level2_table)
-                {
-                    context->level2_table = memory_physical_allocate();
-                    memory_zero(context->level2_table, 4096ul);
-                    context->level3_table[context->level3_index] = (unsigned long)context->level2_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                }
-            }
-        }
-        used_virtual_pages += pages * 512ul;
-        return 1;
+    // Pages of on demand mappings are created by paging_handle_fault
+    void *virtual_address = (void *)region->start;
+    if (!(flags & PAGING_FLAG_ON_DEMAND) && !paging_map_range(context, 0, virtual_address, bytes, flags, 1))
+    {
+        // Mapping failed for some reason
+        paging_region_release(&context->regions, region->start, region->end - region->start);
+        return 0;
     }
+    return virtual_address;
+}
 
-    // Map using 4KiB pages
-    if (context->level1_table[context->level1_index] != 0)
+void *paging_map(struct paging_context *context, unsigned long bytes, unsigned long flags)
+{
+    unsigned long rflags = paging_lock(&context->lock);
+    void *result = paging_map_locked(context, bytes, flags);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
+
+static void *paging_map_physical_at_locked(struct paging_context *context, void *physical_address, void *virtual_address, unsigned long bytes, unsigned long flags)
+{
+    unsigned long page_size = paging_flags_page_size(flags);
+    struct paging_region *region = paging_region_reserve_at(&context->regions, (unsigned long)virtual_address, ALIGN_TO_NEXT(bytes, page_size), flags);
+    if (!region && !(flags & PAGING_FLAG_REPLACE))
     {
-        console_print("[paging_map_index_current] tried to map at already mapped address (4KiB)\n");
+        console_print("[paging_map_physical_at] tried to map at already reserved address\n");
         return 0;
     }
 
-    unsigned long pages = ((bytes - 1) >> 12) + 1; // Divide by 4KiB
-    for (unsigned long i = 0; i < pages; i++)
+    if (!paging_map_range(context, physical_address, virtual_address, bytes, flags, 0))
     {
-        context->level1_table[context->level1_index] = ((unsigned long)memory_physical_allocate() & PAGING_ADDRESS_MASK) | page_entry_flags;
-
-        if (++context->level1_index >= 512ul)
-        {
-            if (++context->level2_index >= 512ul)
-            {
-                if (++context->level3_index >= 512ul)
-                {
-                    if (++context->level4_index >= 512ul)
-                    {
-                        console_print("[paging_map_index_current] failed to allocate 4KiB pages, reached end of virtual address space.\n");
-                        return 0;
-                    }
-
-                    context->level3_index = 0;
-                    context->level3_table = (unsigned long *)(context->level4_table[context->level4_index] & PAGING_ADDRESS_MASK);
-                    if (!context->level3_table)
-                    {
-                        context->level3_table = memory_physical_allocate();
-                        memory_zero(context->level3_table, 4096ul);
-                        context->level4_table[context->level4_index] = (unsigned long)context->level3_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                    }
-                }
-
-                context->level2_index = 0;
-                context->level2_table = (unsigned long *)(context->level3_table[context->level3_index] & PAGING_ADDRESS_MASK);
-                if (!context->level2_table)
-                {
-                    context->level2_table = memory_physical_allocate();
-                    memory_zero(context->level2_table, 4096ul);
-                    context->level3_table[context->level3_index] = (unsigned long)context->level2_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-                }
-            }
-
-            context->level1_index = 0;
-            context->level1_table = (unsigned long *)(context->level2_table[context->level2_index] & PAGING_ADDRESS_MASK);
-            if (!context->level1_table)
-            {
-                context->level1_table = memory_physical_allocate();
-                memory_zero(context->level1_table, 4096ul);
-                context->level2_table[context->level2_index] = (unsigned long)context->level1_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
-            }
-        }
+        if (region)
+            paging_region_release(&context->regions, region->start, region->end - region->start);
+        return 0;
     }
-    used_virtual_pages += pages;
-    return 1;
+    return virtual_address;
 }
 
-static int paging_virtual_address_to_index(struct paging_context *destination_context, void *virtual_address, unsigned long flags)
+void *paging_map_physical_at(struct paging_context *context, void *physical_address, void *virtual_address, unsigned long bytes, unsigned long flags)
 {
-    destination_context->level4_index = ((unsigned long)virtual_address >> 39) & 0b111111111ul;
+    unsigned long rflags = paging_lock(&context->lock);
+    void *result = paging_map_physical_at_locked(context, physical_address, virtual_address, bytes, flags);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
 
-    destination_context->level3_table = (unsigned long *)(destination_context->level4_table[destination_context->level4_index] & PAGING_ADDRESS_MASK);
-    if (!destination_context->level3_table)
+static void *paging_map_at_locked(struct paging_context *context, void *virtual_address, unsigned long bytes, unsigned long flags)
+{
+    if ((flags & PAGING_FLAG_ON_DEMAND) && (flags & (PAGING_FLAG_1GB | PAGING_FLAG_2MB | PAGING_FLAG_REPLACE)))
     {
-        destination_context->level3_table = memory_physical_allocate();
-        memory_zero(destination_context->level3_table, 4096ul);
-        destination_context->level4_table[destination_context->level4_index] = (unsigned long)destination_context->level3_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
+        console_print("[paging_map_at] on demand mappings must use 4KiB pages and cannot replace\n");
+        return 0;
     }
 
-    destination_context->level3_index = ((unsigned long)virtual_address >> 30) & 0b111111111ul;
-
-    if (flags & PAGING_FLAG_1GB)
+    unsigned long page_size = paging_flags_page_size(flags);
+    struct paging_region *region = paging_region_reserve_at(&context->regions, (unsigned long)virtual_address, ALIGN_TO_NEXT(bytes, page_size), flags);
+    if (!region && !(flags & PAGING_FLAG_REPLACE))
     {
-        if ((unsigned long)virtual_address & 0x3FFFFFFFul)
-        {
-            console_print("[paging_virtual_address_to_index] address must be aligned to 0x40000000 (1Gib, 1073741824 bytes) when mapping 1GiB page\n");
-            return 0;
-        }
-
-        destination_context->level2_table = 0;
-        destination_context->level2_index = 0;
-        destination_context->level1_table = 0;
-        destination_context->level1_index = 0;
-        return 1;
+        console_print("[paging_map_at] tried to map at already reserved address\n");
+        return 0;
     }
 
-    destination_context->level2_table = (unsigned long *)(destination_context->level3_table[destination_context->level3_index] & PAGING_ADDRESS_MASK);
-    if (!destination_context->level2_table)
+    if (!(flags & PAGING_FLAG_ON_DEMAND) && !paging_map_range(context, 0, virtual_address, bytes, flags, 1))
     {
-        destination_context->level2_table = memory_physical_allocate();
-        memory_zero(destination_context->level2_table, 4096ul);
-        destination_context->level3_table[destination_context->level3_index] = (unsigned long)destination_context->level2_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
+        if (region)
+            paging_region_release(&context->regions, region->start, region->end - region->start);
+        return 0;
     }
+    return virtual_address;
+}
 
-    destination_context->level2_index = ((unsigned long)virtual_address >> 21) & 0b111111111ul;
+void *paging_map_at(struct paging_context *context, void *virtual_address, unsigned long bytes, unsigned long flags)
+{
+    unsigned long rflags = paging_lock(&context->lock);
+    void *result = paging_map_at_locked(context, virtual_address, bytes, flags);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
 
-    if (flags & PAGING_FLAG_2MB)
-    {
-        if ((unsigned long)virtual_address & 0x1FFFFFul)
-        {
-            console_print("[paging_virtual_address_to_index] address must be aligned to 0x200000 (2MiB, 2097152 bytes) when mapping 2MiB page\n");
-            return 0;
-        }
+// Removes pages, physical memory owned by the mapping is freed
+static int paging_unmap_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    unsigned long page_size = PAGING_LEVEL_SIZE(level);
 
-        destination_context->level1_table = 0;
-        destination_context->level1_index = 0;
-        return 1;
+    // Only remove the part of a huge page that is in the range
+    if (address < walker->start || address + page_size > walker->end)
+    {
+        return paging_split(table, index, level) ? PAGING_WALK_DESCEND : PAGING_WALK_STOP;
     }
 
-    destination_context->level1_table = (unsigned long *)(destination_context->level2_table[destination_context->level2_index] & PAGING_ADDRESS_MASK);
-    if (!destination_context->level1_table)
+    unsigned long entry = table[index];
+    if (PAGING_SWAP_IS_ENTRY(entry))
     {
-        destination_context->level1_table = memory_physical_allocate();
-        memory_zero(destination_context->level1_table, 4096ul);
-        destination_context->level2_table[destination_context->level3_index] = (unsigned long)destination_context->level1_table | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE;
+        paging_swap_free(entry);
     }
-    destination_context->level1_index = ((unsigned long)virtual_address >> 12) & 0b111111111ul;
-
-    if ((unsigned long)virtual_address & 0xFFFul)
+    else if (entry & PAGING_ENTRY_FLAG_OWNED)
     {
-        // Address is not aligned
-        console_print("[paging_virtual_address_to_index] address must be aligned to 0x1000 (4KiB, 4096 bytes) when mapping page\n");
-        return 0;
+        if (level == 1)
+            memory_physical_free((void *)paging_entry_address(entry, level));
+        else
+            memory_physical_free_consecutive((void *)paging_entry_address(entry, level), page_size >> 12);
+    }
+    else if ((entry & PAGING_ENTRY_FLAG_COPY_ON_WRITE) && paging_entry_address(entry, level) != (unsigned long)zero_page)
+    {
+        paging_merge_release((void *)paging_entry_address(entry, level));
     }
 
-    return 1;
+    paging_set_entry(table, index, 0);
+    used_virtual_pages -= page_size >> 12;
+    return PAGING_WALK_CONTINUE;
 }
 
-// void *paging_map_physical(void* physical_address, unsigned long bytes, unsigned long flags)
-// {
-//     struct cpu *cpu = cpu_get_current();
-//     return paging_map_index_physical(&cpu->current_process->paging_context, physical_address, bytes, flags);
-// }
-
-void *paging_map_physical(struct paging_context *context, void *physical_address, unsigned long bytes, unsigned long flags)
+static int paging_unmap_locked(struct paging_context *context, void *virtual_address, unsigned long bytes)
 {
-    if (paging_index_find_spot(context, bytes, flags))
+    struct paging_region *region = paging_region_find(context->regions, (unsigned long)virtual_address);
+    if (!region)
     {
-        void *virtual_address = (void *)(((unsigned long)context->level1_index << 12) | ((unsigned long)context->level2_index << 21) | ((unsigned long)context->level3_index << 30) | ((unsigned long)context->level4_index << 39));
-        if (paging_map_index_physical(physical_address, context, bytes, flags))
-        {
-            return virtual_address;
-        }
-        else
-        {
-            // Mapping failed for some reason
-            return 0;
-        }
+        console_print("[paging_unmap] tried to unmap unreserved address\n");
+        return 0;
     }
-    else
+
+    unsigned long page_size = paging_flags_page_size(region->flags);
+    if ((unsigned long)virtual_address & (page_size - 1))
+    {
+        console_print("[paging_unmap] virtual_address must be aligned to the page size of the mapping\n");
+        return 0;
+    }
+    if ((unsigned long)virtual_address + ALIGN_TO_NEXT(bytes, page_size) > region->end)
     {
+        console_print("[paging_unmap] range must be inside a single mapping\n");
         return 0;
     }
+
+    // Empty page tables are freed by the walker
+    struct paging_walker unmap = {
+        .start = (unsigned long)virtual_address,
+        .end = (unsigned long)virtual_address + ALIGN_TO_NEXT(bytes, page_size),
+        .leaf = paging_unmap_leaf,
+    };
+    int result = paging_walk(context, &unmap);
+    paging_translation_invalidate(context, unmap.start, unmap.end);
+    if (region->flags & PAGING_FLAG_GLOBAL)
+        paging_flush_global();
+    else
+        paging_flush(context);
+    paging_shootdown((region->flags & PAGING_FLAG_GLOBAL) ? 0 : context);
+
+    // Make the virtual memory available again for paging_map
+    paging_region_release(&context->regions, unmap.start, unmap.end - unmap.start);
+    return result;
 }
 
-// void *paging_map(unsigned long bytes, unsigned long flags)
-// {
-//     struct cpu *cpu = cpu_get_current();
-//     return paging_map_index(&cpu->current_process->paging_context, bytes, flags);
-// }
+int paging_unmap(struct paging_context *context, void *virtual_address, unsigned long bytes)
+{
+    unsigned long rflags = paging_lock(&context->lock);
+    int result = paging_unmap_locked(context, virtual_address, bytes);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
 
-void *paging_map(struct paging_context *context, unsigned long bytes, unsigned long flags)
+void paging_context_destroy(struct paging_context *context)
+{
+    // The context is not in use by any cpu, so no TLB has to be flushed. Every page is in the range, so no huge page is split and the walk cannot fail
+    struct paging_walker unmap = {
+        .start = 0,
+        .end = PAGING_REGION_MAXIMUM,
+        .leaf = paging_unmap_leaf,
+    };
+    paging_walk(context, &unmap);
+    paging_translation_invalidate(context, 0, PAGING_REGION_MAXIMUM);
+
+    paging_region_release(&context->regions, 0, PAGING_REGION_MAXIMUM);
+    memory_physical_free(context->level4_table);
+    context->level4_table = 0;
+}
+
+struct paging_protect_walker
+{
+    struct paging_walker base;
+    // The page entry flags that are set on each page
+    unsigned long entry_flags;
+    // The range of pages that were changed and must be removed from the TLB
+    unsigned long changed_start;
+    unsigned long changed_end;
+};
+
+static int paging_protect_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_protect_walker *protect = (struct paging_protect_walker *)walker;
+    unsigned long page_size = PAGING_LEVEL_SIZE(level);
+
+    unsigned long entry = table[index];
+    unsigned long new_entry = (entry & ~(PAGING_PROTECT_ENTRY_FLAGS | PAGING_ENTRY_FLAG_COPY_ON_WRITE)) | protect->entry_flags;
+
+    // Shared pages never become writable, the first write copies them
+    if (entry & PAGING_ENTRY_FLAG_COPY_ON_WRITE)
+        new_entry = (new_entry & ~PAGING_ENTRY_FLAG_WRITABLE) | PAGING_ENTRY_FLAG_COPY_ON_WRITE;
+
+    if (new_entry == entry)
+        return PAGING_WALK_CONTINUE;
+
+    // Only huge pages that are partially in the range must be split
+    if (address < walker->start || address + page_size > walker->end)
+    {
+        return paging_split(table, index, level) ? PAGING_WALK_DESCEND : PAGING_WALK_STOP;
+    }
+
+    table[index] = new_entry;
+
+    if (address < protect->changed_start)
+        protect->changed_start = address;
+    if (address + page_size > protect->changed_end)
+        protect->changed_end = address + page_size;
+    return PAGING_WALK_CONTINUE;
+}
+
+static int paging_protect_locked(struct paging_context *context, void *virtual_address, unsigned long bytes, unsigned long flags)
 {
-    if (paging_index_find_spot(context, bytes, flags))
+    if ((unsigned long)virtual_address & 0xFFF)
     {
-        void *virtual_address = (void *)(((unsigned long)context->level1_index << 12) | ((unsigned long)context->level2_index << 21) | ((unsigned long)context->level3_index << 30) | ((unsigned long)context->level4_index << 39));
-        if (paging_map_index_current(context, bytes, flags))
-        {
-            return virtual_address;
-        }
-        else
-        {
-            // Mapping failed for some reason
-            return 0;
-        }
+        console_print("[paging_protect] virtual_address must be aligned to 4KiB\n");
+        return 0;
     }
-    else
+    struct paging_region *region = paging_region_find(context->regions, (unsigned long)virtual_address);
+    if (!region)
     {
+        console_print("[paging_protect] tried to protect unreserved address\n");
+        return 0;
+    }
+    if ((unsigned long)virtual_address + bytes > region->end)
+    {
+        console_print("[paging_protect] range must be inside a single mapping\n");
+        return 0;
+    }
+    unsigned long region_flags = (region->flags & ~PAGING_PROTECT_FLAGS) | (flags & PAGING_PROTECT_FLAGS);
+
+    struct paging_protect_walker protect = {
+        .base = {
+            .start = (unsigned long)virtual_address,
+            .end = (unsigned long)virtual_address + ALIGN_TO_NEXT(bytes, 4096ul),
+            .leaf = paging_protect_leaf,
+        },
+        .entry_flags = paging_convert_flags(flags) & PAGING_PROTECT_ENTRY_FLAGS,
+        .changed_start = ~0ul,
+        .changed_end = 0,
+    };
+
+    // Store the new permissions in the region first, pages of on demand mappings that are created later get them too.
+    // This is the only step that can fail without changing anything, the range stays reserved either way
+    if (!paging_region_set_flags(&context->regions, protect.base.start, protect.base.end - protect.base.start, region_flags))
+    {
+        console_print("[paging_protect] could not change the flags of the region\n");
         return 0;
     }
-}
 
-// void *paging_map_physical_at(void *physical_address, void *virtual_address, unsigned long bytes, unsigned long flags)
-// {
-//     struct cpu *cpu = cpu_get_current();
-//     return paging_map_index_physical_at(&cpu->current_process->paging_context, physical_address, virtual_address, bytes, flags);
-// }
+    // A huge page that could not be split stops the walk, the pages before it already have the new permissions
+    int result = paging_walk(context, &protect.base);
+    paging_translation_invalidate(context, protect.base.start, protect.base.end);
 
-void *paging_map_physical_at(struct paging_context *context, void *physical_address, void *virtual_address, unsigned long bytes, unsigned long flags)
-{
-    struct paging_context new_index;
-    // A virtual address was given, only get the uppermost (level 4) page table from the current process
-    new_index.level4_table = context->level4_table;
-    if (paging_virtual_address_to_index(&new_index, virtual_address, flags))
+    // Remove the old permissions from the TLB once for the whole range
+    if (protect.changed_start < protect.changed_end)
     {
-        if (paging_map_index_physical(physical_address, &new_index, bytes, flags))
-        {
-            return virtual_address;
-        }
+        if (region_flags & PAGING_FLAG_GLOBAL)
+            paging_flush_global();
         else
-        {
-            return 0;
-        }
+            paging_flush_range(context, protect.changed_start, protect.changed_end);
+        paging_shootdown((region_flags & PAGING_FLAG_GLOBAL) ? 0 : context);
     }
-    else
+
+    if (!result)
     {
+        console_print("[paging_protect] could not change the permissions of the whole range\n");
         return 0;
     }
+    return 1;
 }
 
-// void *paging_map_at(void *virtual_address, unsigned long bytes, unsigned long flags)
-// {
-//     struct cpu *cpu = cpu_get_current();
-//     return paging_map_index_at(&cpu->current_process->paging_context, virtual_address, bytes, flags);
-// }
+int paging_protect(struct paging_context *context, void *virtual_address, unsigned long bytes, unsigned long flags)
+{
+    unsigned long rflags = paging_lock(&context->lock);
+    int result = paging_protect_locked(context, virtual_address, bytes, flags);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
 
-void *paging_map_at(struct paging_context *context, void *virtual_address, unsigned long bytes, unsigned long flags)
+// Copies a copy-on-write page to a private writable page
+static int paging_fault_copy_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
 {
-    struct paging_context new_index;
-    // A virtual address was given, only get the uppermost (level 4) page table from the current process
-    new_index.level4_table = context->level4_table;
-    if (paging_virtual_address_to_index(&new_index, virtual_address, flags))
+    unsigned long entry = table[index];
+
+    // Another cpu made the page writable again while this fault was raised (see paging_promote_table and paging_merge.c), retry the write
+    if ((entry & PAGING_ENTRY_FLAG_PRESENT) && (entry & PAGING_ENTRY_FLAG_WRITABLE))
+        return PAGING_WALK_CONTINUE;
+
+    if (level != 1 || !(entry & PAGING_ENTRY_FLAG_COPY_ON_WRITE))
+        return PAGING_WALK_STOP;
+
+    void *shared_page = (void *)paging_entry_address(entry, level);
+    void *page;
+    if (shared_page != zero_page && paging_merge_take(shared_page))
+    {
+        // This was the last mapping of the merged page, no need to copy it
+        page = shared_page;
+    }
+    else
     {
-        if (paging_map_index_current(&new_index, bytes, flags))
+        // Without memory the fault is not handled, the shared page stays mapped
+        page = memory_physical_allocate();
+        if (!page)
+            return PAGING_WALK_STOP;
+        if (shared_page == zero_page)
         {
-            return virtual_address;
+            memory_zero(page, 4096);
         }
         else
         {
-            return 0;
+            memory_copy(shared_page, page, 4096);
+            paging_merge_release(shared_page);
         }
     }
-    else
-    {
-        return 0;
-    }
+
+    unsigned long flags = entry & ~PAGING_ADDRESS_MASK & ~PAGING_ENTRY_FLAG_COPY_ON_WRITE;
+    table[index] = (unsigned long)page | flags | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_OWNED;
+    return PAGING_WALK_CONTINUE;
 }
 
-int paging_unmap(struct paging_context *context, void *virtual_address, unsigned long bytes)
+struct paging_fault_walker
 {
-    unsigned long *level4_table = context->level4_table;
-    unsigned int level4_index = ((unsigned long)virtual_address >> 39) & 0b111111111ul;
-    unsigned long level4_entry = level4_table[level4_index];
-    if (level4_entry == 0)
+    struct paging_walker base;
+    unsigned long error_code;
+    int handled;
+};
+
+// Loads a swapped out page again
+static int paging_fault_swap_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_fault_walker *fault = (struct paging_fault_walker *)walker;
+
+    unsigned long entry = table[index];
+    if (entry & PAGING_ENTRY_FLAG_PRESENT)
     {
-        console_print("[paging_unmap] tried to unmap unmapped page (level4_entry)\n");
-        return 0;
+        // Another cpu mapped the page again while this fault was raised (see paging_swap.c), retry the access
+        if (!(fault->error_code & PAGING_FAULT_PRESENT))
+            fault->handled = 1;
+        return PAGING_WALK_STOP;
     }
+    if (level != 1)
+        return PAGING_WALK_STOP;
 
-    unsigned long *level3_table = (unsigned long *)(level4_entry & PAGING_ADDRESS_MASK);
-    unsigned int level3_index = ((unsigned long)virtual_address >> 30) & 0b111111111ul;
-    unsigned long level3_entry = level3_table[level3_index];
-    if (level3_entry == 0)
+    void *page = memory_physical_allocate();
+    if (!page)
+        return PAGING_WALK_STOP;
+    if (!paging_swap_load(entry, page))
     {
-        console_print("[paging_unmap] tried to unmap unmapped page (level3_entry)\n");
-        return 0;
+        memory_physical_free(page);
+        return PAGING_WALK_STOP;
     }
-    if (level3_entry & PAGING_ENTRY_FLAG_SIZE)
-    {
-        unsigned long pages = ((bytes - 1) >> 30) + 1; // Divide by 1GB
-        if ((unsigned long)virtual_address & 0x3FFFFFFFul)
-        {
-            console_print("[paging_unmap] virtual_address must be aligned to 0x40000000 bytes (1GiB, 1073741824 bytes) when unmapping 1GB page!\n");
-            return 0;
-        }
 
-        // Free 1GB huge pages
-        for (unsigned long i = 0; i < pages; i++)
-        {
-            level3_table[level3_index] = 0;
-            if (++level3_index >= 512ul)
-            {
-                if (++level4_index >= 512ul)
-                {
-                    console_print("[paging_unmap] invalid 1GiB unmap, reached end of level4 table\n");
-                    return 0;
-                }
+    table[index] = (unsigned long)page | (entry & ~PAGING_ADDRESS_MASK) | PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_OWNED | PAGING_ENTRY_FLAG_ACCESSED;
+    fault->handled = 1;
+    return PAGING_WALK_CONTINUE;
+}
 
-                level3_index = 0;
-                level3_table = (unsigned long *)(level4_table[level4_index] & PAGING_ADDRESS_MASK);
-                if (!level3_table)
-                {
-                    console_print("[paging_unmap] invalid 1GiB unmap, entering null level 3 table\n");
-                    return 0;
-                }
-            }
-        }
+static int paging_handle_fault_locked(struct paging_context *context, void *virtual_address, unsigned long error_code)
+{
+    unsigned long page = (unsigned long)virtual_address & ~0xFFFul;
+    struct paging_region *region = paging_region_find(context->regions, page);
+    if (!region)
+        return 0;
 
-        used_virtual_pages -= pages * 512ul * 512ul;
+    // The page could be swapped out, the page tables could also have been changed by another cpu after the fault was raised
+    struct paging_fault_walker fault = {
+        .base = {
+            .start = page,
+            .end = page + 4096ul,
+            .leaf = paging_fault_swap_leaf,
+        },
+        .error_code = error_code,
+        .handled = 0,
+    };
+    paging_walk(context, &fault.base);
+    if (fault.handled)
         return 1;
-    }
 
-    unsigned long *level2_table = (unsigned long *)(level3_entry & PAGING_ADDRESS_MASK);
-    unsigned int level2_index = ((unsigned long)virtual_address >> 21) & 0b111111111ul;
-    unsigned long level2_entry = level2_table[level2_index];
-    if (level2_entry == 0)
-    {
-        console_print("[paging_unmap] tried to unmap unallocated page (level2_entry)\n");
-        return 0;
-    }
-    if (level2_entry & PAGING_ENTRY_FLAG_SIZE)
+    if (error_code & PAGING_FAULT_PRESENT)
     {
-        unsigned long pages = ((bytes - 1) >> 21) + 1; // Divide by 2MB
-        if ((unsigned long)virtual_address & 0x1FFFFFul)
-        {
-            console_print("[paging_unmap] virtual_address must be aligned to 0x200000 bytes (2MiB, 2097152 bytes) when unmapping 2MB page!\n");
+        // The page exists, only writes to copy-on-write pages can be handled
+        if (!(error_code & PAGING_FAULT_WRITE) || !(region->flags & PAGING_FLAG_WRITE))
             return 0;
-        }
-
-        // Free 2MB huge pages
-        for (unsigned long i = 0; i < pages; i++)
-        {
-            level2_table[level2_index] = 0;
-            if (++level2_index >= 512ul)
-            {
-                if (++level3_index >= 512ul)
-                {
-                    if (++level4_index >= 512ul)
-                    {
-                        console_print("[paging_unmap] invalid 2MiB unmap, reached end of level4 table\n");
-                        return 0;
-                    }
-
-                    level3_index = 0;
-                    level3_table = (unsigned long *)(level4_table[level4_index] & PAGING_ADDRESS_MASK);
-                    if (!level3_table)
-                    {
-                        console_print("[paging_unmap] invalid 2MiB unmap, entering null level 3 table\n");
-                        return 0;
-                    }
-                }
 
-                level2_index = 0;
-                level2_table = (unsigned long *)(level3_table[level3_index] & PAGING_ADDRESS_MASK);
-                if (!level2_table)
-                {
-                    console_print("[paging_unmap] invalid 2MiB unmap, entering null level 2 table\n");
-                    return 0;
-                }
-            }
-        }
+        struct paging_walker copy = {
+            .start = page,
+            .end = page + 4096ul,
+            .leaf = paging_fault_copy_leaf,
+        };
+        if (!paging_walk(context, &copy))
+            return 0;
 
-        used_virtual_pages -= pages * 512ul;
+        paging_invalidate(context, page, page + 4096ul);
         return 1;
     }
 
-    unsigned long *level1_table = (unsigned long *)(level2_entry & PAGING_ADDRESS_MASK);
-    unsigned int level1_index = ((unsigned long)virtual_address >> 12) & 0b111111111ul;
-    unsigned long level1_entry = level1_table[level1_index];
-    if (level1_entry == 0)
-    {
-        console_print("[paging_unmap] tried to unmap unmapped page (level1_entry)\n");
+    if (!(region->flags & PAGING_FLAG_ON_DEMAND))
         return 0;
+    if ((error_code & PAGING_FAULT_WRITE) && !(region->flags & PAGING_FLAG_WRITE))
+        return 0;
+
+    unsigned long entry_flags = paging_convert_flags(region->flags);
+    unsigned long physical_address;
+    if (error_code & PAGING_FAULT_WRITE)
+    {
+        // Only writes need a private page
+        physical_address = (unsigned long)memory_physical_allocate();
+        if (!physical_address)
+            return 0;
+        memory_zero((void *)physical_address, 4096);
+        entry_flags |= PAGING_ENTRY_FLAG_OWNED;
+    }
+    else
+    {
+        // Reads get the shared zero page, the first write to it is handled as a copy-on-write fault
+        physical_address = (unsigned long)zero_page;
+        entry_flags = (entry_flags & ~PAGING_ENTRY_FLAG_WRITABLE) | PAGING_ENTRY_FLAG_COPY_ON_WRITE;
     }
 
-    unsigned long pages = ((bytes - 1) >> 12) + 1; // Divide by 4KB
-    if ((unsigned long)virtual_address & 0xFFFul)
+    struct paging_map_walker map = {
+        .base = {
+            .start = page,
+            .end = page + 4096ul,
+            .absent = paging_map_absent,
+            .table = paging_map_table,
+            .leaf = paging_map_leaf,
+        },
+        .leaf_level = 1,
+        .flags = region->flags,
+        .entry_flags = entry_flags,
+        .allocate = 0,
+        .physical_address = physical_address,
+    };
+    if (!paging_walk(context, &map.base))
     {
-        console_print("[paging_unmap] virtual_address must be aligned to 0xFFF bytes (4KiB, 4096 bytes) when unmapping page!\n");
+        if (error_code & PAGING_FAULT_WRITE)
+            memory_physical_free((void *)physical_address);
         return 0;
     }
+    return 1;
+}
 
-    for (unsigned long i = 0; i < pages; i++)
-    {
-        // Null entire entry, including present flag
-        level1_table[level1_index] = 0;
-        if (++level1_index >= 512ul)
-        {
-            if (++level2_index >= 512ul)
-            {
-                if (++level3_index >= 512ul)
-                {
-                    if (++level4_index >= 512ul)
-                    {
-                        console_print("[paging_unmap] invalid 4KiB unmap, reached end of level4 table\n");
-                        return 0;
-                    }
-
-                    level3_index = 0;
-                    level3_table = (unsigned long *)(level4_table[level4_index] & PAGING_ADDRESS_MASK);
-                    if (!level3_table)
-                    {
-                        console_print("[paging_unmap] invalid 2MiB unmap, entering null level 3 table\n");
-                        return 0;
-                    }
-                }
+int paging_handle_fault(struct paging_context *context, void *virtual_address, unsigned long error_code)
+{
+    unsigned long rflags = paging_lock(&context->lock);
+    int result = paging_handle_fault_locked(context, virtual_address, error_code);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
 
-                level2_index = 0;
-                level2_table = (unsigned long *)(level3_table[level3_index] & PAGING_ADDRESS_MASK);
-                if (!level2_table)
-                {
-                    console_print("[paging_unmap] invalid 2MiB unmap, entering null level 2 table\n");
-                    return 0;
-                }
-            }
+struct paging_lookup_walker
+{
+    struct paging_walker base;
+    unsigned long physical_address;
+};
 
-            level1_index = 0;
-            level1_table = (unsigned long *)(level2_table[level2_index] & PAGING_ADDRESS_MASK);
-            if (!level1_table)
-            {
-                console_print("[paging_unmap] invalid 2MiB unmap, entering null level 1 table\n");
-                return 0;
-            }
-        }
+static int paging_lookup_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_lookup_walker *lookup = (struct paging_lookup_walker *)walker;
+
+    // Swapped out pages have no physical address
+    if (!(table[index] & PAGING_ENTRY_FLAG_PRESENT))
+        return PAGING_WALK_STOP;
+
+    // Take the offset into the page (12, 21 or 30 bits) from the virtual address, the low address bits of a huge page entry are not part of its address
+    unsigned long page_address = paging_entry_address(table[index], level);
+    lookup->physical_address = page_address + (walker->start - address);
+    return PAGING_WALK_STOP;
+}
+
+static void *paging_get_physical_address_locked(struct paging_context *context, void *virtual_address)
+{
+    unsigned long virtual_page = (unsigned long)virtual_address & ~0xFFFul;
+    unsigned long offset = (unsigned long)virtual_address & 0xFFFul;
+
+    struct paging_translation *translation = &context->translations[(virtual_page >> 12) % PAGING_TRANSLATION_CACHE_SIZE];
+    if (translation->virtual_page == virtual_page)
+    {
+        return (void *)(translation->physical_page + offset);
     }
 
-    // TODO unallocate empty table
-    used_virtual_pages -= pages;
-    return 1;
+    struct paging_lookup_walker lookup = {
+        .base = {
+            .start = virtual_page,
+            .end = virtual_page + 1,
+            .leaf = paging_lookup_leaf,
+        },
+        .physical_address = 0,
+    };
+    paging_walk(context, &lookup.base);
+    if (!lookup.physical_address)
+    {
+        return 0;
+    }
+
+    translation->virtual_page = virtual_page;
+    translation->physical_page = lookup.physical_address;
+    return (void *)(lookup.physical_address + offset);
 }
 
 void *paging_get_physical_address(struct paging_context *context, void *virtual_address)
 {
-    unsigned long address = (unsigned long)virtual_address;
+    unsigned long rflags = paging_lock(&context->lock);
+    void *result = paging_get_physical_address_locked(context, virtual_address);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
+
+struct paging_ranges_walker
+{
+    struct paging_walker base;
+    struct paging_physical_range *ranges;
+    unsigned long max_ranges;
+    unsigned long range_count;
+};
+
+// Called for unmapped parts of the range
+static int paging_ranges_absent(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    return PAGING_WALK_STOP;
+}
+
+static int paging_ranges_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_ranges_walker *ranges = (struct paging_ranges_walker *)walker;
+    if (!(table[index] & PAGING_ENTRY_FLAG_PRESENT))
+        return PAGING_WALK_STOP;
 
-    unsigned long *level4_table = context->level4_table;
-    unsigned int level4_offset = (address >> 39) & 0b111111111ul;
-    unsigned long level4_entry = level4_table[level4_offset];
+    // Only take the part of the page that is in the range
+    unsigned long start = address > walker->start ? address : walker->start;
+    unsigned long end = address + PAGING_LEVEL_SIZE(level) < walker->end ? address + PAGING_LEVEL_SIZE(level) : walker->end;
+    unsigned long physical_address = paging_entry_address(table[index], level) + (start - address);
 
-    // Check if page is present
-    if (level4_entry == 0)
+    // Merge with the previous range if it is physically contiguous
+    if (ranges->range_count > 0)
     {
-        return 0;
+        struct paging_physical_range *last = &ranges->ranges[ranges->range_count - 1];
+        if (last->physical_address + last->bytes == physical_address)
+        {
+            last->bytes += end - start;
+            return PAGING_WALK_CONTINUE;
+        }
     }
-    if (!(level4_entry & PAGING_ENTRY_FLAG_PRESENT))
+
+    if (ranges->range_count >= ranges->max_ranges)
+        return PAGING_WALK_STOP;
+
+    ranges->ranges[ranges->range_count].physical_address = physical_address;
+    ranges->ranges[ranges->range_count].bytes = end - start;
+    ranges->range_count++;
+    return PAGING_WALK_CONTINUE;
+}
+
+static unsigned long paging_get_physical_ranges_locked(struct paging_context *context, void *virtual_address, unsigned long bytes, struct paging_physical_range *ranges, unsigned long max_ranges)
+{
+    struct paging_ranges_walker walker = {
+        .base = {
+            .start = (unsigned long)virtual_address,
+            .end = (unsigned long)virtual_address + bytes,
+            .absent = paging_ranges_absent,
+            .leaf = paging_ranges_leaf,
+        },
+        .ranges = ranges,
+        .max_ranges = max_ranges,
+        .range_count = 0,
+    };
+    if (!paging_walk(context, &walker.base))
     {
-        console_print("[paging_get_physical_address] warning: level4 not present but has address\n");
+        console_print("[paging_get_physical_ranges] range is not completely mapped or too many ranges\n");
+        return 0;
     }
+    return walker.range_count;
+}
+
+unsigned long paging_get_physical_ranges(struct paging_context *context, void *virtual_address, unsigned long bytes, struct paging_physical_range *ranges, unsigned long max_ranges)
+{
+    unsigned long rflags = paging_lock(&context->lock);
+    unsigned long result = paging_get_physical_ranges_locked(context, virtual_address, bytes, ranges, max_ranges);
+    paging_unlock(&context->lock, rflags);
+    return result;
+}
 
-    unsigned long *level3_table = (unsigned long *)(level4_entry & PAGING_ADDRESS_MASK);
-    unsigned int level3_offset = (address >> 30) & 0b111111111ul;
-    unsigned long level3_entry = level3_table[level3_offset];
+// Collapses a fully populated level1 table, pointed to by level2_entry, into a single 2MiB page
+// Returns 1 if the table was collapsed, 0 if it is not eligible and -1 if no 2MiB physical block is available
+static int paging_promote_table(struct paging_context *context, unsigned long *level2_entry)
+{
+    unsigned long *level1_table = (unsigned long *)(*level2_entry & PAGING_ADDRESS_MASK);
 
-    // Check if page is present
-    if (level3_entry == 0)
+    // All 512 entries must be present pages owned by the mapping and must have the same flags, the accessed and dirty bits may differ
+    unsigned long ignored_flags = PAGING_ADDRESS_MASK | PAGING_ENTRY_FLAG_ACCESSED | PAGING_ENTRY_FLAG_DIRTY;
+    unsigned long flags = level1_table[0] & ~ignored_flags;
+    if (!(flags & PAGING_ENTRY_FLAG_PRESENT) || !(flags & PAGING_ENTRY_FLAG_OWNED))
     {
         return 0;
     }
-    if (!(level3_entry & PAGING_ENTRY_FLAG_PRESENT))
+    for (int i = 1; i < 512; i++)
     {
-        console_print("[paging_get_physical_address] warning: level3 not present but has address\n");
+        if ((level1_table[i] & ~ignored_flags) != flags)
+        {
+            return 0;
+        }
     }
 
-    // Check if this is 1gb page
-    if (level3_entry & PAGING_ENTRY_FLAG_SIZE)
+    void *block = memory_physical_allocate_consecutive(512ul);
+    if (!block)
     {
-        return (void *)((level3_entry & 0xFFFFFFFFFF000ul) + (address & 0x3FFFFFFFul));
+        return -1;
     }
 
-    unsigned long *level2_table = (unsigned long *)(level3_entry & PAGING_ADDRESS_MASK);
-    unsigned int level2_offset = (address >> 21) & 0b111111111ul;
-    unsigned long level2_entry = level2_table[level2_offset];
-
-    // Check if page is present
-    if (level2_entry == 0)
+    // The process could be running on another cpu, make the pages read-only while they are copied. Writes wait in paging_handle_fault until the context is unlocked
+    if (flags & PAGING_ENTRY_FLAG_WRITABLE)
     {
-        return 0;
+        *level2_entry &= ~PAGING_ENTRY_FLAG_WRITABLE;
+        paging_flush(context);
+        paging_shootdown(context);
     }
-    if (!(level2_entry & PAGING_ENTRY_FLAG_PRESENT))
+
+    for (int i = 0; i < 512; i++)
     {
-        console_print("[paging_get_physical_address] warning: level2 not present but has address\n");
+        memory_copy((void *)(level1_table[i] & PAGING_ADDRESS_MASK), (unsigned char *)block + 4096ul * i, 4096);
     }
 
-    // Check if this is 2mb page
-    if (level2_entry & PAGING_ENTRY_FLAG_SIZE)
+    // Replace the level1 table with a 2MiB page, bit 7 means PAT in a 4KiB page entry but page size in a level2 entry
+    *level2_entry = ((unsigned long)block & PAGING_ADDRESS_MASK) | paging_entry_flags_to_huge(flags);
+
+    // The translations of the old pages are cached in the TLB when this is the current address space
+    paging_flush(context);
+    paging_shootdown(context);
+
+    for (int i = 0; i < 512; i++)
     {
-        return (void *)((level2_entry & 0xFFFFFFFFFF000ul) + (address & 0x1FFFFFul));
+        memory_physical_free((void *)(level1_table[i] & PAGING_ADDRESS_MASK));
     }
+    memory_physical_free(level1_table);
+    return 1;
+}
+
+struct paging_promote_walker
+{
+    struct paging_walker base;
+    struct paging_context *context;
+    unsigned long promoted;
+};
+
+static int paging_promote_walk_table(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_promote_walker *promote = (struct paging_promote_walker *)walker;
+    if (level > 2)
+        return PAGING_WALK_DESCEND;
 
-    unsigned long *level1_table = (unsigned long *)(level2_entry & PAGING_ADDRESS_MASK);
-    unsigned int level1_offset = (address >> 12) & 0b111111111ul; // The other offset fields are 9 bit indices into their 512 entry tables
-    unsigned long level1_entry = level1_table[level1_offset];
+    promote_scanned_tables++;
 
-    // Check if page is present
-    if (level1_entry == 0)
+    int result = paging_promote_table(promote->context, &table[index]);
+    if (result < 0)
     {
-        return 0;
+        // Physical memory is too fragmented, try again next scan
+        promote_failed++;
+        return PAGING_WALK_STOP;
     }
-    if (!(level1_entry & PAGING_ENTRY_FLAG_PRESENT))
+    if (result)
+        paging_translation_invalidate(promote->context, address, address + PAGING_LEVEL_SIZE(2));
+    promote->promoted += result;
+    return PAGING_WALK_CONTINUE;
+}
+
+unsigned long paging_promote(struct paging_context *context)
+{
+    // Only level1 tables are visited, empty ranges and existing huge pages are skipped
+    struct paging_promote_walker promote = {
+        .base = {
+            .start = 0,
+            .end = PAGING_REGION_MAXIMUM,
+            .table = paging_promote_walk_table,
+        },
+        .context = context,
+        .promoted = 0,
+    };
+    unsigned long rflags = paging_lock(&context->lock);
+    paging_walk(context, &promote.base);
+    paging_unlock(&context->lock, rflags);
+
+    promote_collapsed_tables += promote.promoted;
+    return promote.promoted;
+}
+
+void paging_promote_worker()
+{
+    console_print("[paging] huge page promotion started\n");
+
+    while (1)
     {
-        console_print("[paging_get_physical_address] warning: level1 not present but has address\n");
+        unsigned long promoted = 0;
+
+        struct scheduler_process *process = 0;
+        while (process = scheduler_process_iterate(process))
+        {
+            promoted += paging_promote(&process->paging_context);
+        }
+
+        if (promoted)
+        {
+            paging_promote_debug();
+        }
+
+        scheduler_sleep(PAGING_PROMOTE_INTERVAL * 1000000ul);
     }
+}
 
-    unsigned int offset = address & 0b111111111111ul; // Offset is 12 bits because each page is 4096 bytes in size
-    return (void *)((level1_entry & 0xFFFFFFFFFF000ul) + offset);
+void paging_promote_debug()
+{
+    console_print("[paging] promoted ");
+    console_print_u64(promote_collapsed_tables, 10);
+    console_print(" level1 tables to 2MiB pages, scanned ");
+    console_print_u64(promote_scanned_tables, 10);
+    console_print(" tables, ");
+    console_print_u64(promote_failed, 10);
+    console_print(" failed without a free 2MiB block\n");
 }
 
 unsigned long paging_used_pages()
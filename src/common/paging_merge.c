@@ -0,0 +1,477 @@
+#include "kokos/paging_merge.h"
+#include "kokos/memory_physical.h"
+#include "kokos/memory.h"
+#include "kokos/console.h"
+#include "kokos/cpu.h"
+#include "kokos/scheduler.h"
+
+// A page in the stable or unstable tree, sorted by hash, pages with the same hash are stored to the right
+struct paging_merge_node
+{
+    unsigned long hash;
+    // The physical page
+    void *page;
+    // Where the page is mapped, only used for pages in the unstable tree
+    struct paging_context *context;
+    unsigned long address;
+    struct paging_merge_node *left;
+    struct paging_merge_node *right;
+};
+
+// The trees are also changed by page faults and unmaps on other cpus, they are only used while merge_lock is held
+static int merge_lock = 0;
+// Merged pages
+static struct paging_merge_node *stable_tree = 0;
+// Candidates of the current scan
+static struct paging_merge_node *unstable_tree = 0;
+// Unused node structs, linked together using their left field
+static struct paging_merge_node *free_nodes = 0;
+
+// The amount of pages in the stable tree
+static unsigned long merge_pages_shared = 0;
+// The amount of mappings that point to a page in the stable tree
+static unsigned long merge_pages_sharing = 0;
+// The amount of pages that were replaced with the zero page
+static unsigned long merge_pages_zero = 0;
+// The hash of a page filled with zeroes
+static unsigned int zero_hash = 0;
+static unsigned long merge_scanned_pages = 0;
+
+// Returns an unused node struct, or 0 if there is no physical memory left
+static struct paging_merge_node *paging_merge_node_allocate()
+{
+    if (!free_nodes)
+    {
+        // Split a new page into node structs
+        struct paging_merge_node *page = memory_physical_allocate();
+        if (!page)
+            return 0;
+        for (unsigned long i = 0; i < 4096ul / sizeof(struct paging_merge_node); i++)
+        {
+            page[i].left = free_nodes;
+            free_nodes = &page[i];
+        }
+    }
+
+    struct paging_merge_node *node = free_nodes;
+    free_nodes = node->left;
+    node->left = 0;
+    node->right = 0;
+    return node;
+}
+
+static void paging_merge_node_free(struct paging_merge_node *node)
+{
+    node->left = free_nodes;
+    free_nodes = node;
+}
+
+// Hashes the contents of a page (FNV-1a on 8 byte words)
+static unsigned int paging_merge_hash(void *page)
+{
+    unsigned long hash = 0xcbf29ce484222325ul;
+    unsigned long *words = page;
+    for (int i = 0; i < 512; i++)
+    {
+        hash = (hash ^ words[i]) * 0x100000001b3ul;
+    }
+    return (unsigned int)(hash ^ (hash >> 32));
+}
+
+static void paging_merge_insert(struct paging_merge_node **root, struct paging_merge_node *node)
+{
+    while (*root)
+    {
+        root = node->hash < (*root)->hash ? &(*root)->left : &(*root)->right;
+    }
+    *root = node;
+}
+
+// Returns the location of the pointer to node in the tree
+static struct paging_merge_node **paging_merge_find_node(struct paging_merge_node **root, struct paging_merge_node *node)
+{
+    while (*root && *root != node)
+    {
+        root = node->hash < (*root)->hash ? &(*root)->left : &(*root)->right;
+    }
+    return root;
+}
+
+// Unlinks node from the tree
+static void paging_merge_remove(struct paging_merge_node **root, struct paging_merge_node *node)
+{
+    struct paging_merge_node **location = paging_merge_find_node(root, node);
+    if (!*location)
+        return;
+
+    if (!node->left)
+    {
+        *location = node->right;
+    }
+    else if (!node->right)
+    {
+        *location = node->left;
+    }
+    else
+    {
+        // Replace the node with the leftmost node of its right subtree, which keeps equal hashes to the right
+        struct paging_merge_node **minimum = &node->right;
+        while ((*minimum)->left)
+            minimum = &(*minimum)->left;
+
+        struct paging_merge_node *replacement = *minimum;
+        *minimum = replacement->right;
+        replacement->left = node->left;
+        replacement->right = node->right;
+        *location = replacement;
+    }
+}
+
+// Returns the node in the tree with the same contents as page, or 0
+static struct paging_merge_node *paging_merge_find(struct paging_merge_node *node, unsigned long hash, void *page)
+{
+    while (node)
+    {
+        if (hash < node->hash)
+        {
+            node = node->left;
+        }
+        else
+        {
+            // Different pages can have the same hash, so the contents must be compared
+            if (hash == node->hash && node->page != page && memory_compare(node->page, page, 4096))
+                return node;
+            node = node->right;
+        }
+    }
+    return 0;
+}
+
+// Returns the node of page in the tree, or 0
+static struct paging_merge_node *paging_merge_find_page(struct paging_merge_node *node, unsigned long hash, void *page)
+{
+    while (node)
+    {
+        if (hash < node->hash)
+        {
+            node = node->left;
+        }
+        else
+        {
+            if (node->page == page)
+                return node;
+            node = node->right;
+        }
+    }
+    return 0;
+}
+
+static void paging_merge_free_tree(struct paging_merge_node *node)
+{
+    if (!node)
+        return;
+    paging_merge_free_tree(node->left);
+    paging_merge_free_tree(node->right);
+    paging_merge_node_free(node);
+}
+
+// Returns a page entry that maps page read-only (copy-on-write) with the same permissions as entry
+static unsigned long paging_merge_entry(unsigned long entry, void *page)
+{
+    unsigned long flags = entry & ~PAGING_ADDRESS_MASK & ~PAGING_ENTRY_FLAG_OWNED & ~PAGING_ENTRY_FLAG_WRITABLE;
+    return (unsigned long)page | flags | PAGING_ENTRY_FLAG_COPY_ON_WRITE;
+}
+
+struct paging_merge_find_walker
+{
+    struct paging_walker base;
+    unsigned long *entry;
+};
+
+static int paging_merge_find_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_merge_find_walker *find = (struct paging_merge_find_walker *)walker;
+    if (level == 1)
+        find->entry = &table[index];
+    return PAGING_WALK_STOP;
+}
+
+// Returns the 4KiB page entry that maps address, or 0
+static unsigned long *paging_merge_find_entry(struct paging_context *context, unsigned long address)
+{
+    struct paging_merge_find_walker find = {
+        .base = {
+            .start = address,
+            .end = address + 1,
+            .leaf = paging_merge_find_leaf,
+        },
+        .entry = 0,
+    };
+    paging_walk(context, &find.base);
+    return find.entry;
+}
+
+struct paging_merge_walker
+{
+    struct paging_walker base;
+    struct paging_context *context;
+    unsigned long merged;
+};
+
+// Tries to merge a single page, merge_lock and the lock of context must be held and entry must be read-only
+static int paging_merge_page(struct paging_context *context, unsigned long *entry, unsigned long address, unsigned long hash)
+{
+    void *page = (void *)(*entry & PAGING_ADDRESS_MASK);
+
+    // Pages with only zeroes are replaced with the zero page
+    void *zero_page = paging_get_zero_page();
+    if (hash == zero_hash && memory_compare(page, zero_page, 4096))
+    {
+        *entry = paging_merge_entry(*entry, zero_page);
+        memory_physical_free(page);
+        paging_invalidate(context, address, address + 4096ul);
+        merge_pages_zero++;
+        return 1;
+    }
+
+    struct paging_merge_node *stable = paging_merge_find(stable_tree, hash, page);
+    if (stable)
+    {
+        struct memory_physical_page *shared = memory_physical_get_page(stable->page);
+        if (shared->share_count >= PAGING_MERGE_MAX_SHARES)
+            return 0;
+
+        *entry = paging_merge_entry(*entry, stable->page);
+        shared->share_count++;
+        merge_pages_sharing++;
+        memory_physical_free(page);
+        paging_invalidate(context, address, address + 4096ul);
+        return 1;
+    }
+
+    struct paging_merge_node *unstable = paging_merge_find(unstable_tree, hash, page);
+    if (unstable)
+    {
+        // The other address space is locked by another cpu, try again next scan
+        struct paging_context *other_context = unstable->context;
+        unsigned long other_rflags;
+        if (other_context != context && !paging_try_lock(&other_context->lock, &other_rflags))
+            return 0;
+
+        // The other page could have been unmapped or written since it was added to the unstable tree
+        int merged = 0;
+        unsigned long *other_entry = paging_merge_find_entry(other_context, unstable->address);
+        if (other_entry && (*other_entry & PAGING_ADDRESS_MASK) == (unsigned long)unstable->page && (*other_entry & PAGING_ENTRY_FLAG_OWNED))
+        {
+            // Make the other page read-only too before comparing, see paging_merge_leaf
+            unsigned long other_original_entry = *other_entry;
+            if (other_original_entry & PAGING_ENTRY_FLAG_WRITABLE)
+            {
+                *other_entry = other_original_entry & ~PAGING_ENTRY_FLAG_WRITABLE;
+                paging_invalidate(other_context, unstable->address, unstable->address + 4096ul);
+            }
+
+            if (memory_compare(unstable->page, page, 4096))
+            {
+                paging_merge_remove(&unstable_tree, unstable);
+
+                // The page of the other mapping becomes the merged page
+                *other_entry = paging_merge_entry(*other_entry, unstable->page);
+                paging_invalidate(other_context, unstable->address, unstable->address + 4096ul);
+                *entry = paging_merge_entry(*entry, unstable->page);
+                memory_physical_free(page);
+                paging_invalidate(context, address, address + 4096ul);
+
+                memory_physical_get_page(unstable->page)->share_count = 2;
+                merge_pages_shared++;
+                merge_pages_sharing += 2;
+
+                unstable->context = 0;
+                unstable->address = 0;
+                paging_merge_insert(&stable_tree, unstable);
+                merged = 1;
+            }
+            else
+            {
+                *other_entry = other_original_entry;
+            }
+        }
+
+        if (other_context != context)
+            paging_unlock(&other_context->lock, other_rflags);
+        return merged;
+    }
+
+    // Without memory for the node the page is not remembered, it is tried again next scan
+    struct paging_merge_node *candidate = paging_merge_node_allocate();
+    if (!candidate)
+        return 0;
+    candidate->hash = hash;
+    candidate->page = page;
+    candidate->context = context;
+    candidate->address = address;
+    paging_merge_insert(&unstable_tree, candidate);
+    return 0;
+}
+
+static int paging_merge_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_merge_walker *merge = (struct paging_merge_walker *)walker;
+
+    // Only private 4KiB pages can be merged
+    unsigned long entry = table[index];
+    if (level != 1 || !(entry & PAGING_ENTRY_FLAG_OWNED) || (entry & PAGING_ENTRY_FLAG_COPY_ON_WRITE))
+        return PAGING_WALK_CONTINUE;
+
+    merge_scanned_pages++;
+
+    void *page = (void *)(entry & PAGING_ADDRESS_MASK);
+    unsigned int hash = paging_merge_hash(page);
+
+    // Skip pages that changed since the last scan, they are probably written again soon
+    struct memory_physical_page *info = memory_physical_get_page(page);
+    if (info->checksum != hash)
+    {
+        info->checksum = hash;
+        return PAGING_WALK_CONTINUE;
+    }
+
+    unsigned long rflags = paging_lock(&merge_lock);
+
+    // The process could be running on another cpu, make the page read-only while it is compared. Writes wait in paging_handle_fault until the context is unlocked
+    if (entry & PAGING_ENTRY_FLAG_WRITABLE)
+    {
+        table[index] = entry & ~PAGING_ENTRY_FLAG_WRITABLE;
+        paging_invalidate(merge->context, address, address + 4096ul);
+    }
+
+    if (paging_merge_page(merge->context, &table[index], address, hash))
+        merge->merged++;
+    else
+        table[index] = entry;
+
+    paging_unlock(&merge_lock, rflags);
+    return PAGING_WALK_CONTINUE;
+}
+
+unsigned long paging_merge(struct paging_context *context)
+{
+    struct paging_merge_walker merge = {
+        .base = {
+            .leaf = paging_merge_leaf,
+        },
+        .context = context,
+        .merged = 0,
+    };
+
+    if (!zero_hash)
+        zero_hash = paging_merge_hash(paging_get_zero_page());
+
+    unsigned long rflags = paging_lock(&context->lock);
+    struct paging_region *region = 0;
+    while (region = paging_region_iterate(context->regions, region))
+    {
+        if (!(region->flags & PAGING_FLAG_MERGEABLE))
+            continue;
+
+        merge.base.start = region->start;
+        merge.base.end = region->end;
+        paging_walk(context, &merge.base);
+    }
+
+    paging_unlock(&context->lock, rflags);
+    return merge.merged;
+}
+
+void paging_merge_release(void *page)
+{
+    unsigned long rflags = paging_lock(&merge_lock);
+
+    struct memory_physical_page *info = memory_physical_get_page(page);
+    if (info->share_count > 0)
+    {
+        info->share_count--;
+        merge_pages_sharing--;
+        if (info->share_count == 0)
+        {
+            struct paging_merge_node *node = paging_merge_find_page(stable_tree, paging_merge_hash(page), page);
+            if (node)
+            {
+                paging_merge_remove(&stable_tree, node);
+                paging_merge_node_free(node);
+            }
+            merge_pages_shared--;
+            memory_physical_free(page);
+        }
+    }
+
+    paging_unlock(&merge_lock, rflags);
+}
+
+int paging_merge_take(void *page)
+{
+    unsigned long rflags = paging_lock(&merge_lock);
+
+    int taken = 0;
+    struct memory_physical_page *info = memory_physical_get_page(page);
+    if (info->share_count == 1)
+    {
+        struct paging_merge_node *node = paging_merge_find_page(stable_tree, paging_merge_hash(page), page);
+        if (node)
+        {
+            paging_merge_remove(&stable_tree, node);
+            paging_merge_node_free(node);
+        }
+        info->share_count = 0;
+        merge_pages_shared--;
+        merge_pages_sharing--;
+        taken = 1;
+    }
+
+    paging_unlock(&merge_lock, rflags);
+    return taken;
+}
+
+void paging_merge_worker()
+{
+    console_print("[paging] same page merging started\n");
+
+    while (1)
+    {
+        unsigned long merged = 0;
+
+        struct scheduler_process *process = 0;
+        while (process = scheduler_process_iterate(process))
+        {
+            merged += paging_merge(&process->paging_context);
+        }
+
+        // Candidates are only compared within one scan
+        unsigned long rflags = paging_lock(&merge_lock);
+        paging_merge_free_tree(unstable_tree);
+        unstable_tree = 0;
+        paging_unlock(&merge_lock, rflags);
+
+        if (merged)
+        {
+            paging_merge_debug();
+        }
+
+        scheduler_sleep(PAGING_MERGE_INTERVAL * 1000000ul);
+    }
+}
+
+void paging_merge_debug()
+{
+    console_print("[paging] merged pages: ");
+    console_print_u64(merge_pages_shared, 10);
+    console_print(" pages shared by ");
+    console_print_u64(merge_pages_sharing, 10);
+    console_print(" mappings (");
+    console_print_u64(merge_pages_sharing - merge_pages_shared, 10);
+    console_print(" pages saved), ");
+    console_print_u64(merge_pages_zero, 10);
+    console_print(" pages replaced with the zero page, scanned ");
+    console_print_u64(merge_scanned_pages, 10);
+    console_print(" pages\n");
+}
@@ -0,0 +1,411 @@
+#include "kokos/paging_region.h"
+#include "kokos/paging.h"
+#include "kokos/memory_physical.h"
+#include "kokos/console.h"
+#include "kokos/util.h"
+
+// Unused region structs, linked together using their left field
+static struct paging_region *free_regions = 0;
+// Taken using paging_lock, the callers hold the lock of a paging_context so interrupts are disabled and shootdowns must be handled while waiting
+static int region_lock = 0;
+
+// Returns an unused region struct, or 0 if there is no physical memory left
+static struct paging_region *paging_region_allocate()
+{
+    unsigned long rflags = paging_lock(&region_lock);
+
+    while (!free_regions)
+    {
+        // memory_physical_allocate can swap out pages to free memory, which waits for other cpus to flush their TLB (see paging_shootdown),
+        // so region_lock is not held while allocating
+        paging_unlock(&region_lock, rflags);
+        struct paging_region *page = memory_physical_allocate();
+        if (!page)
+        {
+            console_print("[paging_region_allocate] could not allocate region structs\n");
+            return 0;
+        }
+        rflags = paging_lock(&region_lock);
+
+        // Split the new page into region structs
+        for (unsigned long i = 0; i < 4096ul / sizeof(struct paging_region); i++)
+        {
+            page[i].left = free_regions;
+            free_regions = &page[i];
+        }
+    }
+
+    struct paging_region *region = free_regions;
+    free_regions = region->left;
+
+    paging_unlock(&region_lock, rflags);
+    return region;
+}
+
+static void paging_region_free(struct paging_region *region)
+{
+    unsigned long rflags = paging_lock(&region_lock);
+    region->left = free_regions;
+    free_regions = region;
+    paging_unlock(&region_lock, rflags);
+}
+
+static inline int paging_region_height(struct paging_region *node)
+{
+    return node ? node->height : 0;
+}
+
+// Recalculates the height and the subtree information of node from its children
+static void paging_region_update(struct paging_region *node)
+{
+    int left_height = paging_region_height(node->left);
+    int right_height = paging_region_height(node->right);
+    node->height = (left_height > right_height ? left_height : right_height) + 1;
+
+    node->subtree_start = node->left ? node->left->subtree_start : node->start;
+    node->subtree_end = node->right ? node->right->subtree_end : node->end;
+
+    node->largest_gap = 0;
+    if (node->left)
+    {
+        unsigned long gap = node->start - node->left->subtree_end;
+        if (node->left->largest_gap > node->largest_gap)
+            node->largest_gap = node->left->largest_gap;
+        if (gap > node->largest_gap)
+            node->largest_gap = gap;
+    }
+    if (node->right)
+    {
+        unsigned long gap = node->right->subtree_start - node->end;
+        if (node->right->largest_gap > node->largest_gap)
+            node->largest_gap = node->right->largest_gap;
+        if (gap > node->largest_gap)
+            node->largest_gap = gap;
+    }
+}
+
+static struct paging_region *paging_region_rotate_right(struct paging_region *node)
+{
+    struct paging_region *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    paging_region_update(node);
+    paging_region_update(left);
+    return left;
+}
+
+static struct paging_region *paging_region_rotate_left(struct paging_region *node)
+{
+    struct paging_region *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    paging_region_update(node);
+    paging_region_update(right);
+    return right;
+}
+
+// Restores the AVL property of node (the heights of both subtrees may only differ by one) and returns the new subtree root
+static struct paging_region *paging_region_balance(struct paging_region *node)
+{
+    paging_region_update(node);
+
+    int balance = paging_region_height(node->left) - paging_region_height(node->right);
+    if (balance > 1)
+    {
+        if (paging_region_height(node->left->left) < paging_region_height(node->left->right))
+            node->left = paging_region_rotate_left(node->left);
+        return paging_region_rotate_right(node);
+    }
+    if (balance < -1)
+    {
+        if (paging_region_height(node->right->right) < paging_region_height(node->right->left))
+            node->right = paging_region_rotate_right(node->right);
+        return paging_region_rotate_left(node);
+    }
+    return node;
+}
+
+static struct paging_region *paging_region_insert(struct paging_region *node, struct paging_region *region)
+{
+    if (!node)
+        return region;
+
+    if (region->start < node->start)
+        node->left = paging_region_insert(node->left, region);
+    else
+        node->right = paging_region_insert(node->right, region);
+    return paging_region_balance(node);
+}
+
+// Unlinks the leftmost node of the subtree and stores it in minimum
+static struct paging_region *paging_region_remove_minimum(struct paging_region *node, struct paging_region **minimum)
+{
+    if (!node->left)
+    {
+        *minimum = node;
+        return node->right;
+    }
+
+    node->left = paging_region_remove_minimum(node->left, minimum);
+    return paging_region_balance(node);
+}
+
+static struct paging_region *paging_region_remove(struct paging_region *node, struct paging_region *region)
+{
+    if (!node)
+        return 0;
+
+    if (region->start < node->start)
+    {
+        node->left = paging_region_remove(node->left, region);
+    }
+    else if (region->start > node->start)
+    {
+        node->right = paging_region_remove(node->right, region);
+    }
+    else
+    {
+        // Replace the node with the leftmost node of its right subtree
+        struct paging_region *left = node->left;
+        struct paging_region *right = node->right;
+        if (!right)
+            return left;
+
+        struct paging_region *minimum;
+        right = paging_region_remove_minimum(right, &minimum);
+        minimum->left = left;
+        minimum->right = right;
+        return paging_region_balance(minimum);
+    }
+    return paging_region_balance(node);
+}
+
+static struct paging_region *paging_region_create(unsigned long start, unsigned long end, unsigned long flags)
+{
+    struct paging_region *region = paging_region_allocate();
+    if (!region)
+        return 0;
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->left = 0;
+    region->right = 0;
+    paging_region_update(region);
+    return region;
+}
+
+// Returns a region that overlaps with start ... end, or 0 if there is none
+static struct paging_region *paging_region_find_overlap(struct paging_region *node, unsigned long start, unsigned long end)
+{
+    while (node)
+    {
+        if (end <= node->start)
+            node = node->left;
+        else if (start >= node->end)
+            node = node->right;
+        else
+            return node;
+    }
+    return 0;
+}
+
+struct paging_region *paging_region_find(struct paging_region *node, unsigned long virtual_address)
+{
+    return paging_region_find_overlap(node, virtual_address, virtual_address + 1);
+}
+
+// The best spot found while searching for free virtual memory
+struct paging_region_fit
+{
+    unsigned long start;
+    unsigned long gap_size;
+};
+
+// Checks if bytes bytes fit in the gap gap_start ... gap_end and if it is smaller than the best gap found until now
+static void paging_region_fit_gap(unsigned long gap_start, unsigned long gap_end, unsigned long bytes, unsigned long alignment, struct paging_region_fit *best)
+{
+    unsigned long start = ALIGN_TO_NEXT(gap_start, alignment);
+    if (start < gap_start || start >= gap_end || gap_end - start < bytes)
+        return;
+
+    if (gap_end - gap_start < best->gap_size)
+    {
+        best->start = start;
+        best->gap_size = gap_end - gap_start;
+    }
+}
+
+static void paging_region_find_fit(struct paging_region *node, unsigned long bytes, unsigned long alignment, struct paging_region_fit *best)
+{
+    // Skip subtrees that do not have a gap that is large enough, and stop searching when a perfect fit was found
+    if (!node || node->largest_gap < bytes || best->gap_size == bytes)
+        return;
+
+    if (node->left)
+    {
+        paging_region_find_fit(node->left, bytes, alignment, best);
+        paging_region_fit_gap(node->left->subtree_end, node->start, bytes, alignment, best);
+    }
+    if (node->right)
+    {
+        paging_region_fit_gap(node->end, node->right->subtree_start, bytes, alignment, best);
+        paging_region_find_fit(node->right, bytes, alignment, best);
+    }
+}
+
+struct paging_region *paging_region_reserve(struct paging_region **root, unsigned long bytes, unsigned long alignment, unsigned long flags)
+{
+    if (bytes == 0)
+        return 0;
+
+    struct paging_region_fit best = {
+        .start = 0,
+        .gap_size = ~0ul,
+    };
+
+    if (*root)
+    {
+        // Also check the gaps before the first and after the last region
+        paging_region_fit_gap(PAGING_REGION_MINIMUM, (*root)->subtree_start, bytes, alignment, &best);
+        paging_region_find_fit(*root, bytes, alignment, &best);
+        paging_region_fit_gap((*root)->subtree_end, PAGING_REGION_MAXIMUM, bytes, alignment, &best);
+    }
+    else
+    {
+        paging_region_fit_gap(PAGING_REGION_MINIMUM, PAGING_REGION_MAXIMUM, bytes, alignment, &best);
+    }
+
+    if (best.gap_size == ~0ul)
+    {
+        console_print("[paging_region_reserve] exceeded available virtual memory\n");
+        return 0;
+    }
+
+    struct paging_region *region = paging_region_create(best.start, best.start + bytes, flags);
+    if (!region)
+        return 0;
+    *root = paging_region_insert(*root, region);
+    return region;
+}
+
+struct paging_region *paging_region_reserve_at(struct paging_region **root, unsigned long start, unsigned long bytes, unsigned long flags)
+{
+    if (bytes == 0 || paging_region_find_overlap(*root, start, start + bytes))
+        return 0;
+
+    struct paging_region *region = paging_region_create(start, start + bytes, flags);
+    if (!region)
+        return 0;
+    *root = paging_region_insert(*root, region);
+    return region;
+}
+
+int paging_region_set_flags(struct paging_region **root, unsigned long start, unsigned long bytes, unsigned long flags)
+{
+    unsigned long end = start + bytes;
+    struct paging_region *region = paging_region_find_overlap(*root, start, end);
+    if (!region || region->start > start || region->end < end)
+        return 0;
+    if (region->flags == flags)
+        return 1;
+
+    // Create the parts before and after the range first, so nothing is changed when there is no memory for them
+    struct paging_region *before = 0;
+    struct paging_region *after = 0;
+    if (region->start < start && !(before = paging_region_create(region->start, start, region->flags)))
+        return 0;
+    if (region->end > end && !(after = paging_region_create(end, region->end, region->flags)))
+    {
+        if (before)
+            paging_region_free(before);
+        return 0;
+    }
+
+    *root = paging_region_remove(*root, region);
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->left = 0;
+    region->right = 0;
+    paging_region_update(region);
+    *root = paging_region_insert(*root, region);
+    if (before)
+        *root = paging_region_insert(*root, before);
+    if (after)
+        *root = paging_region_insert(*root, after);
+    return 1;
+}
+
+void paging_region_release(struct paging_region **root, unsigned long start, unsigned long bytes)
+{
+    unsigned long end = start + bytes;
+
+    struct paging_region *region;
+    while (region = paging_region_find_overlap(*root, start, end))
+    {
+        *root = paging_region_remove(*root, region);
+
+        // Put back the parts of the region that are outside of the released range. The removed struct is reused for one of them,
+        // so only releasing the middle of a region needs a new struct
+        if (region->end > end && region->start < start)
+        {
+            struct paging_region *after = paging_region_create(end, region->end, region->flags);
+            if (after)
+                *root = paging_region_insert(*root, after);
+            else
+                console_print("[paging_region_release] could not keep the end of the region reserved\n");
+        }
+        if (region->start < start || region->end > end)
+        {
+            if (region->start >= start)
+                region->start = end;
+            else
+                region->end = start;
+            region->left = 0;
+            region->right = 0;
+            paging_region_update(region);
+            *root = paging_region_insert(*root, region);
+        }
+        else
+        {
+            paging_region_free(region);
+        }
+    }
+}
+
+struct paging_region *paging_region_iterate(struct paging_region *node, struct paging_region *previous)
+{
+    // Find the region with the lowest start address after previous
+    struct paging_region *next = 0;
+    while (node)
+    {
+        if (!previous || node->start > previous->start)
+        {
+            next = node;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    return next;
+}
+
+void paging_region_debug(struct paging_region *node)
+{
+    if (!node)
+        return;
+
+    paging_region_debug(node->left);
+
+    console_print("[paging_region] 0x");
+    console_print_u64(node->start, 16);
+    console_print(" .. 0x");
+    console_print_u64(node->end, 16);
+    console_print(" flags 0b");
+    console_print_u64(node->flags, 2);
+    console_new_line();
+
+    paging_region_debug(node->right);
+}
@@ -0,0 +1,356 @@
+#include "kokos/paging_swap.h"
+#include "kokos/memory_physical.h"
+#include "kokos/memory.h"
+#include "kokos/console.h"
+#include "kokos/cpu.h"
+#include "kokos/scheduler.h"
+#include "kokos/util.h"
+#include "kokos/lz.h"
+
+// The page entry bits that are kept in the entry of a swapped out page
+#define PAGING_SWAP_KEPT_FLAGS (PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_EVERYONE_ACCESS | PAGING_ENTRY_FLAG_WRITETHROUGH | PAGING_ENTRY_FLAG_CACHE_DISABLED | PAGING_ENTRY_FLAG_PAT | PAGING_ENTRY_FLAG_NO_EXECUTE)
+
+// Every store page starts with this header, followed by the compressed pages, which each start with their size (2 bytes) and are aligned to 8 bytes
+struct paging_swap_store
+{
+    // The amount of compressed pages in this store page
+    unsigned short objects;
+    // The amount of bytes of this store page that are used, including the header
+    unsigned short used;
+};
+
+// The store page that new compressed pages are added to
+static struct paging_swap_store *current_store = 0;
+static void *reserve_pages[PAGING_SWAP_RESERVE_PAGES];
+static int reserve_count = 0;
+// Held while swapping out, only one cpu swaps out at a time and this prevents memory_physical_allocate from calling paging_swap_reclaim again
+static int reclaim_lock = 0;
+// Held while the store and the reserved pages are used
+static int store_lock = 0;
+// The highest age of a page that was found during the last scan
+static unsigned char highest_age = 0;
+// Compressed data is written here first, it is only used while reclaim_lock is held
+static unsigned char compress_buffer[PAGING_SWAP_MAX_COMPRESSED];
+
+static unsigned long swap_stored_pages = 0;
+static unsigned long swap_stored_bytes = 0;
+static unsigned long swap_store_pages = 0;
+static unsigned long swap_outs = 0;
+static unsigned long swap_ins = 0;
+static unsigned long swap_rejected = 0;
+
+static struct paging_swap_store *paging_swap_store_allocate()
+{
+    struct paging_swap_store *store = memory_physical_allocate();
+    if (!store && reserve_count > 0)
+    {
+        store = reserve_pages[--reserve_count];
+    }
+    if (!store)
+    {
+        return 0;
+    }
+
+    store->objects = 0;
+    store->used = ALIGN_TO_NEXT(sizeof(struct paging_swap_store), 8);
+    swap_store_pages++;
+    return store;
+}
+
+static void paging_swap_store_free(struct paging_swap_store *store)
+{
+    memory_physical_free(store);
+    swap_store_pages--;
+}
+
+// Fills up the reserved store pages again
+static void paging_swap_refill_reserve()
+{
+    while (reserve_count < PAGING_SWAP_RESERVE_PAGES)
+    {
+        void *page = memory_physical_allocate();
+        if (!page)
+            break;
+
+        unsigned long rflags = paging_lock(&store_lock);
+        if (reserve_count < PAGING_SWAP_RESERVE_PAGES)
+        {
+            reserve_pages[reserve_count++] = page;
+            page = 0;
+        }
+        paging_unlock(&store_lock, rflags);
+
+        if (page)
+            memory_physical_free(page);
+    }
+}
+
+// Copies size bytes of compressed data into the store and returns its address, or 0 if no store page could be allocated. store_lock must be held
+static unsigned long paging_swap_store_add(unsigned char *data, unsigned long size)
+{
+    unsigned long needed = ALIGN_TO_NEXT(sizeof(unsigned short) + size, 8);
+    if (!current_store || current_store->used + needed > 4096)
+    {
+        struct paging_swap_store *store = paging_swap_store_allocate();
+        if (!store)
+            return 0;
+
+        if (current_store && current_store->objects == 0)
+            paging_swap_store_free(current_store);
+        current_store = store;
+    }
+
+    unsigned char *object = (unsigned char *)current_store + current_store->used;
+    *(unsigned short *)object = size;
+    memory_copy(data, object + sizeof(unsigned short), size);
+    current_store->used += needed;
+    current_store->objects++;
+
+    swap_stored_pages++;
+    swap_stored_bytes += size;
+    return (unsigned long)object;
+}
+
+// Frees the compressed data at object, store_lock must be held
+static void paging_swap_store_remove(unsigned long object)
+{
+    struct paging_swap_store *store = (struct paging_swap_store *)(object & ~0xFFFul);
+    swap_stored_pages--;
+    swap_stored_bytes -= *(unsigned short *)object;
+
+    store->objects--;
+    if (store->objects == 0 && store != current_store)
+        paging_swap_store_free(store);
+}
+
+static inline unsigned long paging_swap_entry_object(unsigned long entry)
+{
+    return ((entry & PAGING_ADDRESS_MASK) >> 12) << 3;
+}
+
+struct paging_swap_walker
+{
+    struct paging_walker base;
+    struct paging_context *context;
+    // Only pages that were not accessed for at least this amount of scans are swapped out
+    unsigned char minimum_age;
+    // The amount of pages that still have to be swapped out
+    unsigned long remaining;
+    // Set if an accessed bit was cleared, the TLB must be flushed so the processor sets it again
+    int accessed;
+};
+
+// Returns 1 if the page of this entry can be swapped out
+static inline int paging_swap_is_candidate(unsigned long entry, int level)
+{
+    return level == 1 && (entry & PAGING_ENTRY_FLAG_PRESENT) && (entry & PAGING_ENTRY_FLAG_OWNED) && !(entry & PAGING_ENTRY_FLAG_COPY_ON_WRITE);
+}
+
+static int paging_swap_age_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_swap_walker *swap = (struct paging_swap_walker *)walker;
+
+    unsigned long entry = table[index];
+    if (!paging_swap_is_candidate(entry, level))
+        return PAGING_WALK_CONTINUE;
+
+    struct memory_physical_page *info = memory_physical_get_page((void *)(entry & PAGING_ADDRESS_MASK));
+    if (entry & PAGING_ENTRY_FLAG_ACCESSED)
+    {
+        table[index] = entry & ~PAGING_ENTRY_FLAG_ACCESSED;
+        info->age = 0;
+        swap->accessed = 1;
+    }
+    else if (info->age < 255)
+    {
+        info->age++;
+        if (info->age > highest_age)
+            highest_age = info->age;
+    }
+    return PAGING_WALK_CONTINUE;
+}
+
+static int paging_swap_out_leaf(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address)
+{
+    struct paging_swap_walker *swap = (struct paging_swap_walker *)walker;
+
+    unsigned long entry = table[index];
+    if (!paging_swap_is_candidate(entry, level) || (entry & PAGING_ENTRY_FLAG_ACCESSED))
+        return PAGING_WALK_CONTINUE;
+
+    void *page = (void *)(entry & PAGING_ADDRESS_MASK);
+    struct memory_physical_page *info = memory_physical_get_page(page);
+    if (info->age < swap->minimum_age)
+        return PAGING_WALK_CONTINUE;
+
+    // The process could be running on another cpu, remove the page while it is compressed so it cannot be written meanwhile.
+    // Accesses wait in paging_handle_fault until the context is unlocked
+    table[index] = entry & ~PAGING_ENTRY_FLAG_PRESENT;
+    paging_invalidate(swap->context, address, address + 4096ul);
+
+    unsigned long size = lz_compress(page, 4096, compress_buffer, PAGING_SWAP_MAX_COMPRESSED);
+    if (!size)
+    {
+        // Does not compress well, try again when it is older
+        table[index] = entry;
+        info->age = 0;
+        swap_rejected++;
+        return PAGING_WALK_CONTINUE;
+    }
+
+    unsigned long rflags = paging_lock(&store_lock);
+    unsigned long object = paging_swap_store_add(compress_buffer, size);
+    paging_unlock(&store_lock, rflags);
+    if (!object)
+    {
+        table[index] = entry;
+        return PAGING_WALK_STOP;
+    }
+
+    table[index] = ((object >> 3) << 12) | (entry & PAGING_SWAP_KEPT_FLAGS);
+    info->age = 0;
+    memory_physical_free(page);
+    swap_outs++;
+
+    if (--swap->remaining == 0)
+        return PAGING_WALK_STOP;
+    return PAGING_WALK_CONTINUE;
+}
+
+// Walks the swappable mappings of every process, when wait is 0, processes that are locked by another cpu (or by the current cpu, which is allocating memory) are skipped
+static void paging_swap_walk_processes(struct paging_swap_walker *swap, int wait)
+{
+    struct scheduler_process *process = 0;
+    while (process = scheduler_process_iterate(process))
+    {
+        swap->context = &process->paging_context;
+        swap->accessed = 0;
+
+        unsigned long rflags;
+        if (wait)
+            rflags = paging_lock(&swap->context->lock);
+        else if (!paging_try_lock(&swap->context->lock, &rflags))
+            continue;
+
+        int stopped = 0;
+        struct paging_region *region = 0;
+        while (!stopped && (region = paging_region_iterate(swap->context->regions, region)))
+        {
+            if (!(region->flags & PAGING_FLAG_SWAPPABLE))
+                continue;
+
+            swap->base.start = region->start;
+            swap->base.end = region->end;
+            stopped = !paging_walk(swap->context, &swap->base);
+        }
+
+        if (swap->accessed)
+            paging_invalidate(swap->context, 0, PAGING_REGION_MAXIMUM);
+
+        paging_unlock(&swap->context->lock, rflags);
+        if (stopped)
+            return;
+    }
+}
+
+unsigned long paging_swap_reclaim(unsigned long pages)
+{
+    unsigned long rflags;
+    if (pages == 0 || !paging_try_lock(&reclaim_lock, &rflags))
+        return 0;
+
+    struct paging_swap_walker swap = {
+        .base = {
+            .leaf = paging_swap_out_leaf,
+        },
+        .remaining = pages,
+    };
+
+    // Swap out the oldest pages first
+    int age = highest_age;
+    while (age >= 0 && swap.remaining > 0)
+    {
+        swap.minimum_age = age;
+        paging_swap_walk_processes(&swap, 0);
+        age--;
+    }
+
+    paging_unlock(&reclaim_lock, rflags);
+    return pages - swap.remaining;
+}
+
+int paging_swap_load(unsigned long entry, void *page)
+{
+    unsigned long rflags = paging_lock(&store_lock);
+
+    unsigned long object = paging_swap_entry_object(entry);
+    unsigned long size = *(unsigned short *)object;
+    int loaded = lz_decompress((unsigned char *)object + sizeof(unsigned short), size, page, 4096) == 4096;
+    if (loaded)
+    {
+        paging_swap_store_remove(object);
+        swap_ins++;
+    }
+    else
+    {
+        console_print("[paging_swap_load] compressed page is corrupt\n");
+    }
+
+    paging_unlock(&store_lock, rflags);
+    return loaded;
+}
+
+void paging_swap_free(unsigned long entry)
+{
+    unsigned long rflags = paging_lock(&store_lock);
+    paging_swap_store_remove(paging_swap_entry_object(entry));
+    paging_unlock(&store_lock, rflags);
+}
+
+void paging_swap_worker()
+{
+    console_print("[paging] swapping started\n");
+
+    paging_swap_refill_reserve();
+    memory_physical_set_reclaim(paging_swap_reclaim);
+
+    while (1)
+    {
+        // Age the pages, this also happens when there is enough memory so the ages are known when memory runs low
+        highest_age = 0;
+        struct paging_swap_walker age = {
+            .base = {
+                .leaf = paging_swap_age_leaf,
+            },
+        };
+        paging_swap_walk_processes(&age, 1);
+
+        unsigned long total_pages = memory_physical_total_pages();
+        unsigned long free_pages = total_pages - memory_physical_used_pages();
+        if (free_pages < total_pages / PAGING_SWAP_LOW_WATERMARK)
+        {
+            paging_swap_reclaim(total_pages / PAGING_SWAP_HIGH_WATERMARK - free_pages);
+            paging_swap_debug();
+        }
+        paging_swap_refill_reserve();
+
+        scheduler_sleep(PAGING_SWAP_INTERVAL * 1000000ul);
+    }
+}
+
+void paging_swap_debug()
+{
+    console_print("[paging] swapped ");
+    console_print_u64(swap_stored_pages, 10);
+    console_print(" pages into ");
+    console_print_u64(swap_store_pages, 10);
+    console_print(" pages (");
+    console_print_u64(swap_stored_bytes, 10);
+    console_print(" bytes compressed), ");
+    console_print_u64(swap_outs, 10);
+    console_print(" swap outs, ");
+    console_print_u64(swap_ins, 10);
+    console_print(" swap ins, ");
+    console_print_u64(swap_rejected, 10);
+    console_print(" incompressible\n");
+}
@@ -6,58 +6,341 @@
 #include "kokos/idt.h"
 #include "kokos/lock.h"
 #include "kokos/util.h"
+#include "kokos/fpu.h"
+#include "kokos/time.h"
+#include "kokos/idle.h"
 
 // Defined in src/x86_64/schedule.asm, this assembly code calls scheduler_handle_interrupt below
 extern void(scheduler_interrupt)();
+// Defined in src/x86_64/schedule.asm, switches to the stack of another thread and to level4_table when it is not 0, see the note on context switches in scheduler.h
+extern void scheduler_switch(void **saved_stack_pointer, void *stack_pointer, void *level4_table);
 
 unsigned int print_lock = 0;
 unsigned int counters[16] = {0};
 
-void scheduler_handle_interrupt(struct scheduler_interrupt_frame *stack)
+// The cpus that are isolated, see scheduler_set_isolated
+static volatile unsigned long isolated_cpus = 0;
+
+// Returns the waiting thread of cpu that is cheapest to move to destination (the one that did not run for the longest time), or 0 if every waiting thread
+// is cache hot, was migrated recently, has its FPU state in the registers of cpu or may not run on destination. The scheduler_lock of cpu must be held
+static struct scheduler_thread *scheduler_find_migratable(struct cpu *cpu, struct cpu *destination, unsigned long now)
 {
-    struct cpu *current_cpu = cpu_get_current();
+    unsigned long cache_hot_time = time_ns_to_cycles(SCHEDULER_CACHE_HOT_TIME);
+    unsigned long migration_cost = time_ns_to_cycles(SCHEDULER_MIGRATION_COST);
+    struct scheduler_thread *best = 0;
+    struct scheduler_thread *thread = 0;
+    while (thread = scheduler_fair_iterate(&cpu->fair_queue, thread))
+    {
+        if (thread != cpu->fpu_owner && (thread->affinity & CPU_MASK(destination->id)) && now - thread->last_run >= cache_hot_time && now - thread->last_migration >= migration_cost && (!best || thread->last_run < best->last_run))
+        {
+            best = thread;
+        }
+    }
+    return best;
+}
 
-    // Allow more interrupts to be handled
-    CPU_APIC->end_of_interrupt = 0;
+// Returns the amount of threads of the cpus that share level of the topology with cpu (one of CPU_TOPOLOGY_*), including cpu itself
+static unsigned int scheduler_group_load(struct cpu *cpu, int level)
+{
+    unsigned int load = 0;
+    struct cpu *other_cpu = 0;
+    while (other_cpu = cpu_iterate(other_cpu))
+    {
+        if (cpu_topology_distance(cpu, other_cpu) <= level)
+            load += other_cpu->thread_count;
+    }
+    return load;
+}
+
+// Returns 1 if a thread is better placed on cpu (which runs threads threads) than on best (which runs best_threads threads): on the cpu that runs the least threads,
+// and when they run the same amount, on the one whose core, last level cache and package run the least threads. So threads are spread over cores before SMT siblings get a second one
+static int scheduler_less_loaded(struct cpu *cpu, unsigned int threads, struct cpu *best, unsigned int best_threads)
+{
+    if (threads != best_threads)
+        return threads < best_threads;
+
+    for (int level = CPU_TOPOLOGY_SAME_CORE; level <= CPU_TOPOLOGY_SAME_PACKAGE; level++)
+    {
+        unsigned int load = scheduler_group_load(cpu, level);
+        unsigned int best_load = scheduler_group_load(best, level);
+        if (load != best_load)
+            return load < best_load;
+    }
+    return 0;
+}
+
+// Returns 1 if cpu should take a thread from other rather than from busiest. An idle cpu takes a waiting thread from the nearest cpu in the topology
+// (an SMT sibling or a cpu sharing its last level cache, where the data of the thread may still be cached), otherwise threads are taken from the cpu that runs the most
+static int scheduler_better_source(struct cpu *cpu, struct cpu *other, struct cpu *busiest, int idle)
+{
+    // A cpu that runs a single thread has no waiting thread that could be taken
+    int other_waiting = other->thread_count > 1;
+    int busiest_waiting = busiest->thread_count > 1;
+    int other_distance = cpu_topology_distance(cpu, other);
+    int busiest_distance = cpu_topology_distance(cpu, busiest);
+    if (idle && other_waiting != busiest_waiting)
+        return other_waiting;
+    if (idle && other_waiting && other_distance != busiest_distance)
+        return other_distance < busiest_distance;
+    if (other->thread_count != busiest->thread_count)
+        return other->thread_count > busiest->thread_count;
+    return other_distance < busiest_distance;
+}
+
+// Moves a thread from the busiest other cpu to the run queue of cpu. When idle is set, any waiting thread is taken (a steal), preferably from a nearby cpu,
+// otherwise the busiest cpu must run at least SCHEDULER_IMBALANCE threads more than cpu. The scheduler_lock of cpu must be held
+static void scheduler_balance(struct cpu *cpu, unsigned long now, int idle)
+{
+    // Isolated cpus only run the threads that are placed on them
+    if (isolated_cpus & CPU_MASK(cpu->id))
+        return;
+
+    struct cpu *busiest = 0;
+    struct cpu *other_cpu = 0;
+    while (other_cpu = cpu_iterate(other_cpu))
+    {
+        if (other_cpu != cpu && (!busiest || scheduler_better_source(cpu, other_cpu, busiest, idle)))
+        {
+            busiest = other_cpu;
+        }
+    }
+
+    if (!busiest || busiest->thread_count == 0 || (!idle && busiest->thread_count < cpu->thread_count + SCHEDULER_IMBALANCE))
+        return;
+
+    // Two cpus could be balancing with each other at the same time, so do not wait for the lock of the other cpu, try again next time instead
+    if (!lock_try_acquire(&busiest->scheduler_lock))
+        return;
+
+    struct scheduler_thread *thread = scheduler_find_migratable(busiest, cpu, now);
+    if (thread)
+    {
+        scheduler_fair_dequeue(&busiest->fair_queue, thread);
+        busiest->thread_count--;
+        scheduler_fair_migrate(&busiest->fair_queue, &cpu->fair_queue, thread);
+        scheduler_fair_enqueue(&cpu->fair_queue, thread);
+        cpu->thread_count++;
+
+        thread->cpu = cpu;
+        thread->last_migration = now;
+        if (idle)
+            cpu->steals++;
+        else
+            cpu->migrations++;
+    }
+
+    lock_release(&busiest->scheduler_lock);
+}
+
+// Tickless cpus do not balance by themselves, wakes up the least busy one if it should take a thread from cpu. The scheduler_lock of cpu must be held.
+// This runs on every schedule, so it only looks for a cpu to wake up every SCHEDULER_BALANCE_INTERVAL interrupts, and the topology (which walks every cpu
+// for every candidate, see scheduler_less_loaded) is only used to choose between cpus that run the least threads when one of them will be woken up
+static void scheduler_kick_balancer(struct cpu *cpu)
+{
+    if (cpu->scheduler_ticks % SCHEDULER_BALANCE_INTERVAL != 0 || !scheduler_fair_first(&cpu->fair_queue))
+        return;
 
-    struct scheduler_process *next = current_cpu->current_process->next;
-    if (current_cpu->current_process != next)
+    int found = 0;
+    unsigned int least_threads = 0;
+    struct cpu *other_cpu = 0;
+    while (other_cpu = cpu_iterate(other_cpu))
     {
-        // There are other processes scheduled on this CPU, switch process now
-        // TODO preserve xmm/mmx registers
+        if (other_cpu != cpu && other_cpu->timer_stopped && !(isolated_cpus & CPU_MASK(other_cpu->id)) && (!found || other_cpu->thread_count < least_threads))
+        {
+            found = 1;
+            least_threads = other_cpu->thread_count;
+        }
+    }
+    if (!found || (least_threads != 0 && least_threads + SCHEDULER_IMBALANCE > cpu->thread_count))
+        return;
 
-        // console_print("next #");
-        // console_print_u64(next->id, 10);
-        // console_print(" rip 0x");
-        // console_print_u64(current_cpu->current_process->saved_instruction_pointer, 16);
-        // console_print(" -> 0x");
-        // console_print_u64(next->saved_instruction_pointer, 16);
-        // console_print(" rsp 0x");
-        // console_print_u64(current_cpu->current_process->saved_stack_pointer, 16);
-        // console_print(" -> 0x");
-        // console_print_u64(next->saved_stack_pointer, 16);
-        // console_new_line();
+    struct cpu *least_busy = 0;
+    other_cpu = 0;
+    while (other_cpu = cpu_iterate(other_cpu))
+    {
+        if (other_cpu != cpu && other_cpu->timer_stopped && !(isolated_cpus & CPU_MASK(other_cpu->id)) && other_cpu->thread_count == least_threads &&
+            (!least_busy || scheduler_less_loaded(other_cpu, other_cpu->thread_count, least_busy, least_busy->thread_count)))
+        {
+            least_busy = other_cpu;
+        }
+    }
 
-        // Save current registers
-        current_cpu->current_process->saved_rflags = stack->base.rflags;
-        current_cpu->current_process->saved_instruction_pointer = stack->base.instruction_pointer;
-        current_cpu->current_process->saved_stack_pointer = stack->base.stack_pointer;
-        current_cpu->current_process->saved_registers = stack->registers;
+    // The thread counts could have changed since the first loop, they are read without the locks of the other cpus
+    if (least_busy)
+    {
+        least_busy->balance_request = 1;
+        idle_wake(least_busy);
+    }
+}
 
-        // Restore next process registers
-        stack->base.instruction_pointer = next->saved_instruction_pointer;
-        stack->base.stack_pointer = next->saved_stack_pointer;
-        stack->base.rflags = next->saved_rflags;
-        stack->registers = next->saved_registers;
+// Lowers *event to time, an event of 0 means no event
+static inline void scheduler_set_event(unsigned long *event, unsigned long time)
+{
+    if (time && (!*event || time < *event))
+        *event = time;
+}
 
-        // Set new page table
-        asm volatile("mov cr3, %0" ::"a"(next->paging_context.level4_table));
+// Programs the timer of the current cpu to interrupt at event, or stops it when event is 0. The scheduler_lock of cpu must be held
+static void scheduler_program_timer(struct cpu *cpu, unsigned long now, unsigned long event)
+{
+    cpu->timer_stopped = !event;
+    unsigned long minimum = time_ns_to_cycles(SCHEDULER_TIMER_MINIMUM);
+    if (event && event < now + minimum)
+        event = now + minimum;
+    cpu->timer_event = event;
+
+    if (cpu->timer_tsc_deadline)
+    {
+        // The timer interrupts when the time stamp counter reaches the deadline, a deadline of 0 stops it
+        cpu_write_msr(CPU_MSR_TSC_DEADLINE, event);
+        return;
+    }
 
-        current_cpu->current_process = next;
+    if (!event)
+    {
+        CPU_APIC->timer_initial_count = 0;
+        return;
     }
 
-    // Restart timer
-    CPU_APIC->timer_initial_count = SCHEDULER_TIMER_INTERVAL;
+    unsigned long ticks = (event - now) * cpu->timer_ticks_per_megacycle / 1000000ul;
+    if (ticks == 0)
+        ticks = 1;
+    else if (ticks > 0xFFFFFFFFul)
+        ticks = 0xFFFFFFFFul;
+    CPU_APIC->timer_initial_count = ticks;
+}
+
+// Counts the context switch that just finished, called by the next thread right after scheduler_switch returned to it. The scheduler_lock of cpu must be held
+static inline void scheduler_switch_done(struct cpu *cpu)
+{
+    cpu->switches++;
+    cpu->switch_cycles += cpu_timestamp() - cpu->switch_start;
+}
+
+// Chooses the thread that runs next on cpu and switches to it. When yield is set, the running fair thread gives up the rest of its slice.
+// The scheduler_lock of cpu must be held and interrupts must be disabled. If another thread was switched to, this returns when the current thread is scheduled again,
+// possibly on another cpu, so the caller must release the scheduler_lock of cpu_get_current() afterwards
+static void scheduler_schedule(struct cpu *current_cpu, int yield)
+{
+    // The idle thread does not take part in fair or deadline scheduling, it only runs when there are no other threads
+    unsigned long now = cpu_timestamp();
+    idle_exit(current_cpu, now);
+    struct scheduler_thread *current = current_cpu->current_thread;
+    struct scheduler_thread *fair_current = current != current_cpu->idle_thread && current->policy == SCHEDULER_POLICY_FAIR ? current : 0;
+    struct scheduler_thread *deadline_running = current != current_cpu->idle_thread && current->policy == SCHEDULER_POLICY_DEADLINE ? current : 0;
+    scheduler_fair_update(&current_cpu->fair_queue, fair_current, now);
+    scheduler_deadline_update(&current_cpu->deadline_queue, deadline_running, now);
+    scheduler_deadline_release(&current_cpu->deadline_queue, now);
+
+    // Wake up the threads whose sleep ended, the current thread could be one of them if it just started sleeping.
+    // A current thread that is still blocked must not run again and is not put back in the run queue
+    scheduler_wheel_run(&current_cpu->wheel, now);
+    struct scheduler_thread *fair_running = fair_current && fair_current->state == SCHEDULER_THREAD_RUNNABLE ? fair_current : 0;
+
+    // An idle cpu looks for work on every interrupt, a busy cpu only balances every SCHEDULER_BALANCE_INTERVAL interrupts or when another cpu asks for it
+    current_cpu->scheduler_ticks++;
+    if (current_cpu->thread_count == 0)
+        scheduler_balance(current_cpu, now, 1);
+    else if (current_cpu->scheduler_ticks % SCHEDULER_BALANCE_INTERVAL == 0 || current_cpu->balance_request)
+        scheduler_balance(current_cpu, now, 0);
+    current_cpu->balance_request = 0;
+
+    // Ready deadline threads go before fair threads
+    struct scheduler_thread *next = scheduler_deadline_first(&current_cpu->deadline_queue);
+    if (!next)
+    {
+        struct scheduler_thread *first = scheduler_fair_first(&current_cpu->fair_queue);
+        if (first && (!fair_running || yield || scheduler_fair_should_preempt(&current_cpu->fair_queue, fair_running, now)))
+        {
+            scheduler_fair_dequeue(&current_cpu->fair_queue, first);
+            next = first;
+        }
+        else
+        {
+            next = fair_running ? fair_running : current_cpu->idle_thread;
+        }
+    }
+
+    // The running fair thread is not in the tree, put it back when it is switched out
+    if (fair_running && next != fair_running)
+        scheduler_fair_enqueue(&current_cpu->fair_queue, fair_running);
+
+    if (current != next)
+    {
+        next->fair.exec_start = now;
+        next->fair.slice_start = now;
+        next->deadline.exec_start = now;
+    }
+
+    // Interrupt again at the next event: when the slice of the running thread ends while others are waiting, when the budget of a running deadline
+    // thread is used up, when a deadline thread can run again or when a timer expires. A cpu that is idle or runs a single thread does not get interrupted
+    unsigned long event = 0;
+    if (next != current_cpu->idle_thread && next->policy == SCHEDULER_POLICY_DEADLINE)
+        scheduler_set_event(&event, now + next->deadline.remaining);
+    else if (next != current_cpu->idle_thread && scheduler_fair_first(&current_cpu->fair_queue))
+        scheduler_set_event(&event, scheduler_fair_slice_end(&current_cpu->fair_queue, next));
+    scheduler_set_event(&event, scheduler_deadline_next_release(&current_cpu->deadline_queue));
+    scheduler_set_event(&event, scheduler_wheel_next_event(&current_cpu->wheel));
+    scheduler_program_timer(current_cpu, now, event);
+
+    scheduler_kick_balancer(current_cpu);
+
+    if (current == next)
+        return;
+
+    // Another thread should run now, switch thread
+    // The FPU registers are switched lazily, when next uses them (see fpu.h)
+    fpu_switch(current_cpu, next);
+    current->last_run = now;
+    current_cpu->switch_start = now;
+
+    // Kernel threads and threads of the process that is loaded already keep the page table, so the TLB stays valid. Otherwise set the loaded process
+    // before the page table, so other cpus that change its page tables after this send this cpu a TLB flush request (see paging_shootdown)
+    current_cpu->current_thread = next;
+    void *level4_table = 0;
+    if (next->process && next->process != current_cpu->current_process)
+    {
+        current_cpu->current_process = next->process;
+        current_cpu->address_space_switches++;
+        level4_table = next->process->paging_context.level4_table;
+    }
+
+    // Continues in next, current continues here when it is switched to again
+    scheduler_switch(&current->saved_stack_pointer, next->saved_stack_pointer, level4_table);
+    scheduler_switch_done(cpu_get_current());
+}
+
+void scheduler_handle_interrupt()
+{
+    // This is an interrupt gate, interrupts stay disabled until the next thread enables them (using iretq, cpu_restore_interrupts or in scheduler_start),
+    // so the next SCHEDULER_VECTOR from the timer or another cpu cannot interrupt the switch even though the end of interrupt is sent right away
+    CPU_APIC->end_of_interrupt = 0;
+
+    // Other cpus can add threads to this cpu's run queue, see scheduler_execute and scheduler_balance
+    struct cpu *current_cpu = cpu_get_current();
+    lock_acquire(&current_cpu->scheduler_lock);
+    scheduler_schedule(current_cpu, 0);
+
+    // The thread may have been switched out and continue on another cpu now
+    lock_release(&cpu_get_current()->scheduler_lock);
+}
+
+// New threads start here, scheduler_switch returns to it the first time the thread runs (see scheduler_create_thread)
+static void scheduler_start()
+{
+    struct cpu *cpu = cpu_get_current();
+    scheduler_switch_done(cpu);
+    void (*entrypoint)() = cpu->current_thread->entrypoint;
+    lock_release(&cpu->scheduler_lock);
+
+    asm volatile("sti");
+    entrypoint();
+
+    // Threads cannot exit yet
+    while (1)
+    {
+        asm volatile("hlt");
+    }
 }
 
 void scheduler_initialize()
@@ -65,36 +348,115 @@ void scheduler_initialize()
     struct cpu *cpu = cpu_get_current();
 
     // Register the local APIC timer, see https://kokos.run/#WzAsIkFNRDY0Vm9sdW1lMi5wZGYiLDY1NyxbNjU3LDMxLDY1NywzMV1d
-    // Not using interrupt gate, because hardware interrupts are still allowed while the cpu is switching threads
-    idt_register_interrupt(0x23, scheduler_interrupt, IDT_GATE_TYPE_TRAP, IDT_STACK_TYPE_SCHEDULER);
-    CPU_APIC->timer_initial_count = SCHEDULER_TIMER_INTERVAL;
-    // Use divisor 128
-    CPU_APIC->timer_divide_config = 0b1010;
-    // Use one-shot mode, when an scheduler interrupt is done, it re-enables the one-shot mode.
-    CPU_APIC->timer_vector = 0x23;
+    // The handler runs on the stack of the interrupted thread, which is saved there while other threads run (see scheduler_switch).
+    // It uses an interrupt gate, the scheduler_lock is held while it runs and the switch itself cannot be interrupted
+    idt_register_interrupt(SCHEDULER_VECTOR, scheduler_interrupt, IDT_GATE_TYPE_INTERRUPT, IDT_STACK_TYPE_CURRENT);
+    if (cpu_id(0x1).ecx & CPU_ID_TSC_DEADLINE_ECX)
+    {
+        // Use TSC-deadline mode, the timer is programmed with the time stamp counter value at which it should interrupt, see scheduler_program_timer
+        cpu->timer_tsc_deadline = 1;
+        CPU_APIC->timer_vector = SCHEDULER_VECTOR | CPU_APIC_TIMER_TSC_DEADLINE;
+        // The mode switch must be done before the deadline is written, the MSR write is not ordered with memory writes
+        asm volatile("mfence" ::
+                         : "memory");
+        console_print("[scheduler] using TSC-deadline timer\n");
+    }
+    else
+    {
+        // Use divisor 1, for the most precise one-shot counts
+        cpu->timer_tsc_deadline = 0;
+        CPU_APIC->timer_divide_config = 0b1011;
+
+        // Measure the speed of the timer against the time stamp counter, so events can be converted to timer ticks. Mask the timer interrupt meanwhile
+        CPU_APIC->timer_vector = SCHEDULER_VECTOR | CPU_APIC_TIMER_MASKED;
+        CPU_APIC->timer_initial_count = 0xFFFFFFFF;
+        unsigned long start = cpu_timestamp();
+        while (cpu_timestamp() - start < SCHEDULER_TIMER_CALIBRATION)
+            asm volatile("pause");
+        cpu->timer_ticks_per_megacycle = (0xFFFFFFFFul - CPU_APIC->timer_current_count) * 1000000ul / SCHEDULER_TIMER_CALIBRATION;
+        CPU_APIC->timer_initial_count = 0;
+
+        // Use one-shot mode, each scheduler interrupt programs the timer to the next event
+        CPU_APIC->timer_vector = SCHEDULER_VECTOR;
+        console_print("[scheduler] TSC-deadline timer not supported, using one-shot timer with ");
+        console_print_u64(cpu->timer_ticks_per_megacycle, 10);
+        console_print(" ticks per million cycles\n");
+    }
+
+    // Schedule as soon as possible, the first interrupt programs the timer to the next event
+    unsigned long now = cpu_timestamp();
+    scheduler_program_timer(cpu, now, now);
+}
+
+// Makes a blocked thread of cpu runnable again and adds it to its run queue. The scheduler_lock of cpu must be held
+static void scheduler_wake_locked(struct cpu *cpu, struct scheduler_thread *thread)
+{
+    if (thread->state != SCHEDULER_THREAD_RUNNABLE)
+    {
+        thread->state = SCHEDULER_THREAD_RUNNABLE;
+        cpu->thread_count++;
+
+        // A thread that blocked but was not switched out yet is still the current thread, it just continues running
+        if (thread != cpu->current_thread)
+        {
+            scheduler_fair_place(&cpu->fair_queue, thread, 1);
+            scheduler_fair_enqueue(&cpu->fair_queue, thread);
+        }
+    }
+}
+
+// Called by the timer wheel when the sleep of a thread ended, the scheduler_lock of its cpu is held
+static void scheduler_sleep_expired(struct scheduler_wheel_timer *timer)
+{
+    struct scheduler_thread *thread = timer->data;
+    scheduler_wake_locked(thread->cpu, thread);
+}
+
+// Wakes up a blocked thread, possibly of another cpu. Interrupts must be disabled
+static void scheduler_wake(struct scheduler_thread *thread)
+{
+    // A blocked thread is not in a run queue, so it is not migrated and its cpu does not change
+    struct cpu *cpu = thread->cpu;
+    lock_acquire(&cpu->scheduler_lock);
+    scheduler_wake_locked(cpu, thread);
+    int stopped = cpu->timer_stopped;
+    lock_release(&cpu->scheduler_lock);
+
+    // The cpu does not get scheduler interrupts by itself when its timer is stopped
+    if (stopped)
+        idle_wake(cpu);
+}
+
+// Returns 1 if the current thread of cpu can block, see the note on sleeping and waiting
+static inline int scheduler_can_block(struct cpu *cpu)
+{
+    return cpu->current_thread != cpu->idle_thread && cpu->current_thread->policy == SCHEDULER_POLICY_FAIR;
 }
 
 static unsigned long current_process_id = 0;
+// The first process in the list of all processes, linked together using all_next
+static struct scheduler_process *all_processes = 0;
+static unsigned long current_thread_id = 0;
+// The first thread in the list of all threads, linked together using all_next
+static struct scheduler_thread *all_threads = 0;
+// Held while a process or thread is added to the list of all processes or threads and while the ids are incremented
+static int all_processes_lock = 0;
 
 extern unsigned long max_memory_address;
 
-void scheduler_execute(void (*entrypoint)())
+// Allocates a new process without threads whose threads run on the cpus in affinity and adds it to the list of all processes, returns 0 if no memory is available
+static struct scheduler_process *scheduler_create_process(struct cpu *cpu, unsigned long affinity)
 {
-    struct cpu *cpu = cpu_get_current();
-
     struct scheduler_process *process = memory_physical_allocate();
-    process->id = current_process_id++;
+    if (!process)
+        return 0;
 
     // Set up page table information
-    process->paging_context.level4_table = memory_physical_allocate();
-    memory_zero(process->paging_context.level4_table, 4096);
-    process->paging_context.level3_table = 0;
-    process->paging_context.level2_table = 0;
-    process->paging_context.level1_table = 0;
-    process->paging_context.level4_index = 0;
-    process->paging_context.level3_index = 0;
-    process->paging_context.level2_index = 0;
-    process->paging_context.level1_index = 0;
+    if (!paging_context_initialize(&process->paging_context))
+    {
+        memory_physical_free(process);
+        return 0;
+    }
 
     // Identity map RAM
     if (paging_get_hugepages_supported())
@@ -102,7 +464,7 @@ void scheduler_execute(void (*entrypoint)())
         console_print("[paging] identity map using 1GiB pages\n");
 
         // Identity map whole memory using 1GB huge pages
-        paging_map_physical_at(&process->paging_context, 0, 0, ALIGN_TO_NEXT(max_memory_address, 0x40000000ul), PAGING_FLAG_1GB | PAGING_FLAG_READ | PAGING_FLAG_WRITE);
+        paging_map_physical_at(&process->paging_context, 0, 0, ALIGN_TO_NEXT(max_memory_address, 0x40000000ul), PAGING_FLAG_1GB | PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_EXECUTE | PAGING_FLAG_GLOBAL);
 
         console_print("[paging] done\n");
     }
@@ -111,37 +473,506 @@ void scheduler_execute(void (*entrypoint)())
         console_print("[paging] identity map using 2MiB pages (1GiB pages not supported)\n");
 
         // Identity map whole memory using 2MB huge pages
-        paging_map_physical_at(&process->paging_context, 0, 0, ALIGN_TO_NEXT(max_memory_address, 0x200000ul), PAGING_FLAG_2MB | PAGING_FLAG_READ | PAGING_FLAG_WRITE);
+        paging_map_physical_at(&process->paging_context, 0, 0, ALIGN_TO_NEXT(max_memory_address, 0x200000ul), PAGING_FLAG_2MB | PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_EXECUTE | PAGING_FLAG_GLOBAL);
 
         console_print("[paging] done\n");
     }
 
+    // The identity mapping is at address 0, which paging_map_physical_at also returns when it fails, but a failed mapping releases its region
+    int mapped = paging_region_find(process->paging_context.regions, 0) != 0;
+
     // Map the local apic at the fixed apic virtual address
-    paging_map_physical_at(&process->paging_context, cpu->local_apic_physical, CPU_APIC_ADDRESS, sizeof(struct apic), PAGING_FLAG_WRITE | PAGING_FLAG_READ);
+    if (mapped)
+        mapped = paging_map_physical_at(&process->paging_context, cpu->local_apic_physical, CPU_APIC_ADDRESS, sizeof(struct apic), PAGING_FLAG_WRITE | PAGING_FLAG_READ | PAGING_FLAG_GLOBAL | PAGING_FLAG_UNCACHED) != 0;
+    if (!mapped)
+    {
+        console_print("[scheduler] could not create the address space of a process\n");
+        paging_context_destroy(&process->paging_context);
+        memory_physical_free(process);
+        return 0;
+    }
+    process->thread_count = 0;
+    process->affinity = affinity;
+
+    // Insert new process into the list of all processes
+    unsigned long rflags = cpu_disable_interrupts();
+    lock_acquire(&all_processes_lock);
+    process->id = current_process_id++;
+    process->all_next = all_processes;
+    all_processes = process;
+    lock_release(&all_processes_lock);
+    cpu_restore_interrupts(rflags);
+
+    return process;
+}
 
-    process->saved_rflags = 0b1001000110; // Default flags
-    memory_zero(&process->saved_registers, sizeof(struct scheduler_saved_registers));
-    process->saved_stack_pointer = (unsigned char *)paging_map(&process->paging_context, 4096ul * 8ul, PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_USER) + 4096ul * 8ul;
-    process->saved_instruction_pointer = entrypoint;
+// Allocates a new thread of process (0 for a kernel thread) that starts at entrypoint and adds it to the list of all threads, it is not added to a run queue yet.
+// Returns 0 if no memory is available
+static struct scheduler_thread *scheduler_create_thread(struct scheduler_process *process, void (*entrypoint)())
+{
+    struct scheduler_thread *thread = memory_physical_allocate();
+    if (!thread)
+        return 0;
 
-    // Temporary disable scheduler interrupt
-    asm volatile("cli");
+    // Without its own state, the first FPU instruction of the thread would restore the state from address 0
+    thread->fpu_state = fpu_create_state();
+    if (!thread->fpu_state)
+    {
+        memory_physical_free(thread);
+        return 0;
+    }
 
-    // Insert new process into linked list
-    if (cpu->current_process)
+    // The stack of a thread of a process is mapped in its address space, the stack of a kernel thread is identity mapped memory, which every address space maps
+    unsigned char *stack_top;
+    unsigned long *stack;
+    if (process)
     {
-        // Insert new process into linked list
-        process->next = cpu->current_process->next;
-        process->previous = cpu->current_process;
-        cpu->current_process->next = process;
+        stack_top = (unsigned char *)paging_map(&process->paging_context, SCHEDULER_STACK_SIZE, PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_USER);
+        if (stack_top)
+        {
+            stack_top += SCHEDULER_STACK_SIZE;
+            // The stack is only mapped in the page table of the process, so its last page is written using its physical address
+            stack = (unsigned long *)((unsigned char *)paging_get_physical_address(&process->paging_context, stack_top - 4096ul) + 4096ul);
+        }
     }
     else
     {
-        // This is the first process on this CPU
-        process->next = process;
-        process->previous = process;
-        cpu->current_process = process;
+        stack_top = memory_physical_allocate_consecutive(SCHEDULER_KERNEL_STACK_PAGES);
+        if (stack_top)
+        {
+            stack_top += SCHEDULER_KERNEL_STACK_PAGES * 4096ul;
+            stack = (unsigned long *)stack_top;
+        }
+    }
+    if (!stack_top)
+    {
+        memory_physical_free(thread->fpu_state);
+        memory_physical_free(thread);
+        return 0;
     }
 
-    asm volatile("sti");
+    // Prepare the stack like the thread was switched out by scheduler_switch: zero callee-saved registers (rbx, rbp, r12 ... r15) and scheduler_start as return address.
+    // Above that is a zero return address for scheduler_start, so the stack is aligned like scheduler_start was called
+    *--stack = 0;
+    *--stack = (unsigned long)scheduler_start;
+    for (int i = 0; i < 6; i++)
+        *--stack = 0;
+    thread->saved_stack_pointer = stack_top - 8 * sizeof(unsigned long);
+    thread->entrypoint = entrypoint;
+    thread->process = process;
+    thread->last_run = 0;
+    thread->last_migration = 0;
+    thread->policy = SCHEDULER_POLICY_FAIR;
+    thread->state = SCHEDULER_THREAD_RUNNABLE;
+    thread->cpu = 0;
+    thread->affinity = process ? process->affinity : CPU_MASK_ALL;
+    thread->sleep_timer.function = scheduler_sleep_expired;
+    thread->sleep_timer.data = thread;
+    scheduler_fair_set_nice(thread, 0);
+
+    // Insert new thread into the list of all threads
+    unsigned long rflags = cpu_disable_interrupts();
+    lock_acquire(&all_processes_lock);
+    thread->id = current_thread_id++;
+    thread->all_next = all_threads;
+    all_threads = thread;
+    if (process)
+        process->thread_count++;
+    lock_release(&all_processes_lock);
+    cpu_restore_interrupts(rflags);
+
+    return thread;
+}
+
+// Returns the cpu in affinity that runs the least threads, preferring cpus on idle cores (see scheduler_less_loaded), or 0 if affinity contains no started cpu.
+// Isolated cpus are only used when affinity contains no other cpu. The current cpu is busy running the caller, so on a tie another cpu is chosen
+static struct cpu *scheduler_least_busy_cpu(unsigned long affinity)
+{
+    unsigned long allowed = affinity & ~isolated_cpus;
+    if (!allowed)
+        allowed = affinity;
+
+    struct cpu *current_cpu = cpu_get_current();
+    struct cpu *cpu = 0;
+    unsigned int least_threads = 0;
+    if (allowed & CPU_MASK(current_cpu->id))
+    {
+        cpu = current_cpu;
+        least_threads = cpu->thread_count + 1;
+    }
+    struct cpu *other_cpu = 0;
+    while (other_cpu = cpu_iterate(other_cpu))
+    {
+        if (other_cpu != current_cpu && (allowed & CPU_MASK(other_cpu->id)) && (!cpu || scheduler_less_loaded(other_cpu, other_cpu->thread_count, cpu, least_threads)))
+        {
+            cpu = other_cpu;
+            least_threads = other_cpu->thread_count;
+        }
+    }
+    return cpu;
+}
+
+// Inserts a new fair thread into the run queue of cpu, its scheduler interrupt could be running at the same time
+static void scheduler_add_thread(struct cpu *cpu, struct scheduler_thread *thread)
+{
+    unsigned long rflags = cpu_disable_interrupts();
+    lock_acquire(&cpu->scheduler_lock);
+    thread->cpu = cpu;
+    scheduler_fair_place(&cpu->fair_queue, thread, 0);
+    scheduler_fair_enqueue(&cpu->fair_queue, thread);
+    cpu->thread_count++;
+    int stopped = cpu->timer_stopped;
+    lock_release(&cpu->scheduler_lock);
+
+    // The cpu does not get scheduler interrupts by itself when its timer is stopped
+    if (stopped)
+        idle_wake(cpu);
+    cpu_restore_interrupts(rflags);
+}
+
+void scheduler_execute(void (*entrypoint)())
+{
+    struct cpu *cpu = scheduler_least_busy_cpu(CPU_MASK_ALL);
+    struct scheduler_process *process = scheduler_create_process(cpu, CPU_MASK_ALL);
+    struct scheduler_thread *thread = process ? scheduler_create_thread(process, entrypoint) : 0;
+    if (!thread)
+    {
+        console_print("[scheduler_execute] no memory available\n");
+        return;
+    }
+
+    scheduler_add_thread(cpu, thread);
+}
+
+int scheduler_execute_on(unsigned long cpu_mask, void (*entrypoint)())
+{
+    struct cpu *cpu = scheduler_least_busy_cpu(cpu_mask);
+    if (!cpu)
+    {
+        console_print("[scheduler_execute_on] cpu_mask contains no started cpu\n");
+        return 0;
+    }
+
+    struct scheduler_process *process = scheduler_create_process(cpu, cpu_mask);
+    struct scheduler_thread *thread = process ? scheduler_create_thread(process, entrypoint) : 0;
+    if (!thread)
+    {
+        console_print("[scheduler_execute_on] no memory available\n");
+        return 0;
+    }
+
+    scheduler_add_thread(cpu, thread);
+    return 1;
+}
+
+void scheduler_set_isolated(unsigned long cpu_mask)
+{
+    isolated_cpus = cpu_mask;
+}
+
+int scheduler_execute_thread(void (*entrypoint)())
+{
+    // Disable interrupts, the current thread could be moved to another cpu between reading the cpu and its current thread
+    unsigned long rflags = cpu_disable_interrupts();
+    struct scheduler_process *process = cpu_get_current()->current_thread->process;
+    cpu_restore_interrupts(rflags);
+
+    struct cpu *cpu = scheduler_least_busy_cpu(process ? process->affinity : CPU_MASK_ALL);
+    if (!cpu)
+    {
+        console_print("[scheduler_execute_thread] the affinity of the process contains no started cpu\n");
+        return 0;
+    }
+
+    struct scheduler_thread *thread = scheduler_create_thread(process, entrypoint);
+    if (!thread)
+    {
+        console_print("[scheduler_execute_thread] no memory available\n");
+        return 0;
+    }
+
+    scheduler_add_thread(cpu, thread);
+    return 1;
+}
+
+int scheduler_execute_kernel(void (*entrypoint)())
+{
+    struct scheduler_thread *thread = scheduler_create_thread(0, entrypoint);
+    if (!thread)
+    {
+        console_print("[scheduler_execute_kernel] no memory available\n");
+        return 0;
+    }
+
+    scheduler_add_thread(scheduler_least_busy_cpu(CPU_MASK_ALL), thread);
+    return 1;
+}
+
+int scheduler_execute_deadline(void (*entrypoint)(), unsigned long runtime, unsigned long period)
+{
+    // The run queue works in time stamp counter cycles
+    runtime = time_ns_to_cycles(runtime);
+    period = time_ns_to_cycles(period);
+
+    if (runtime == 0 || runtime > period)
+    {
+        console_print("[scheduler_execute_deadline] runtime must be between 0 and period\n");
+        return 0;
+    }
+
+    // Use the cpu with the least deadline utilization, so the deadline threads are spread over the cpus. Isolated cpus are only used when every cpu is isolated
+    struct cpu *cpu = 0;
+    struct cpu *other_cpu = 0;
+    while (other_cpu = cpu_iterate(other_cpu))
+    {
+        int isolated = (isolated_cpus & CPU_MASK(other_cpu->id)) != 0;
+        int cpu_isolated = cpu && (isolated_cpus & CPU_MASK(cpu->id)) != 0;
+        if (!cpu || (isolated == cpu_isolated ? other_cpu->deadline_queue.utilization < cpu->deadline_queue.utilization : !isolated))
+            cpu = other_cpu;
+    }
+
+    unsigned long rflags = cpu_disable_interrupts();
+    lock_acquire(&cpu->scheduler_lock);
+    int admitted = scheduler_deadline_admit(&cpu->deadline_queue, runtime, period);
+    lock_release(&cpu->scheduler_lock);
+    cpu_restore_interrupts(rflags);
+    if (!admitted)
+    {
+        console_print("[scheduler_execute_deadline] not enough cpu time left to guarantee the deadline\n");
+        return 0;
+    }
+
+    // Deadline threads are never migrated
+    struct scheduler_process *process = scheduler_create_process(cpu, CPU_MASK(cpu->id));
+    struct scheduler_thread *thread = process ? scheduler_create_thread(process, entrypoint) : 0;
+    rflags = cpu_disable_interrupts();
+    lock_acquire(&cpu->scheduler_lock);
+    if (!thread)
+    {
+        // Give the reserved utilization back
+        cpu->deadline_queue.utilization -= scheduler_deadline_utilization(runtime, period);
+        lock_release(&cpu->scheduler_lock);
+        cpu_restore_interrupts(rflags);
+        console_print("[scheduler_execute_deadline] no memory available\n");
+        return 0;
+    }
+
+    thread->policy = SCHEDULER_POLICY_DEADLINE;
+    thread->cpu = cpu;
+    scheduler_deadline_start(&cpu->deadline_queue, thread, runtime, period, cpu_timestamp());
+    cpu->thread_count++;
+    lock_release(&cpu->scheduler_lock);
+
+    // Deadline threads go before the running thread, schedule right away
+    idle_wake(cpu);
+    cpu_restore_interrupts(rflags);
+    return 1;
+}
+
+void scheduler_yield()
+{
+    unsigned long rflags = cpu_disable_interrupts();
+    struct cpu *cpu = cpu_get_current();
+    lock_acquire(&cpu->scheduler_lock);
+    scheduler_schedule(cpu, 1);
+
+    // The thread may continue on another cpu
+    lock_release(&cpu_get_current()->scheduler_lock);
+    cpu_restore_interrupts(rflags);
+}
+
+void scheduler_wait_period()
+{
+    // Run the scheduler now instead of at the next event, so another thread gets the rest of the time
+    unsigned long rflags = cpu_disable_interrupts();
+    struct cpu *cpu = cpu_get_current();
+    lock_acquire(&cpu->scheduler_lock);
+    if (cpu->current_thread != cpu->idle_thread && cpu->current_thread->policy == SCHEDULER_POLICY_DEADLINE)
+        scheduler_deadline_done(&cpu->deadline_queue, cpu->current_thread);
+    scheduler_schedule(cpu, 1);
+
+    lock_release(&cpu_get_current()->scheduler_lock);
+    cpu_restore_interrupts(rflags);
+}
+
+int scheduler_sleep(unsigned long nanoseconds)
+{
+    unsigned long rflags = cpu_disable_interrupts();
+    struct cpu *cpu = cpu_get_current();
+    lock_acquire(&cpu->scheduler_lock);
+    if (!scheduler_can_block(cpu))
+    {
+        lock_release(&cpu->scheduler_lock);
+        cpu_restore_interrupts(rflags);
+        console_print("[scheduler_sleep] only fair threads can sleep\n");
+        return 0;
+    }
+
+    // Leave the run queue until the timer wakes this thread up again
+    struct scheduler_thread *thread = cpu->current_thread;
+    thread->state = SCHEDULER_THREAD_BLOCKED;
+    cpu->thread_count--;
+    thread->sleep_timer.expires = cpu_timestamp() + time_ns_to_cycles(nanoseconds);
+    scheduler_wheel_add(&cpu->wheel, &thread->sleep_timer);
+    scheduler_schedule(cpu, 1);
+
+    // The thread may continue on another cpu
+    lock_release(&cpu_get_current()->scheduler_lock);
+    cpu_restore_interrupts(rflags);
+    return 1;
+}
+
+int scheduler_wait(struct scheduler_wait_queue *queue)
+{
+    unsigned long rflags = cpu_disable_interrupts();
+    struct cpu *cpu = cpu_get_current();
+    lock_acquire(&cpu->scheduler_lock);
+    if (!scheduler_can_block(cpu))
+    {
+        lock_release(&cpu->scheduler_lock);
+        cpu_restore_interrupts(rflags);
+        console_print("[scheduler_wait] only fair threads can wait\n");
+        return 0;
+    }
+
+    // Add this thread to the queue and block it before the queue lock is released. The scheduler_lock stays held until this thread was switched out,
+    // so a thread that wakes it up right away waits until the switch is done (see scheduler_wake)
+    struct scheduler_thread *thread = cpu->current_thread;
+    lock_acquire(&queue->lock);
+    thread->wait_next = 0;
+    if (queue->last)
+        queue->last->wait_next = thread;
+    else
+        queue->first = thread;
+    queue->last = thread;
+    thread->state = SCHEDULER_THREAD_BLOCKED;
+    cpu->thread_count--;
+    lock_release(&queue->lock);
+    scheduler_schedule(cpu, 1);
+
+    // The thread may continue on another cpu
+    lock_release(&cpu_get_current()->scheduler_lock);
+    cpu_restore_interrupts(rflags);
+    return 1;
+}
+
+int scheduler_wake_one(struct scheduler_wait_queue *queue)
+{
+    unsigned long rflags = cpu_disable_interrupts();
+    lock_acquire(&queue->lock);
+    struct scheduler_thread *thread = queue->first;
+    if (thread)
+    {
+        queue->first = thread->wait_next;
+        if (!queue->first)
+            queue->last = 0;
+    }
+    lock_release(&queue->lock);
+
+    if (thread)
+        scheduler_wake(thread);
+    cpu_restore_interrupts(rflags);
+    return thread != 0;
+}
+
+unsigned long scheduler_wake_all(struct scheduler_wait_queue *queue)
+{
+    // Take the whole list at once, the threads are woken up without holding the queue lock
+    unsigned long rflags = cpu_disable_interrupts();
+    lock_acquire(&queue->lock);
+    struct scheduler_thread *thread = queue->first;
+    queue->first = 0;
+    queue->last = 0;
+    lock_release(&queue->lock);
+
+    unsigned long woken = 0;
+    while (thread)
+    {
+        // wait_next is changed when the thread waits again after it was woken up
+        struct scheduler_thread *next = thread->wait_next;
+        scheduler_wake(thread);
+        thread = next;
+        woken++;
+    }
+    cpu_restore_interrupts(rflags);
+    return woken;
+}
+
+struct scheduler_process *scheduler_process_iterate(struct scheduler_process *previous)
+{
+    if (!previous)
+    {
+        return all_processes;
+    }
+    return previous->all_next;
+}
+
+struct scheduler_thread *scheduler_thread_iterate(struct scheduler_thread *previous)
+{
+    if (!previous)
+    {
+        return all_threads;
+    }
+    return previous->all_next;
+}
+
+int scheduler_set_nice(int nice)
+{
+    if (nice < SCHEDULER_FAIR_NICE_MINIMUM || nice > SCHEDULER_FAIR_NICE_MAXIMUM)
+    {
+        console_print("[scheduler_set_nice] invalid nice value\n");
+        return 0;
+    }
+
+    // The current thread is not in the tree of its cpu, so only its weight changes. Disable interrupts so it does not get switched out meanwhile
+    unsigned long rflags = cpu_disable_interrupts();
+    struct cpu *cpu = cpu_get_current();
+    lock_acquire(&cpu->scheduler_lock);
+    if (cpu->current_thread != cpu->idle_thread && cpu->current_thread->policy == SCHEDULER_POLICY_FAIR)
+        scheduler_fair_set_nice(cpu->current_thread, nice);
+    lock_release(&cpu->scheduler_lock);
+    cpu_restore_interrupts(rflags);
+    return 1;
+}
+
+void scheduler_debug()
+{
+    struct cpu *cpu = 0;
+    while (cpu = cpu_iterate(cpu))
+    {
+        console_print("[scheduler] cpu ");
+        console_print_u64(cpu->id, 10);
+        console_print(": ");
+        console_print_u64(cpu->thread_count, 10);
+        console_print(" threads, ");
+        console_print_u64(cpu->steals, 10);
+        console_print(" steals, ");
+        console_print_u64(cpu->migrations, 10);
+        console_print(" migrations, ");
+        console_print_u64(cpu->switches, 10);
+        console_print(" context switches of ");
+        console_print_u64(cpu->switches ? cpu->switch_cycles / cpu->switches : 0, 10);
+        console_print(" cycles (");
+        console_print_u64(cpu->switches ? time_cycles_to_ns(cpu->switch_cycles / cpu->switches) : 0, 10);
+        console_print(" ns) on average, ");
+        console_print_u64(cpu->address_space_switches, 10);
+        console_print(isolated_cpus & CPU_MASK(cpu->id) ? " address space switches, isolated\n" : " address space switches\n");
+    }
+
+    struct scheduler_thread *thread = 0;
+    while (thread = scheduler_thread_iterate(thread))
+    {
+        if (thread->policy != SCHEDULER_POLICY_DEADLINE)
+            continue;
+
+        console_print("[scheduler] deadline thread #");
+        console_print_u64(thread->id, 10);
+        console_print(": ");
+        console_print_u64(thread->deadline.jobs, 10);
+        console_print(" jobs, ");
+        console_print_u64(thread->deadline.misses, 10);
+        console_print(" deadline misses\n");
+    }
+
+    idle_debug();
 }
\ No newline at end of file
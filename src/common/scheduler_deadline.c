@@ -0,0 +1,142 @@
+#include "kokos/scheduler_deadline.h"
+#include "kokos/scheduler.h"
+
+unsigned long scheduler_deadline_utilization(unsigned long runtime, unsigned long period)
+{
+    return runtime * SCHEDULER_DEADLINE_UNIT / period;
+}
+
+int scheduler_deadline_admit(struct scheduler_deadline_queue *queue, unsigned long runtime, unsigned long period)
+{
+    unsigned long utilization = scheduler_deadline_utilization(runtime, period);
+    if (queue->utilization + utilization > SCHEDULER_DEADLINE_MAX_UTILIZATION)
+        return 0;
+
+    queue->utilization += utilization;
+    return 1;
+}
+
+// Inserts thread into the ready list, sorted by absolute deadline
+static void scheduler_deadline_insert_ready(struct scheduler_deadline_queue *queue, struct scheduler_thread *thread)
+{
+    struct scheduler_thread **link = &queue->ready;
+    while (*link && (*link)->deadline.absolute_deadline <= thread->deadline.absolute_deadline)
+        link = &(*link)->deadline.next;
+
+    thread->deadline.next = *link;
+    *link = thread;
+}
+
+// Removes thread from the list that starts at *link
+static void scheduler_deadline_remove(struct scheduler_thread **link, struct scheduler_thread *thread)
+{
+    while (*link && *link != thread)
+        link = &(*link)->deadline.next;
+
+    if (*link)
+        *link = thread->deadline.next;
+}
+
+// Starts the job of the period that ends at absolute_deadline
+static void scheduler_deadline_start_job(struct scheduler_deadline_queue *queue, struct scheduler_thread *thread, unsigned long absolute_deadline)
+{
+    thread->deadline.absolute_deadline = absolute_deadline;
+    thread->deadline.remaining = thread->deadline.runtime;
+    thread->deadline.state = SCHEDULER_DEADLINE_STATE_READY;
+    thread->deadline.jobs++;
+    scheduler_deadline_insert_ready(queue, thread);
+}
+
+void scheduler_deadline_start(struct scheduler_deadline_queue *queue, struct scheduler_thread *thread, unsigned long runtime, unsigned long period, unsigned long now)
+{
+    thread->deadline.runtime = runtime;
+    thread->deadline.period = period;
+    thread->deadline.exec_start = now;
+    thread->deadline.jobs = 0;
+    thread->deadline.misses = 0;
+    scheduler_deadline_start_job(queue, thread, now + period);
+}
+
+void scheduler_deadline_update(struct scheduler_deadline_queue *queue, struct scheduler_thread *current, unsigned long now)
+{
+    if (!current || current->deadline.state != SCHEDULER_DEADLINE_STATE_READY)
+        return;
+
+    unsigned long ran = now - current->deadline.exec_start;
+    current->deadline.exec_start = now;
+    if (ran < current->deadline.remaining)
+    {
+        current->deadline.remaining -= ran;
+        return;
+    }
+
+    // Used up its budget, it cannot run again before its next period
+    current->deadline.remaining = 0;
+    current->deadline.state = SCHEDULER_DEADLINE_STATE_THROTTLED;
+    scheduler_deadline_remove(&queue->ready, current);
+    current->deadline.next = queue->waiting;
+    queue->waiting = current;
+}
+
+void scheduler_deadline_release(struct scheduler_deadline_queue *queue, unsigned long now)
+{
+    // Ready jobs whose deadline passed did not get enough cpu time, this happens when interrupts were disabled for a long time
+    while (queue->ready && queue->ready->deadline.absolute_deadline <= now)
+    {
+        struct scheduler_thread *thread = queue->ready;
+        queue->ready = thread->deadline.next;
+        thread->deadline.misses++;
+
+        unsigned long absolute_deadline = thread->deadline.absolute_deadline;
+        while (absolute_deadline <= now)
+            absolute_deadline += thread->deadline.period;
+        scheduler_deadline_start_job(queue, thread, absolute_deadline);
+    }
+
+    struct scheduler_thread **link = &queue->waiting;
+    while (*link)
+    {
+        struct scheduler_thread *thread = *link;
+        if (thread->deadline.absolute_deadline > now)
+        {
+            link = &thread->deadline.next;
+            continue;
+        }
+
+        // A throttled job used up its runtime before it was done
+        if (thread->deadline.state == SCHEDULER_DEADLINE_STATE_THROTTLED)
+            thread->deadline.misses++;
+
+        *link = thread->deadline.next;
+        scheduler_deadline_start_job(queue, thread, thread->deadline.absolute_deadline + thread->deadline.period);
+    }
+}
+
+void scheduler_deadline_done(struct scheduler_deadline_queue *queue, struct scheduler_thread *thread)
+{
+    if (thread->deadline.state != SCHEDULER_DEADLINE_STATE_READY)
+        return;
+
+    thread->deadline.state = SCHEDULER_DEADLINE_STATE_DONE;
+    scheduler_deadline_remove(&queue->ready, thread);
+    thread->deadline.next = queue->waiting;
+    queue->waiting = thread;
+}
+
+struct scheduler_thread *scheduler_deadline_first(struct scheduler_deadline_queue *queue)
+{
+    return queue->ready;
+}
+
+unsigned long scheduler_deadline_next_release(struct scheduler_deadline_queue *queue)
+{
+    unsigned long release = 0;
+    struct scheduler_thread *thread = queue->waiting;
+    while (thread)
+    {
+        if (!release || thread->deadline.absolute_deadline < release)
+            release = thread->deadline.absolute_deadline;
+        thread = thread->deadline.next;
+    }
+    return release;
+}
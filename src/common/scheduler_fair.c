@@ -0,0 +1,244 @@
+#include "kokos/scheduler_fair.h"
+#include "kokos/scheduler.h"
+#include "kokos/time.h"
+
+// The weight of each nice value, starting at SCHEDULER_FAIR_NICE_MINIMUM. Each nice level is about 10% cpu time, so the weights differ by a factor 1.25 (the same table as Linux)
+static const unsigned long nice_weights[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15};
+
+void scheduler_fair_set_nice(struct scheduler_thread *thread, int nice)
+{
+    thread->fair.nice = nice;
+    thread->fair.weight = nice_weights[nice - SCHEDULER_FAIR_NICE_MINIMUM];
+}
+
+// Returns 1 if a is sorted before b, threads with the same virtual runtime are sorted by id so every key is unique
+static inline int scheduler_fair_before(struct scheduler_thread *a, struct scheduler_thread *b)
+{
+    return a->fair.vruntime < b->fair.vruntime || (a->fair.vruntime == b->fair.vruntime && a->id < b->id);
+}
+
+static inline int scheduler_fair_height(struct scheduler_thread *node)
+{
+    return node ? node->fair.height : 0;
+}
+
+static void scheduler_fair_update_height(struct scheduler_thread *node)
+{
+    int left_height = scheduler_fair_height(node->fair.left);
+    int right_height = scheduler_fair_height(node->fair.right);
+    node->fair.height = (left_height > right_height ? left_height : right_height) + 1;
+}
+
+static struct scheduler_thread *scheduler_fair_rotate_right(struct scheduler_thread *node)
+{
+    struct scheduler_thread *left = node->fair.left;
+    node->fair.left = left->fair.right;
+    left->fair.right = node;
+    scheduler_fair_update_height(node);
+    scheduler_fair_update_height(left);
+    return left;
+}
+
+static struct scheduler_thread *scheduler_fair_rotate_left(struct scheduler_thread *node)
+{
+    struct scheduler_thread *right = node->fair.right;
+    node->fair.right = right->fair.left;
+    right->fair.left = node;
+    scheduler_fair_update_height(node);
+    scheduler_fair_update_height(right);
+    return right;
+}
+
+// Restores the AVL property of node (the heights of both subtrees may only differ by one) and returns the new subtree root
+static struct scheduler_thread *scheduler_fair_balance(struct scheduler_thread *node)
+{
+    scheduler_fair_update_height(node);
+
+    int balance = scheduler_fair_height(node->fair.left) - scheduler_fair_height(node->fair.right);
+    if (balance > 1)
+    {
+        if (scheduler_fair_height(node->fair.left->fair.left) < scheduler_fair_height(node->fair.left->fair.right))
+            node->fair.left = scheduler_fair_rotate_left(node->fair.left);
+        return scheduler_fair_rotate_right(node);
+    }
+    if (balance < -1)
+    {
+        if (scheduler_fair_height(node->fair.right->fair.right) < scheduler_fair_height(node->fair.right->fair.left))
+            node->fair.right = scheduler_fair_rotate_right(node->fair.right);
+        return scheduler_fair_rotate_left(node);
+    }
+    return node;
+}
+
+static struct scheduler_thread *scheduler_fair_insert(struct scheduler_thread *node, struct scheduler_thread *thread)
+{
+    if (!node)
+        return thread;
+
+    if (scheduler_fair_before(thread, node))
+        node->fair.left = scheduler_fair_insert(node->fair.left, thread);
+    else
+        node->fair.right = scheduler_fair_insert(node->fair.right, thread);
+    return scheduler_fair_balance(node);
+}
+
+// Unlinks the leftmost node of the subtree and stores it in minimum
+static struct scheduler_thread *scheduler_fair_remove_minimum(struct scheduler_thread *node, struct scheduler_thread **minimum)
+{
+    if (!node->fair.left)
+    {
+        *minimum = node;
+        return node->fair.right;
+    }
+
+    node->fair.left = scheduler_fair_remove_minimum(node->fair.left, minimum);
+    return scheduler_fair_balance(node);
+}
+
+static struct scheduler_thread *scheduler_fair_remove(struct scheduler_thread *node, struct scheduler_thread *thread)
+{
+    if (!node)
+        return 0;
+
+    if (node == thread)
+    {
+        // Replace the node with the leftmost node of its right subtree
+        struct scheduler_thread *left = node->fair.left;
+        struct scheduler_thread *right = node->fair.right;
+        if (!right)
+            return left;
+
+        struct scheduler_thread *minimum;
+        right = scheduler_fair_remove_minimum(right, &minimum);
+        minimum->fair.left = left;
+        minimum->fair.right = right;
+        return scheduler_fair_balance(minimum);
+    }
+
+    if (scheduler_fair_before(thread, node))
+        node->fair.left = scheduler_fair_remove(node->fair.left, thread);
+    else
+        node->fair.right = scheduler_fair_remove(node->fair.right, thread);
+    return scheduler_fair_balance(node);
+}
+
+void scheduler_fair_place(struct scheduler_fair_queue *queue, struct scheduler_thread *thread, int sleeper)
+{
+    if (!sleeper)
+    {
+        thread->fair.vruntime = queue->min_vruntime;
+        return;
+    }
+
+    // Do not give more credit than SCHEDULER_FAIR_SLEEPER_CREDIT, but do not take away credit it still has either
+    unsigned long credit = time_ns_to_cycles(SCHEDULER_FAIR_SLEEPER_CREDIT);
+    unsigned long vruntime = queue->min_vruntime > credit ? queue->min_vruntime - credit : 0;
+    if (thread->fair.vruntime < vruntime)
+        thread->fair.vruntime = vruntime;
+}
+
+void scheduler_fair_enqueue(struct scheduler_fair_queue *queue, struct scheduler_thread *thread)
+{
+    thread->fair.left = 0;
+    thread->fair.right = 0;
+    thread->fair.height = 1;
+    queue->root = scheduler_fair_insert(queue->root, thread);
+    queue->load += thread->fair.weight;
+}
+
+void scheduler_fair_dequeue(struct scheduler_fair_queue *queue, struct scheduler_thread *thread)
+{
+    queue->root = scheduler_fair_remove(queue->root, thread);
+    queue->load -= thread->fair.weight;
+}
+
+void scheduler_fair_migrate(struct scheduler_fair_queue *from, struct scheduler_fair_queue *to, struct scheduler_thread *thread)
+{
+    // Keep the distance to min_vruntime, the virtual runtimes of different cpus are not related. A thread can be behind min_vruntime (sleeper credit),
+    // it keeps at most SCHEDULER_FAIR_SLEEPER_CREDIT of that so the unsigned virtual runtime never goes below 0
+    long lag = (long)(thread->fair.vruntime - from->min_vruntime);
+    long credit = (long)time_ns_to_cycles(SCHEDULER_FAIR_SLEEPER_CREDIT);
+    if (lag < -credit)
+        lag = -credit;
+    if (lag < 0 && (unsigned long)-lag > to->min_vruntime)
+        thread->fair.vruntime = 0;
+    else
+        thread->fair.vruntime = to->min_vruntime + lag;
+}
+
+struct scheduler_thread *scheduler_fair_first(struct scheduler_fair_queue *queue)
+{
+    struct scheduler_thread *node = queue->root;
+    while (node && node->fair.left)
+        node = node->fair.left;
+    return node;
+}
+
+struct scheduler_thread *scheduler_fair_iterate(struct scheduler_fair_queue *queue, struct scheduler_thread *previous)
+{
+    // Find the thread that is sorted right after previous
+    struct scheduler_thread *next = 0;
+    struct scheduler_thread *node = queue->root;
+    while (node)
+    {
+        if (!previous || scheduler_fair_before(previous, node))
+        {
+            next = node;
+            node = node->fair.left;
+        }
+        else
+        {
+            node = node->fair.right;
+        }
+    }
+    return next;
+}
+
+void scheduler_fair_update(struct scheduler_fair_queue *queue, struct scheduler_thread *current, unsigned long now)
+{
+    if (current)
+    {
+        current->fair.vruntime += (now - current->fair.exec_start) * SCHEDULER_FAIR_NICE_0_WEIGHT / current->fair.weight;
+        current->fair.exec_start = now;
+    }
+
+    struct scheduler_thread *first = scheduler_fair_first(queue);
+    unsigned long vruntime;
+    if (current && first)
+        vruntime = current->fair.vruntime < first->fair.vruntime ? current->fair.vruntime : first->fair.vruntime;
+    else if (current)
+        vruntime = current->fair.vruntime;
+    else if (first)
+        vruntime = first->fair.vruntime;
+    else
+        return;
+
+    if (vruntime > queue->min_vruntime)
+        queue->min_vruntime = vruntime;
+}
+
+unsigned long scheduler_fair_slice_end(struct scheduler_fair_queue *queue, struct scheduler_thread *current)
+{
+    // The slice of current is its share of the latency period
+    unsigned long slice = SCHEDULER_FAIR_LATENCY * current->fair.weight / (queue->load + current->fair.weight);
+    if (slice < SCHEDULER_FAIR_MINIMUM_GRANULARITY)
+        slice = SCHEDULER_FAIR_MINIMUM_GRANULARITY;
+    return current->fair.slice_start + time_ns_to_cycles(slice);
+}
+
+int scheduler_fair_should_preempt(struct scheduler_fair_queue *queue, struct scheduler_thread *current, unsigned long now)
+{
+    struct scheduler_thread *first = scheduler_fair_first(queue);
+    if (!first)
+        return 0;
+
+    return now >= scheduler_fair_slice_end(queue, current) && scheduler_fair_before(first, current);
+}
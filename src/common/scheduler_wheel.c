@@ -0,0 +1,131 @@
+#include "kokos/scheduler_wheel.h"
+
+// The amount of ticks covered by one slot of level
+#define SCHEDULER_WHEEL_LEVEL_TICKS(level) (1ul << ((level) * SCHEDULER_WHEEL_SLOT_BITS))
+
+void scheduler_wheel_initialize(struct scheduler_wheel *wheel, unsigned long now)
+{
+    wheel->tick = now / SCHEDULER_WHEEL_TICK;
+    for (int level = 0; level < SCHEDULER_WHEEL_LEVELS; level++)
+    {
+        wheel->level_timers[level] = 0;
+        for (unsigned long slot = 0; slot < SCHEDULER_WHEEL_SLOTS; slot++)
+            wheel->slots[level][slot] = 0;
+    }
+}
+
+void scheduler_wheel_add(struct scheduler_wheel *wheel, struct scheduler_wheel_timer *timer)
+{
+    // Round up, so the timer never expires early
+    unsigned long tick = (timer->expires + SCHEDULER_WHEEL_TICK - 1) / SCHEDULER_WHEEL_TICK;
+    if (tick < wheel->tick)
+        tick = wheel->tick;
+
+    // Timers that are out of reach are put in the last slot that can be reached, they are added again when it is cascaded
+    unsigned long max_tick = wheel->tick + SCHEDULER_WHEEL_LEVEL_TICKS(SCHEDULER_WHEEL_LEVELS) - 1;
+    if (tick > max_tick)
+        tick = max_tick;
+
+    // The lowest level whose slots reach tick. A slot of a higher level is cascaded when the wheel reaches its first tick,
+    // so the timer is always cascaded or expired before tick passed
+    int level = 0;
+    while (tick - wheel->tick >= SCHEDULER_WHEEL_LEVEL_TICKS(level + 1))
+        level++;
+
+    unsigned long slot = (tick >> (level * SCHEDULER_WHEEL_SLOT_BITS)) & (SCHEDULER_WHEEL_SLOTS - 1);
+    timer->next = wheel->slots[level][slot];
+    wheel->slots[level][slot] = timer;
+    wheel->level_timers[level]++;
+}
+
+// Removes the timers of a slot and adds them again, they move to a lower level
+static void scheduler_wheel_cascade(struct scheduler_wheel *wheel, int level, unsigned long slot)
+{
+    struct scheduler_wheel_timer *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = 0;
+    while (timer)
+    {
+        struct scheduler_wheel_timer *next = timer->next;
+        wheel->level_timers[level]--;
+        scheduler_wheel_add(wheel, timer);
+        timer = next;
+    }
+}
+
+// Processes wheel->tick: cascades the higher level slots that start at it and expires the timers of its level 0 slot
+static void scheduler_wheel_process_tick(struct scheduler_wheel *wheel)
+{
+    for (int level = 1; level < SCHEDULER_WHEEL_LEVELS; level++)
+    {
+        if (wheel->tick & (SCHEDULER_WHEEL_LEVEL_TICKS(level) - 1))
+            break;
+        scheduler_wheel_cascade(wheel, level, (wheel->tick >> (level * SCHEDULER_WHEEL_SLOT_BITS)) & (SCHEDULER_WHEEL_SLOTS - 1));
+    }
+
+    unsigned long slot = wheel->tick & (SCHEDULER_WHEEL_SLOTS - 1);
+    struct scheduler_wheel_timer *timer = wheel->slots[0][slot];
+    wheel->slots[0][slot] = 0;
+    while (timer)
+    {
+        struct scheduler_wheel_timer *next = timer->next;
+        wheel->level_timers[0]--;
+        timer->function(timer);
+        timer = next;
+    }
+}
+
+void scheduler_wheel_run(struct scheduler_wheel *wheel, unsigned long now)
+{
+    unsigned long end = now / SCHEDULER_WHEEL_TICK + 1;
+    while (wheel->tick < end)
+    {
+        // Nothing happens before the next slot of the lowest level that has timers starts, skip the ticks in between (the cpu could have been idle for a long time)
+        int level = 0;
+        while (level < SCHEDULER_WHEEL_LEVELS && !wheel->level_timers[level])
+            level++;
+        if (level == SCHEDULER_WHEEL_LEVELS)
+        {
+            wheel->tick = end;
+            return;
+        }
+        if (level > 0)
+        {
+            unsigned long next = (wheel->tick + SCHEDULER_WHEEL_LEVEL_TICKS(level) - 1) & ~(SCHEDULER_WHEEL_LEVEL_TICKS(level) - 1);
+            if (next >= end)
+            {
+                wheel->tick = end;
+                return;
+            }
+            wheel->tick = next;
+        }
+
+        scheduler_wheel_process_tick(wheel);
+        wheel->tick++;
+    }
+}
+
+unsigned long scheduler_wheel_next_event(struct scheduler_wheel *wheel)
+{
+    unsigned long event = 0;
+    for (int level = 0; level < SCHEDULER_WHEEL_LEVELS; level++)
+    {
+        if (!wheel->level_timers[level])
+            continue;
+
+        // Level 0 slots expire at their tick, higher level slots are cascaded at their first tick. The current slot of a higher level
+        // was cascaded already (timers in it are a whole rotation away), unless the next tick is its first tick
+        unsigned long position = wheel->tick >> (level * SCHEDULER_WHEEL_SLOT_BITS);
+        unsigned long first = level == 0 || !(wheel->tick & (SCHEDULER_WHEEL_LEVEL_TICKS(level) - 1)) ? 0 : 1;
+        for (unsigned long i = first; i < first + SCHEDULER_WHEEL_SLOTS; i++)
+        {
+            if (wheel->slots[level][(position + i) & (SCHEDULER_WHEEL_SLOTS - 1)])
+            {
+                unsigned long time = ((position + i) << (level * SCHEDULER_WHEEL_SLOT_BITS)) * SCHEDULER_WHEEL_TICK;
+                if (!event || time < event)
+                    event = time;
+                break;
+            }
+        }
+    }
+    return event;
+}
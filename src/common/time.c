@@ -0,0 +1,290 @@
+#include "kokos/time.h"
+#include "kokos/cpu.h"
+#include "kokos/port.h"
+#include "kokos/paging.h"
+#include "kokos/console.h"
+
+// The conversion values, only written by time_publish. See the note on time keeping
+struct time_clock
+{
+    // Odd while the values below are being changed
+    volatile unsigned int sequence;
+    // time_now_ns returns base_ns at time stamp counter base_cycles
+    unsigned long base_cycles;
+    unsigned long base_ns;
+    // Nanoseconds per cycle and cycles per nanosecond, multiplied by 2^TIME_SHIFT
+    unsigned long ns_mult;
+    unsigned long cycles_mult;
+    // Cycles per second
+    unsigned long frequency;
+};
+
+static struct time_clock time_clock = {
+    .sequence = 0,
+    .base_cycles = 0,
+    .base_ns = 0,
+    .ns_mult = (1000000000ul << TIME_SHIFT) / TIME_DEFAULT_FREQUENCY,
+    .cycles_mult = ((TIME_DEFAULT_FREQUENCY / 1000ul) << TIME_SHIFT) / 1000000ul,
+    .frequency = TIME_DEFAULT_FREQUENCY,
+};
+
+// One of TIME_SOURCE_*
+static int time_source = TIME_SOURCE_NONE;
+static int time_invariant = 0;
+
+// The HPET registers, only used during calibration
+static volatile unsigned char *time_hpet;
+
+// Returns the sequence number to pass to time_read_retry, waits while the values are being changed
+static inline unsigned int time_read_begin()
+{
+    unsigned int sequence;
+    while ((sequence = time_clock.sequence) & 1)
+        asm volatile("pause");
+    // Do not let the compiler read the values before the sequence number, x86 does not reorder reads with other reads
+    asm volatile("" ::: "memory");
+    return sequence;
+}
+
+// Returns 1 if the values changed since time_read_begin, then they must be read again
+static inline int time_read_retry(unsigned int sequence)
+{
+    asm volatile("" ::: "memory");
+    return time_clock.sequence != sequence;
+}
+
+static inline unsigned long time_multiply(unsigned long value, unsigned long mult)
+{
+    // The product does not fit in 64 bits for large values, mul gives the whole 128 bit product
+    return (unsigned long)(((unsigned __int128)value * mult) >> TIME_SHIFT);
+}
+
+unsigned long time_now_ns()
+{
+    unsigned int sequence;
+    unsigned long ns;
+    do
+    {
+        sequence = time_read_begin();
+        ns = time_clock.base_ns + time_multiply(cpu_timestamp() - time_clock.base_cycles, time_clock.ns_mult);
+    } while (time_read_retry(sequence));
+    return ns;
+}
+
+unsigned long time_ns_to_cycles(unsigned long nanoseconds)
+{
+    unsigned int sequence;
+    unsigned long cycles;
+    do
+    {
+        sequence = time_read_begin();
+        cycles = time_multiply(nanoseconds, time_clock.cycles_mult);
+    } while (time_read_retry(sequence));
+    return cycles;
+}
+
+unsigned long time_cycles_to_ns(unsigned long cycles)
+{
+    unsigned int sequence;
+    unsigned long ns;
+    do
+    {
+        sequence = time_read_begin();
+        ns = time_multiply(cycles, time_clock.ns_mult);
+    } while (time_read_retry(sequence));
+    return ns;
+}
+
+unsigned long time_frequency()
+{
+    return time_clock.frequency;
+}
+
+// Switches to a new frequency, time_now_ns continues from the time it returned using the previous frequency so it never jumps back
+static void time_publish(unsigned long frequency)
+{
+    unsigned long now_ns = time_now_ns();
+    unsigned long now = cpu_timestamp();
+
+    time_clock.sequence++;
+    asm volatile("" ::: "memory");
+    time_clock.base_cycles = now;
+    time_clock.base_ns = now_ns;
+    time_clock.ns_mult = (1000000000ul << TIME_SHIFT) / frequency;
+    // frequency << TIME_SHIFT does not fit in 64 bits, kilohertz precision is enough
+    time_clock.cycles_mult = ((frequency / 1000ul) << TIME_SHIFT) / 1000000ul;
+    time_clock.frequency = frequency;
+    asm volatile("" ::: "memory");
+    time_clock.sequence++;
+}
+
+static unsigned long time_read_hpet()
+{
+    return *(volatile unsigned long *)(time_hpet + TIME_HPET_COUNTER);
+}
+
+static unsigned short time_pm_timer_port;
+
+static unsigned long time_read_pm_timer()
+{
+    return port_in32(time_pm_timer_port);
+}
+
+// Counts the time stamp counter cycles during TIME_CALIBRATION_MILLISECONDS of a counter that runs at frequency and wraps at mask,
+// and returns the time stamp counter frequency
+static unsigned long time_calibrate_counter(unsigned long (*read)(), unsigned long frequency, unsigned long mask)
+{
+    unsigned long ticks = frequency * TIME_CALIBRATION_MILLISECONDS / 1000ul;
+
+    unsigned long start_counter = read();
+    unsigned long start = cpu_timestamp();
+    unsigned long elapsed;
+    do
+    {
+        elapsed = (read() - start_counter) & mask;
+    } while (elapsed < ticks);
+    unsigned long end = cpu_timestamp();
+
+    return (end - start) * frequency / elapsed;
+}
+
+// Counts the time stamp counter cycles until PIT channel 2 counted down from the calibration time (mode 0 sets its output when it reaches 0)
+// and returns the time stamp counter frequency
+static unsigned long time_calibrate_pit()
+{
+    // The count register is 16 bits, so the calibration time is at most 54 ms
+    unsigned long ticks = TIME_PIT_FREQUENCY * TIME_CALIBRATION_MILLISECONDS / 1000ul;
+
+    // Enable the gate of channel 2 and disconnect the speaker
+    port_out8(TIME_PIT_CONTROL_PORT, (port_in8(TIME_PIT_CONTROL_PORT) & ~0b10) | 0b1);
+    // Channel 2, low byte then high byte, mode 0 (interrupt on terminal count), binary
+    port_out8(TIME_PIT_COMMAND_PORT, 0b10110000);
+    port_out8(TIME_PIT_CHANNEL_2_PORT, ticks & 0xFF);
+    port_out8(TIME_PIT_CHANNEL_2_PORT, (ticks >> 8) & 0xFF);
+
+    unsigned long start = cpu_timestamp();
+    while (!(port_in8(TIME_PIT_CONTROL_PORT) & 0b100000))
+        asm volatile("pause");
+    unsigned long end = cpu_timestamp();
+
+    return (end - start) * TIME_PIT_FREQUENCY / ticks;
+}
+
+// Returns the time stamp counter frequency measured against the HPET, or 0 if it is missing or unusable
+static unsigned long time_try_hpet(const struct acpi_rsdt *rsdt)
+{
+    struct time_hpet_table *table = (struct time_hpet_table *)acpi_rsdt_get_table(rsdt, TIME_HPET_SIGNATURE);
+    if (!table)
+        return 0;
+    if (acpi_validate_sdt(&table->base))
+    {
+        console_print("[time] HPET table not valid\n");
+        return 0;
+    }
+    if (table->address.address_space != 0)
+    {
+        console_print("[time] HPET registers are not memory mapped\n");
+        return 0;
+    }
+
+    time_hpet = (volatile unsigned char *)paging_map_physical(&cpu_get_current()->current_process->paging_context, (void *)table->address.address, 1024,
+                                                              PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_UNCACHED);
+    if (!time_hpet)
+    {
+        console_print("[time] could not map HPET\n");
+        return 0;
+    }
+
+    unsigned long capabilities = *(volatile unsigned long *)(time_hpet + TIME_HPET_CAPABILITIES);
+    // The upper half is the period of the counter in femtoseconds, at most 100 ns
+    unsigned long period = capabilities >> 32;
+    if (period == 0 || period > 100000000ul)
+    {
+        console_print("[time] HPET period not valid\n");
+        return 0;
+    }
+
+    // Make sure the main counter runs, firmware usually leaves it stopped
+    *(volatile unsigned long *)(time_hpet + TIME_HPET_CONFIGURATION) |= TIME_HPET_ENABLE;
+
+    unsigned long mask = capabilities & TIME_HPET_64_BIT ? 0xFFFFFFFFFFFFFFFFul : 0xFFFFFFFFul;
+    return time_calibrate_counter(&time_read_hpet, 1000000000000000ul / period, mask);
+}
+
+// Returns the time stamp counter frequency measured against the ACPI power management timer, or 0 if it is missing
+static unsigned long time_try_pm_timer(const struct acpi_rsdt *rsdt)
+{
+    struct acpi_fadt *fadt = (struct acpi_fadt *)acpi_rsdt_get_table(rsdt, ACPI_FADT_SIGNATURE);
+    if (!fadt || fadt->pm_timer_length != 4 || !fadt->pm_timer_block)
+        return 0;
+
+    time_pm_timer_port = fadt->pm_timer_block;
+    return time_calibrate_counter(&time_read_pm_timer, TIME_PM_TIMER_FREQUENCY, fadt->flags & TIME_FADT_TIMER_32_BIT ? 0xFFFFFFFFul : 0xFFFFFFul);
+}
+
+int time_initialize(const struct acpi_rsdt *rsdt)
+{
+    time_invariant = (cpu_id(0x80000000).eax >= 0x80000007) && (cpu_id(0x80000007).edx & CPU_ID_INVARIANT_TSC_EDX);
+    if (!time_invariant)
+        console_print("[time] warning: time stamp counter is not invariant, its frequency can change\n");
+
+    // Do not get interrupted while measuring
+    unsigned long rflags = cpu_disable_interrupts();
+
+    unsigned long frequency = 0;
+    if (rsdt)
+    {
+        frequency = time_try_hpet(rsdt);
+        if (frequency)
+        {
+            time_source = TIME_SOURCE_HPET;
+        }
+        else
+        {
+            frequency = time_try_pm_timer(rsdt);
+            if (frequency)
+                time_source = TIME_SOURCE_PM_TIMER;
+        }
+    }
+    if (!frequency)
+    {
+        frequency = time_calibrate_pit();
+        if (frequency)
+            time_source = TIME_SOURCE_PIT;
+    }
+
+    cpu_restore_interrupts(rflags);
+
+    if (!frequency)
+    {
+        console_print("[time] could not measure the time stamp counter frequency\n");
+        return 0;
+    }
+
+    time_publish(frequency);
+    time_debug();
+    return 1;
+}
+
+void time_debug()
+{
+    console_print("[time] time stamp counter frequency ");
+    console_print_u64(time_clock.frequency / 1000ul, 10);
+    console_print(" kHz, measured against ");
+    switch (time_source)
+    {
+    case TIME_SOURCE_HPET:
+        console_print("HPET");
+        break;
+    case TIME_SOURCE_PM_TIMER:
+        console_print("ACPI PM timer");
+        break;
+    case TIME_SOURCE_PIT:
+        console_print("PIT");
+        break;
+    default:
+        console_print("nothing (assumed)");
+        break;
+    }
+    console_print(time_invariant ? ", invariant\n" : ", not invariant\n");
+}
@@ -5,14 +5,62 @@
 #include "kokos/gdt.h"
 #include "kokos/paging.h"
 #include "kokos/scheduler.h"
+#include "kokos/idle.h"
+#include "kokos/cpu_topology.h"
 
 #define CPU_ID_FUNCTION_0 0
 #define CPU_ID_1GB_PAGES_EDX 1 << 26
 #define CPU_ID_LONG_MODE_EDX 1 << 29
+#define CPU_ID_NO_EXECUTE_EDX 1 << 20
+#define CPU_ID_GLOBAL_PAGES_EDX 1 << 13
+#define CPU_ID_PAT_EDX 1 << 16
+#define CPU_ID_TSC_DEADLINE_ECX 1 << 24
+#define CPU_ID_MONITOR_ECX 1 << 3
+// Function 0x5, EDX enumerates the MWAIT C-states
+#define CPU_ID_MWAIT_EXTENSIONS_ECX 1 << 0
+#define CPU_ID_XSAVE_ECX 1 << 26
+// Function 0x80000007, the time stamp counter runs at a constant rate in every power state
+#define CPU_ID_INVARIANT_TSC_EDX 1 << 8
+// CPUID leaf 0xD sub-leaf 1
+#define CPU_ID_XSAVEOPT_EAX 1 << 0
+#define CPU_ID_XSAVES_EAX 1 << 3
 
 #define CPU_MSR_LOCAL_APIC 0x0000001B
 #define CPU_MSR_FS_BASE 0xC0000100
 #define CPU_MSR_GS_BASE 0xC0000101
+#define CPU_MSR_EFER 0xC0000080
+#define CPU_MSR_PAT 0x00000277
+#define CPU_MSR_TSC_DEADLINE 0x000006E0
+#define CPU_MSR_XSS 0x00000DA0
+
+// Bit in the EFER register that enables the no-execute bit in page entries
+#define CPU_EFER_NO_EXECUTE_ENABLE (1ul << 11)
+// Bits in the CR0 register that make FPU instructions raise #NM when CPU_CR0_TASK_SWITCHED is set, and that disable FPU emulation
+#define CPU_CR0_MONITOR_COPROCESSOR (1ul << 1)
+#define CPU_CR0_EMULATION (1ul << 2)
+// Bit in the CR0 register that makes the next FPU instruction raise #NM (device not available), see fpu.h
+#define CPU_CR0_TASK_SWITCHED (1ul << 3)
+// Bit in the CR0 register that makes read-only pages read-only in privilege level 0 too
+#define CPU_CR0_WRITE_PROTECT (1ul << 16)
+// Bit in the rflags register that enables hardware interrupts
+#define CPU_RFLAGS_INTERRUPT (1ul << 9)
+// Bit in the CR4 register that enables global pages
+#define CPU_CR4_GLOBAL_PAGES (1ul << 7)
+// Bits in the CR4 register that enable SSE instructions (and FXSAVE), SIMD floating point exceptions and XSAVE
+#define CPU_CR4_OSFXSR (1ul << 9)
+#define CPU_CR4_OSXMMEXCPT (1ul << 10)
+#define CPU_CR4_OSXSAVE (1ul << 18)
+// Bit in the interrupt command register of the local APIC that is set while an interrupt is being sent
+#define CPU_APIC_DELIVERY_PENDING (1u << 12)
+// Bit in the timer vector register of the local APIC that masks the timer interrupt
+#define CPU_APIC_TIMER_MASKED (1u << 16)
+// Timer mode in the timer vector register of the local APIC that interrupts when the time stamp counter reaches CPU_MSR_TSC_DEADLINE
+#define CPU_APIC_TIMER_TSC_DEADLINE (0b10u << 17)
+
+// The bit of a cpu in a cpu mask (like the affinity of a process), masks are unsigned longs so they cover the cpus with id 0 ... 63
+#define CPU_MASK(id) ((id) < 64 ? 1ul << (id) : 0ul)
+// A cpu mask that contains every cpu
+#define CPU_MASK_ALL 0xFFFFFFFFFFFFFFFFul
 
 // The following statements define fixed virtual address structures/devices
 // Fixed virtual location of the apic
@@ -35,20 +83,74 @@ struct cpu
     // Pointer to its interrupt descriptor table
     struct idt_entry *interrupt_descriptor_table;
     struct gdt_entry *global_descriptor_table;
-    // Pointer to currently running process
+    // Pointer to the process whose address space is loaded. A kernel thread has no address space, it keeps using the one that was loaded before it
     struct scheduler_process *current_process;
+    // Pointer to the currently running thread
+    struct scheduler_thread *current_thread;
+    // The id of this cpu's local APIC, used to send interrupts to this cpu
+    unsigned int apic_id;
+    // The core, last level cache and package of this cpu, see cpu_topology.h
+    struct cpu_topology topology;
+    // Pointer to the next cpu, see cpu_iterate
+    struct cpu *next;
+    // Held while the run queue (the list of threads) of this cpu is changed
+    int scheduler_lock;
+    // The amount of threads on this cpu (the running thread and the waiting threads), not counting idle_thread
+    unsigned int thread_count;
+    // The waiting fair threads of this cpu
+    struct scheduler_fair_queue fair_queue;
+    // The deadline threads of this cpu, they go before the fair threads
+    struct scheduler_deadline_queue deadline_queue;
+    // The thread of the dummy process of this cpu, it runs when there is nothing else to do and it is never migrated to another cpu
+    struct scheduler_thread *idle_thread;
+    // The timers of this cpu, like the timers of its sleeping threads
+    struct scheduler_wheel wheel;
+    // The amount of scheduler interrupts handled by this cpu, used to balance the load every SCHEDULER_BALANCE_INTERVAL ticks
+    unsigned long scheduler_ticks;
+    // Set if the local APIC timer is used in TSC-deadline mode, see scheduler_initialize
+    int timer_tsc_deadline;
+    // The speed of the local APIC timer when it is not in TSC-deadline mode: the amount of timer ticks per million time stamp counter cycles
+    unsigned long timer_ticks_per_megacycle;
+    // Set when the scheduler timer of this cpu is stopped because it has nothing to preempt, other cpus must send it SCHEDULER_VECTOR to make it schedule
+    volatile unsigned char timer_stopped;
+    // The time stamp counter the scheduler timer is programmed to, 0 when it is stopped. Used to predict how long the cpu stays idle, see idle.h
+    unsigned long timer_event;
+    // Set by other cpus that want this cpu to balance at its next scheduler interrupt, see scheduler_kick_balancer
+    volatile unsigned char balance_request;
+    // The amount of threads this cpu took from other cpus while it was idle
+    unsigned long steals;
+    // The amount of threads this cpu took from busier cpus while balancing
+    unsigned long migrations;
+    // The time stamp counter when the current context switch started, see scheduler_switch_done
+    unsigned long switch_start;
+    // The amount of context switches of this cpu and the sum of their time stamp counter cycles, from the start of scheduling until the next thread runs
+    unsigned long switches;
+    unsigned long switch_cycles;
+    // The amount of context switches that loaded another address space (wrote cr3), switches between threads of the same process and to kernel threads do not
+    unsigned long address_space_switches;
+    // The thread whose FPU state is in the FPU registers of this cpu, see fpu.h
+    struct scheduler_thread *fpu_owner;
+    // The amount of times the FPU state of a thread was loaded on this cpu
+    unsigned long fpu_loads;
+    // Set by other cpus when this cpu must flush its TLB, see PAGING_SHOOTDOWN_LOCAL and paging_handle_shootdown
+    volatile unsigned char flush_request;
+    // The state of the idle loop of this cpu, see idle.h
+    struct idle_cpu idle;
 };
 
 // Performs an cpuid instruction and returns the result
 struct cpu_id_result cpu_id(unsigned int function);
 
+// Performs an cpuid instruction with a sub-leaf (in ecx) and returns the result
+struct cpu_id_result cpu_id_subleaf(unsigned int function, unsigned int subleaf);
+
 // Returns the cpu's time stamp counter
 unsigned long cpu_timestamp();
 
-// Waits for a minimum amount of 1 microseconds
+// Waits for a minimum amount of 1 microseconds, measured using the time stamp counter frequency of time.h
 unsigned long cpu_wait_microsecond();
 
-// Waits for a minimum amount of 1 milliseconds
+// Waits for a minimum amount of 1 milliseconds, measured using the time stamp counter frequency of time.h
 unsigned long cpu_wait_millisecond();
 
 // Reads from a model specific register
@@ -57,12 +159,25 @@ unsigned long cpu_read_msr(unsigned int register_index);
 // Writes to a model specific register
 unsigned long cpu_write_msr(unsigned int register_index, unsigned long value);
 
+// Disables hardware interrupts and returns the previous rflags, pass it to cpu_restore_interrupts to enable them again if they were enabled
+unsigned long cpu_disable_interrupts();
+
+// Enables hardware interrupts again if they were enabled in rflags, see cpu_disable_interrupts
+void cpu_restore_interrupts(unsigned long rflags);
+
 // Returns os-relevant information about the current cpu.
 // cpu_initialize must be called first!
 struct cpu *cpu_get_current();
 
+// Iterates every cpu that was initialized using cpu_initialize, starting with the boot processor. Pass 0 to get the first cpu
+struct cpu *cpu_iterate(struct cpu *previous);
+
+// Sends interrupt vector to another cpu using the local APIC
+void cpu_send_interrupt(struct cpu *cpu, unsigned char vector);
+
 // Initializes the current cpu info.
 // memory_physical_initialize and paging_initialize must be called first!
+// Switches to a new stack and calls entrypoint with interrupts enabled, this function does not return
 struct cpu *cpu_initialize(void (*entrypoint)());
 
 void cpu_panic(const char *message);
\ No newline at end of file
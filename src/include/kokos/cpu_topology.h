@@ -0,0 +1,57 @@
+#pragma once
+
+struct cpu;
+
+// Note on cpu topology:
+// Logical cpus are not independent: SMT siblings (hyper-threads) share the execution units and caches of one core, the cores of a package (socket)
+// share its memory bandwidth and usually a last level cache (LLC). Every level of the topology is a range of bits in the x2APIC id of a cpu:
+// the lowest smt_shift bits select the thread in its core, the bits below core_shift select the core in its package and the bits above select the package.
+// The shifts are read from CPUID leaf 0x1F or 0xB (extended topology), from leaf 0x8000001E on AMD cpus without those, or derived from leaf 0x1 and 0x4 on old cpus.
+// The amount of cpus sharing the last level cache is read from the deterministic cache parameters (leaf 0x4, or 0x8000001D on AMD).
+// The ids below are the x2APIC id shifted right by the shift of their level, so they are unique in the whole system and two cpus are in the same
+// core, LLC or package when their ids of that level are equal. The scheduler uses this to spread threads over cores before it puts them on SMT siblings.
+
+// The distance between two cpus, see cpu_topology_distance
+#define CPU_TOPOLOGY_SAME_CPU 0
+#define CPU_TOPOLOGY_SAME_CORE 1
+#define CPU_TOPOLOGY_SAME_LLC 2
+#define CPU_TOPOLOGY_SAME_PACKAGE 3
+#define CPU_TOPOLOGY_OTHER_PACKAGE 4
+
+// CPUID function 0x80000001, leaves 0x8000001D and 0x8000001E are supported
+#define CPU_ID_TOPOLOGY_EXTENSIONS_ECX 1 << 22
+// CPUID function 0x1, EBX[23:16] contains the amount of logical cpus per package
+#define CPU_ID_HYPER_THREADING_EDX 1 << 28
+
+// The level types in ECX[15:8] of CPUID leaf 0xB and 0x1F
+#define CPU_TOPOLOGY_LEVEL_INVALID 0
+#define CPU_TOPOLOGY_LEVEL_SMT 1
+#define CPU_TOPOLOGY_LEVEL_CORE 2
+
+// The place of a cpu in the topology of the system
+struct cpu_topology
+{
+    // The x2APIC id, this is the same as the local APIC id when it fits in 8 bits
+    unsigned int x2apic_id;
+    // The amount of low x2APIC id bits that select the thread in a core, the core in a package and the cpus sharing the last level cache
+    unsigned int smt_shift;
+    unsigned int core_shift;
+    unsigned int llc_shift;
+    // The index of this cpu in its core
+    unsigned int thread_id;
+    // The ids of the core, last level cache and package of this cpu, unique in the system
+    unsigned int core_id;
+    unsigned int llc_id;
+    unsigned int package_id;
+    // The CPUID leaf the topology was read from, 0x1 when it was derived from the legacy leaves
+    unsigned int leaf;
+};
+
+// Reads the topology of the current cpu into topology
+void cpu_topology_detect(struct cpu_topology *topology);
+
+// Returns the smallest level that a and b share, one of CPU_TOPOLOGY_*
+int cpu_topology_distance(struct cpu *a, struct cpu *b);
+
+// Prints the topology tree of all cpus: packages, last level caches, cores and their threads
+void cpu_topology_debug();
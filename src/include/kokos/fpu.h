@@ -0,0 +1,38 @@
+#pragma once
+#include "kokos/scheduler.h"
+
+struct cpu;
+
+// Note on FPU state:
+// Every thread has its own FPU/SSE/AVX register state, saved in a separate page (scheduler_thread.fpu_state) using the best instruction
+// the cpu supports: XSAVES (compacted, only saves the components that are in use), XSAVEOPT (skips components that were not modified since they were loaded),
+// XSAVE or FXSAVE (x87 and SSE only). The size of the state is read from CPUID leaf 0xD.
+// The state is switched lazily: the scheduler does not touch the FPU registers, it only sets CR0.TS when it switches to a thread that does not own
+// the registers of the cpu (cpu->fpu_owner). The first FPU instruction of that thread raises #NM (device not available), which saves the state
+// of the owner and loads the state of the thread. Threads that never use the FPU never cause a save or load.
+// A thread that owns the FPU registers of a cpu is not migrated, because its state is only in those registers.
+// Every kernel file that runs in interrupt handlers is compiled using -mgeneral-regs-only, so the handlers never change the FPU registers of a thread.
+
+// Bits of the XCR0 register (and of CPUID leaf 0xD) for the state components that are switched: x87, SSE, AVX and the AVX-512 components
+#define FPU_XCR0_X87 (1ul << 0)
+#define FPU_XCR0_SSE (1ul << 1)
+#define FPU_XCR0_AVX (1ul << 2)
+#define FPU_XCR0_AVX512 (0b111ul << 5)
+
+// The size of the FXSAVE area, used when XSAVE is not supported
+#define FPU_FXSAVE_SIZE 512
+// Default value of the MXCSR register, all SIMD floating point exceptions masked
+#define FPU_DEFAULT_MXCSR 0x1F80
+
+// Enables the FPU, SSE and (when supported) XSAVE and AVX on the current cpu and registers the #NM handler.
+// The first call also decides how the state is saved and creates the initial state of new threads
+void fpu_initialize_cpu();
+
+// Allocates the FPU state of a new thread, it starts with the initial state (like after FNINIT). Returns 0 if no memory is available
+void *fpu_create_state();
+
+// Called by the scheduler when next starts running on cpu, makes its first FPU instruction raise #NM when another thread owns the FPU registers
+void fpu_switch(struct cpu *cpu, struct scheduler_thread *next);
+
+// Prints the way the FPU state is saved and its size
+void fpu_debug();
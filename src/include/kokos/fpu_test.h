@@ -0,0 +1,14 @@
+#pragma once
+
+// Note on the FPU test:
+// The kernel itself is compiled using -mgeneral-regs-only, so without a workload that uses SSE the lazy FPU switching (#NM, XSAVE and XRSTOR, see fpu.h) never runs.
+// fpu_test.c is the only file compiled without -mgeneral-regs-only. Its test fills all 16 xmm registers, keeps them loaded while the thread is preempted
+// and checks them afterwards. When two threads run it on the same cpu, each one takes the FPU registers from the other, so a state that is not saved
+// or restored correctly shows up as a changed register.
+
+// The amount of xmm registers that are checked
+#define FPU_TEST_REGISTERS 16
+
+// Loads a pattern derived from seed into xmm0 ... xmm15, waits for cycles time stamp counter cycles (long enough to be preempted) and checks that
+// the registers still contain the pattern. Returns 1 if they do, 0 if any register changed
+int fpu_test_registers(unsigned long seed, unsigned long cycles);
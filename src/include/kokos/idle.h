@@ -0,0 +1,62 @@
+#pragma once
+#include "kokos/core.h"
+
+struct cpu;
+
+// Note on idling:
+// A cpu without threads runs its idle thread, which loops in idle_loop. When the cpu supports MONITOR/MWAIT, the idle loop monitors the cache line
+// of its wake flag (idle_cpu.wake) and waits using MWAIT, otherwise it waits using HLT. Both end at the next interrupt, MWAIT also ends when another cpu
+// writes to the monitored line. So a cpu that has work for an idle cpu (see idle_wake) only writes its wake flag instead of sending SCHEDULER_VECTOR,
+// the idle cpu wakes up without an interrupt and schedules. cpus that are not idle (or that wait using HLT) still get the interrupt.
+// MWAIT takes a hint that says which C-state the cpu may enter: deeper states save more power but take longer to wake up from, so they are only
+// worth it for long idle periods. The governor (idle_select) predicts the idle period as the time until the scheduler timer expires, or the average of
+// the recent idle periods when that is shorter (cpus are often woken by other cpus), and picks the deepest state whose target residency fits in it.
+// The target residencies are conservative defaults per MWAIT C-state, the exact values are only in the ACPI _CST object, which needs an AML interpreter.
+// The amount of times each state was entered, the time spent in it and the latency of remote wakeups are counted per cpu, see idle_debug.
+
+// The size of a cache line, the wake flag is alone in one so other writes to struct cpu do not end MWAIT
+#define IDLE_LINE_SIZE 64
+// The maximum amount of idle states: HLT, or MWAIT C1 ... C7
+#define IDLE_MAX_STATES 8
+// The weight of the last idle period in the average idle period is 1 / 2^IDLE_AVERAGE_SHIFT
+#define IDLE_AVERAGE_SHIFT 3
+
+// The idle state of a cpu
+struct idle_cpu
+{
+    // Written by other cpus that want this cpu to schedule, the cache line monitored using MONITOR/MWAIT
+    volatile unsigned char wake ATTRIBUTE_ALIGN(IDLE_LINE_SIZE);
+    // Set while this cpu is in idle_loop waiting for work, it is cleared by idle_exit
+    volatile unsigned char sleeping;
+    // The time stamp counter when the cpu went idle
+    unsigned long enter ATTRIBUTE_ALIGN(IDLE_LINE_SIZE);
+    // The idle state that was entered, an index in the states chosen by idle_initialize_cpu
+    int state;
+    // The average idle period in time stamp counter cycles, see IDLE_AVERAGE_SHIFT
+    unsigned long average;
+    // The time stamp counter when another cpu first asked this cpu to wake up, 0 if no cpu did since the last wake up
+    volatile unsigned long wake_request;
+    // The amount of times each state was entered and the sum of the time stamp counter cycles spent in it
+    unsigned long usage[IDLE_MAX_STATES];
+    unsigned long residency[IDLE_MAX_STATES];
+    // The amount of times another cpu woke this cpu up, how many of them only wrote the wake flag, and the sum of the time stamp counter cycles until this cpu ran again
+    unsigned long wakeups;
+    unsigned long flag_wakeups;
+    unsigned long wakeup_cycles;
+};
+
+// Initializes the idle state of the current cpu. The first call also decides whether MONITOR/MWAIT is used and which C-states are available
+void idle_initialize_cpu();
+
+// The loop of the idle thread of the current cpu, waits for work and schedules when another cpu wrote the wake flag. Interrupts must be enabled, does not return
+void idle_loop();
+
+// Makes cpu schedule: writes its wake flag when it waits using MWAIT, otherwise sends it SCHEDULER_VECTOR
+void idle_wake(struct cpu *cpu);
+
+// Counts the idle period of cpu that ended at now, called by the idle loop and by the scheduler (an interrupt can make the cpu schedule before the idle loop continues).
+// Returns 1 if the wake flag was written, then the cpu must schedule. Interrupts must be disabled
+int idle_exit(struct cpu *cpu, unsigned long now);
+
+// Prints the idle states, and the usage, residency and wake up latency of every cpu
+void idle_debug();
@@ -16,10 +16,8 @@ enum idt_stack_type
     IDT_STACK_TYPE_CURRENT = 0,
     // Interrupt stack 1 is used for double faults, to make sure that a valid stack is available when this exception occures.
     IDT_STACK_TYPE_DOUBLE_FAULT = 1,
-    // Stack 2 is used for scheduler interrupts and task switches
-    // A seperate stack is used for the scheduler interrupt because, when a process must be switched, the stack pointer could be unique to that process's virtual address space.
-    // Because the next process does not use the same virtual address space, problems would occur when switching virtual address spaces.
-    // The scheduler stack would be mapped into every process' virtual address space.
+    // Stack 2 was used for scheduler interrupts, because the stack of a process is only mapped in its own virtual address space.
+    // The scheduler interrupt now runs on the stack of the interrupted process, scheduler_switch (see schedule.asm) switches the address space and the stack together.
     IDT_STACK_TYPE_SCHEDULER = 2,
     // See gdt.c to see how these are allocated
 };
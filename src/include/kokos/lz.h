@@ -0,0 +1,23 @@
+#pragma once
+
+// Note on the compression format:
+// A fast LZ77 compressor in the style of LZ4, made for compressing single pages (see paging_swap.h).
+// The compressed data is a list of sequences, each sequence starts with a token byte, its upper 4 bits are the amount of literals
+// and its lower 4 bits are the length of the match minus LZ_MIN_MATCH. When one of them is 15, more length bytes follow (until a byte that is not 255).
+// After the token (and literal length bytes) come the literals, then a 2 byte little endian offset back into the output and then the match length bytes.
+// The last sequence only contains literals.
+
+// The minimum length of a match
+#define LZ_MIN_MATCH 4
+// The amount of bits of the hash table that is used to find matches (2048 entries of 2 bytes, it is kept on the stack)
+#define LZ_HASH_BITS 11
+// The furthest a match can be, limited by the 2 byte offset
+#define LZ_MAX_OFFSET 0xFFFF
+
+// Compresses input_size bytes from input into output, which can hold output_capacity bytes.
+// Returns the size of the compressed data, or 0 when it does not fit in output
+unsigned long lz_compress(const unsigned char *input, unsigned long input_size, unsigned char *output, unsigned long output_capacity);
+
+// Decompresses input_size bytes from input into output, which can hold output_capacity bytes.
+// Returns the size of the decompressed data, or 0 if the compressed data is invalid
+unsigned long lz_decompress(const unsigned char *input, unsigned long input_size, unsigned char *output, unsigned long output_capacity);
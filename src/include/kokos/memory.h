@@ -15,6 +15,9 @@ void memory_set(void *pointer, unsigned long size, unsigned char amount);
 // Sets a region of memory to zero
 void memory_zero(void *address, unsigned long size);
 
+// Returns 1 if the `size` bytes at `a` and `b` are equal, 0 otherwise
+int memory_compare(void *a, void *b, unsigned long size);
+
 // Copies `amount` of bytes from `from` to `to`
 void memory_copy(void *from, void *to, int amount);
 
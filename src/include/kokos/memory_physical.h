@@ -1,9 +1,32 @@
 #pragma once
 
+// The amount of pages memory_physical_allocate asks the reclaim function to free when no memory is available
+#define MEMORY_PHYSICAL_RECLAIM_PAGES 32
+
+// Information that is kept about every physical page (4096 bytes), see memory_physical_get_page
+struct memory_physical_page
+{
+    // When this page is used as a page table, the amount of non-empty entries in it
+    unsigned short table_entries;
+    // When this page is a merged page, the amount of mappings that point to it, see paging_merge.h
+    unsigned short share_count;
+    // The hash of the contents of this page when it was last scanned by paging_merge
+    unsigned int checksum;
+    // The amount of scans since this page was last accessed, used to find cold pages to swap out, see paging_swap.h
+    unsigned char age;
+};
+
+// Returns the amount of bytes that are needed to manage total_memory bytes of physical memory
+// (1 bit per page for the allocation table and a struct memory_physical_page per page)
+unsigned long memory_physical_table_size(unsigned long total_memory);
+
 // Initializes the physical memory system. The allocation_table_location should point to a reserved location
-// that can hold (total_memory / 4096 / 8) bytes
+// that can hold memory_physical_table_size(total_memory) bytes
 void memory_physical_initialize(void *allocation_table_location, unsigned long total_memory);
 
+// Returns the information about the physical page that contains physical_address, or 0 if it is not physical memory
+struct memory_physical_page *memory_physical_get_page(void *physical_address);
+
 // Reserves a physical address so it can't be allocated using memory_physical_allocate
 void memory_physical_reserve(void *physical_address, unsigned long bytes);
 
@@ -11,16 +34,26 @@ void memory_physical_reserve(void *physical_address, unsigned long bytes);
 void memory_physical_free(void *physical_address);
 
 // Allocates a single 4096 byte chunk of physical memory and returns the physical address to it
-// This chunk is always aligned to 4096 bytes
+// This chunk is always aligned to 4096 bytes. Returns 0 if no memory is available, even after calling the reclaim function
 void *memory_physical_allocate();
 
+// Sets the function that is called when no physical memory is available, it should try to free pages amount of pages and return the amount it freed
+void memory_physical_set_reclaim(unsigned long (*reclaim)(unsigned long pages));
+
+// Returns the total number of physical pages
+unsigned long memory_physical_total_pages();
+
 // Returns 1 if the passed address has been reserved or allocated
 int memory_physical_allocated(void *physical_address);
 
 // Returs the number of used physical pages
 unsigned long memory_physical_used_pages();
 
-// Allocates multiple consecutive pages (4096 bytes) of physical memory and returns the physical address to it
-// Use memory_physical_allocate_consecutive(512) to allocate a 2MB chunk
-// Use memory_physical_allocate_consecutive(512 * 512) to allocate a 1GB chunk
-void *memory_physical_allocate_consecutive(unsigned long pages);
\ No newline at end of file
+// Allocates multiple consecutive pages (4096 bytes) of physical memory and returns the physical address to it, or 0 if there is no such region
+// Pages are handed out in groups of 64, a power of two amount of groups is aligned to its own size
+// Use memory_physical_allocate_consecutive(512) to allocate a 2MB chunk (aligned to 2MB)
+// Use memory_physical_allocate_consecutive(512 * 512) to allocate a 1GB chunk (aligned to 1GB)
+void *memory_physical_allocate_consecutive(unsigned long pages);
+
+// Frees pages previously allocated using memory_physical_allocate_consecutive
+void memory_physical_free_consecutive(void *physical_address, unsigned long pages);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #pragma once
+#include "kokos/paging_region.h"
 
 // Note on virtual memory in this os:
 // The first virtual memory space is identity mapped to the physical memory using huge pages,
@@ -39,12 +40,26 @@
 #define PAGING_ENTRY_FLAG_DIRTY 0b001000000
 // This flag is only present in the level 2 and level 3 tables
 #define PAGING_ENTRY_FLAG_SIZE 0b010000000
+// This flag is only present in the lowest table (the same bit as the page size bit) and selects a page attribute table entry together with the writethrough and cache disabled bits
+#define PAGING_ENTRY_FLAG_PAT 0b010000000
+// The PAT bit of 2MiB and 1GiB page entries
+#define PAGING_ENTRY_FLAG_HUGE_PAT 0x1000
 // This flag is only present in the lowest table
 #define PAGING_ENTRY_FLAG_GLOBAL 0b100000000
 #define PAGING_ENTRY_FLAG_NO_EXECUTE 0x8000000000000000ull
 // Bits 11-9 in each page table entry are user definable (AVL bits, available for software) and can be used for anything, in this case for the following:
 // This flag indicates that the underlaying page table does not contain at least 1 empty entry
 #define PAGING_ENTRY_FLAG_FULL 0b1000000000
+// This flag indicates that the physical memory of this page was allocated by paging_map and belongs to the mapping (not set by paging_map_physical)
+#define PAGING_ENTRY_FLAG_OWNED 0b10000000000
+// This flag indicates that the physical memory of this page is shared (the zero page or a merged page, see paging_merge.h), so it is mapped read-only.
+// When the mapping is writable, the first write causes a page fault which copies the page to private memory, see paging_handle_fault
+#define PAGING_ENTRY_FLAG_COPY_ON_WRITE 0b100000000000
+
+// The flags of entries that point to a lower level table, the permissions are only restricted in the entries of the pages themselves
+#define PAGING_TABLE_ENTRY_FLAGS (PAGING_ENTRY_FLAG_PRESENT | PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_EVERYONE_ACCESS)
+// The page entry flags that are changed by paging_protect
+#define PAGING_PROTECT_ENTRY_FLAGS (PAGING_ENTRY_FLAG_WRITABLE | PAGING_ENTRY_FLAG_EVERYONE_ACCESS | PAGING_ENTRY_FLAG_NO_EXECUTE)
 
 // This flag indicates that reading is enabled is enabled for this page
 #define PAGING_FLAG_READ 0b1
@@ -60,27 +75,150 @@
 #define PAGING_FLAG_2MB 0b100000
 // This flag indicates that paging_map should forcefully replace the existing virtual mapping if there is one
 #define PAGING_FLAG_REPLACE 0b1000000
+// This flag indicates that the memory is not cached, use this for memory mapped registers of devices (like the APIC)
+#define PAGING_FLAG_UNCACHED 0b100000000
+// This flag indicates that writes are combined in a buffer before being written to memory, reads are not cached, use this for framebuffers
+#define PAGING_FLAG_WRITE_COMBINING 0b1000000000
+// This flag indicates that reads are cached but writes go to memory immediately
+#define PAGING_FLAG_WRITE_THROUGH 0b10000000000
+// This flag indicates that the mapping is the same in every address space (like the identity map), its translations are kept in the TLB when switching address spaces
+#define PAGING_FLAG_GLOBAL 0b10000000
+
+// This flag indicates that paging_map should only reserve the virtual memory, pages are created when they are accessed (4KiB pages only).
+// Reading a page that was not written yet maps a shared page filled with zeroes, only writing allocates physical memory for it
+#define PAGING_FLAG_ON_DEMAND 0b100000000000
+
+// This flag indicates that identical pages of this mapping may be merged with other mergeable pages, see paging_merge.h
+#define PAGING_FLAG_MERGEABLE 0b1000000000000
+
+// This flag indicates that cold pages of this mapping may be compressed and swapped out when physical memory runs low, see paging_swap.h
+#define PAGING_FLAG_SWAPPABLE 0b10000000000000
+
+// The PAGING_FLAG_* flags that are changed by paging_protect
+#define PAGING_PROTECT_FLAGS (PAGING_FLAG_READ | PAGING_FLAG_WRITE | PAGING_FLAG_EXECUTE | PAGING_FLAG_USER)
+
+// Bits of the error code of a page fault (AMD Volume 2 8.4.2)
+// The page was present, the fault was caused by a protection violation
+#define PAGING_FAULT_PRESENT 0b1
+// The fault was caused by a write
+#define PAGING_FAULT_WRITE 0b10
+
+// The page attribute table, the memory type of a page is selected by its PAT, cache disabled and writethrough bits (index = PAT << 2 | PCD << 1 | PWT)
+// Entry 0: write-back, 1: write-through, 2: uncached (can be overridden by MTRRs), 3: uncached, 4: write-combining, 5: write-through, 6: uncached (can be overridden by MTRRs), 7: uncached
+// This is the default table with entry 4 (write-back by default) replaced with write-combining
+#define PAGING_PAT 0x0007040100070406ul
+
+// The maximum amount of pages that are invalidated one by one (using invlpg), the whole TLB is flushed when more pages changed
+#define PAGING_FLUSH_PAGE_LIMIT 32
+
+// The amount of milliseconds paging_promote_worker waits between scans
+#define PAGING_PROMOTE_INTERVAL 1000
+
+// The amount of virtual memory one entry in a table of level level maps (4KiB for level 1, 2MiB for level 2, 1GiB for level 3, 512GiB for level 4)
+#define PAGING_LEVEL_SIZE(level) (1ul << (3 + 9 * (level)))
+
+// Return values of the paging_walker callbacks
+// Go to the next entry
+#define PAGING_WALK_CONTINUE 0
+// Walk the entries of the table the entry points to (the callback must make sure it points to a table)
+#define PAGING_WALK_DESCEND 1
+// Stop walking, paging_walk returns 0
+#define PAGING_WALK_STOP -1
+
+// The amount of entries in the translation cache of each address space, see paging_get_physical_address
+#define PAGING_TRANSLATION_CACHE_SIZE 32
+// Value of paging_translation.virtual_page for unused entries, this is not a valid page address
+#define PAGING_TRANSLATION_INVALID 0xFFFFFFFFFFFFFFFFul
+
+// A cached translation of a 4KiB virtual page to its physical address
+struct paging_translation
+{
+    unsigned long virtual_page;
+    unsigned long physical_page;
+};
+
+// A physically contiguous part of a virtual memory range, see paging_get_physical_ranges
+struct paging_physical_range
+{
+    unsigned long physical_address;
+    unsigned long bytes;
+};
+
+// Note on multiple processors:
+// The page tables of a process can be changed by other cpus than the one it runs on (for example by the paging workers), so every function
+// that changes or reads a paging_context locks it first using paging_lock. Locks are held with interrupts disabled.
+// After a page entry changed, the other cpus that currently use the address space must remove it from their TLB too. They are asked to
+// using an interrupt (PAGING_SHOOTDOWN_VECTOR) and the changing cpu waits until they did, so freed pages cannot be accessed anymore.
+// A cpu that waits for a lock keeps handling these requests, because the cpu that holds the lock could be waiting for it.
+
+// The interrupt vector that asks a cpu to flush its TLB, see paging_handle_shootdown
+#define PAGING_SHOOTDOWN_VECTOR 0x25
+// Values of cpu.flush_request: flush the translations of the current address space, or all translations including global pages
+#define PAGING_SHOOTDOWN_LOCAL 0b01
+#define PAGING_SHOOTDOWN_GLOBAL 0b10
 
-// Represents a location in the page structure
+// Represents an address space
 struct paging_context
 {
+    // Held while the page tables, regions or translations of this address space are used, see paging_lock
+    int lock;
     unsigned long *level4_table; // The uppermost level4 table
-    unsigned long *level3_table; // The current level3 table selected by level4_table[level4_index]
-    unsigned long *level2_table; // The current level2 table selected by level3_table[level3_index]
-    unsigned long *level1_table; // The current level1 table selected by level2_table[level2_index]
-    unsigned short level4_index;
-    unsigned short level3_index;
-    unsigned short level2_index;
-    unsigned short level1_index;
+    // The tree of reserved virtual memory regions in this address space, see paging_region.h
+    struct paging_region *regions;
+    // Recently looked up translations, indexed by virtual page number modulo PAGING_TRANSLATION_CACHE_SIZE, this is invalidated when the page tables change
+    struct paging_translation translations[PAGING_TRANSLATION_CACHE_SIZE];
+};
+
+// Visits the page table entries that map virtual memory in start ... end, see paging_walk.
+// Each callback receives the table, the index of the entry in it, the level of the table (4 is the uppermost) and the first virtual address the entry maps.
+struct paging_walker
+{
+    // The first virtual address to walk
+    unsigned long start;
+    // The first virtual address after the walked range
+    unsigned long end;
+    // Called for empty entries, when 0, the whole range of the entry is skipped
+    int (*absent)(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address);
+    // Called for entries that point to a lower level table, when 0, the walker always descends
+    int (*table)(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address);
+    // Called for entries that map a page (4KiB pages in level 1, 2MiB pages in level 2 and 1GiB pages in level 3)
+    int (*leaf)(struct paging_walker *walker, unsigned long *table, unsigned int index, int level, unsigned long address);
 };
 
 // Sets up paging.
 // Physical memory allocation must be initialized first!
 void paging_initialize();
 
+// Enables the paging features (no-execute pages, read-only pages for the kernel, global pages, page attribute table) on the current cpu
+// and registers the PAGING_SHOOTDOWN_VECTOR interrupt, called by cpu_initialize after idt_initialize
+void paging_initialize_cpu();
+
+// Allocates and clears a new level 4 table and an empty region tree for a new address space. Returns 0 if no memory is available
+int paging_context_initialize(struct paging_context *context);
+
+// Unmaps everything in an address space that no cpu uses, frees the physical memory owned by its mappings, its page tables and its regions
+void paging_context_destroy(struct paging_context *context);
+
+// Disables interrupts and acquires lock (the lock of a paging_context or a lock that is held while page entries are changed).
+// While waiting, TLB flush requests of other cpus are handled. Returns the rflags to pass to paging_unlock
+unsigned long paging_lock(int *lock);
+
+// Like paging_lock, but returns 0 instead of waiting when lock is taken. Otherwise returns 1 and stores the rflags to pass to paging_unlock in rflags
+int paging_try_lock(int *lock, unsigned long *rflags);
+
+// Releases lock and enables interrupts again if they were enabled before paging_lock
+void paging_unlock(int *lock, unsigned long rflags);
+
+// Flushes the TLB of the current cpu if other cpus requested it, called by the PAGING_SHOOTDOWN_VECTOR interrupt
+void paging_handle_shootdown();
+
 // Returns the physical address for virtual address and returns 0 if the virtual address is not mapped
 void *paging_get_physical_address(struct paging_context *context, void *virtual_address);
 
+// Stores the physically contiguous parts of virtual_address ... virtual_address + bytes in ranges (at most max_ranges), contiguous pages are merged into one range.
+// Returns the amount of ranges, or 0 if a part of the range is not mapped or if more than max_ranges are needed
+unsigned long paging_get_physical_ranges(struct paging_context *context, void *virtual_address, unsigned long bytes, struct paging_physical_range *ranges, unsigned long max_ranges);
+
 // Maps the specified physical memory to any available virtual memory
 void *paging_map_physical(struct paging_context *context, void *physical_address, unsigned long bytes, unsigned long flags);
 
@@ -93,9 +231,41 @@ void *paging_map(struct paging_context *context, unsigned long bytes, unsigned l
 // Tries to map certain amount of available physical memory specific virtual memory
 void *paging_map_at(struct paging_context *context, void *virtual_address, unsigned long bytes, unsigned long flags);
 
-// Unmaps memory previously mapped memory using paging_map
+// Walks the page tables of context in the range of walker, lower level tables that become empty while walking are freed.
+// The context must be locked using paging_lock.
+// Returns 1 if the whole range was walked, 0 if a callback returned PAGING_WALK_STOP
+int paging_walk(struct paging_context *context, struct paging_walker *walker);
+
+// Replaces the huge page at table[index] with a lower level table of pages that map the same memory with the same flags
+int paging_split(unsigned long *table, unsigned int index, int level);
+
+// Unmaps memory previously mapped memory using paging_map, the range must be inside a single mapping. Returns 0 if it is not
 int paging_unmap(struct paging_context *context, void *virtual_address, unsigned long bytes);
 
+// Changes the permissions of the pages in virtual_address ... virtual_address + bytes to flags (PAGING_FLAG_WRITE, PAGING_FLAG_EXECUTE and PAGING_FLAG_USER).
+// The range must be inside a single mapping. Huge pages that are partially in the range are split.
+int paging_protect(struct paging_context *context, void *virtual_address, unsigned long bytes, unsigned long flags);
+
+// Removes the cached translations of start ... end of context on every cpu, call this after changing page table entries directly
+void paging_invalidate(struct paging_context *context, unsigned long start, unsigned long end);
+
+// Returns the physical address of the page filled with zeroes that is shared by all on demand mappings
+void *paging_get_zero_page();
+
+// Handles a page fault at virtual_address in context: loads swapped out pages, creates pages of on demand mappings and copies copy-on-write pages.
+// Returns 1 if the fault was handled and the instruction can be retried, 0 if it was an invalid access
+int paging_handle_fault(struct paging_context *context, void *virtual_address, unsigned long error_code);
+
+// Collapses every fully populated level1 table of this address space whose pages all have the same flags into a single 2MiB page
+// Returns the amount of level1 tables that were collapsed
+unsigned long paging_promote(struct paging_context *context);
+
+// Runs paging_promote on every process forever, every PAGING_PROMOTE_INTERVAL milliseconds, start this using scheduler_execute
+void paging_promote_worker();
+
+// Prints the huge page promotion statistics
+void paging_promote_debug();
+
 // Returs the number of used virtual pages
 unsigned long paging_used_pages();
 
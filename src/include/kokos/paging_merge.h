@@ -0,0 +1,30 @@
+#pragma once
+#include "kokos/paging.h"
+
+// Note on same page merging:
+// Processes that run the same program often have many pages with the same contents. paging_merge scans the pages of
+// PAGING_FLAG_MERGEABLE mappings and lets identical pages share a single physical page, which is mapped copy-on-write.
+// A page is only merged when its hash did not change since the previous scan, pages that are written often are not worth merging.
+// Merged pages are kept in the stable tree, sorted by the hash of their contents. Candidates that are not merged yet are kept
+// in the unstable tree, which is rebuilt every scan because their contents can change at any time.
+// Pages that only contain zeroes are replaced with the zero page of paging.c.
+
+// The amount of milliseconds paging_merge_worker waits between scans
+#define PAGING_MERGE_INTERVAL 2000
+// The maximum amount of mappings of one merged page (the size of memory_physical_page.share_count)
+#define PAGING_MERGE_MAX_SHARES 0xFFFF
+
+// Scans the mergeable pages of context once and merges them with identical pages. Returns the amount of pages that were merged
+unsigned long paging_merge(struct paging_context *context);
+
+// Runs paging_merge on every process forever, every PAGING_MERGE_INTERVAL milliseconds, start this using scheduler_execute
+void paging_merge_worker();
+
+// Removes a mapping of the merged page, the page is freed when it was the last mapping
+void paging_merge_release(void *page);
+
+// Returns 1 and makes the merged page private again if it has only one mapping left, otherwise returns 0
+int paging_merge_take(void *page);
+
+// Prints the same page merging statistics (pages shared and pages saved)
+void paging_merge_debug();
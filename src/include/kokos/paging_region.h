@@ -0,0 +1,55 @@
+#pragma once
+
+// Note on virtual memory regions:
+// Every address space keeps a tree of the virtual memory regions that are reserved in it (like the VMA's in Linux).
+// The tree is an AVL tree sorted by start address, so looking up the region that contains an address is O(log n).
+// Each node also remembers the largest free gap between the regions in its subtree, this is used to skip subtrees
+// that cannot contain a free spot when searching for free virtual memory.
+
+// The lowest virtual address that can be handed out by paging_region_reserve
+#define PAGING_REGION_MINIMUM 0x1000ul
+// The end of the lower canonical half of the virtual address space, addresses above this need bits 63:48 set
+#define PAGING_REGION_MAXIMUM 0x0000800000000000ul
+
+struct paging_region
+{
+    // The first virtual address of this region
+    unsigned long start;
+    // The first virtual address after this region
+    unsigned long end;
+    // The PAGING_FLAG_* flags this region was mapped with
+    unsigned long flags;
+    struct paging_region *left;
+    struct paging_region *right;
+    // The height of this node in the tree, a leaf has height 1
+    int height;
+    // The lowest start address in this subtree
+    unsigned long subtree_start;
+    // The highest end address in this subtree
+    unsigned long subtree_end;
+    // The largest gap between 2 regions in this subtree
+    unsigned long largest_gap;
+};
+
+// Finds the smallest free spot of bytes bytes (best-fit), aligned to alignment, and reserves it.
+// Returns the new region, or 0 if there is no free spot that is large enough or no memory for the region struct.
+struct paging_region *paging_region_reserve(struct paging_region **root, unsigned long bytes, unsigned long alignment, unsigned long flags);
+
+// Reserves a region at a specific virtual address. Returns the new region, or 0 if it overlaps with an existing region or there is no memory for the region struct.
+struct paging_region *paging_region_reserve_at(struct paging_region **root, unsigned long start, unsigned long bytes, unsigned long flags);
+
+// Changes the flags of start ... start + bytes, which must be inside a single region. The region is split when the range does not cover it.
+// Returns 0 without changing anything if the range is not inside a region or there is no memory for the region structs of the split
+int paging_region_set_flags(struct paging_region **root, unsigned long start, unsigned long bytes, unsigned long flags);
+
+// Unreserves a part of the virtual address space, regions that partially overlap are shrunk or split.
+void paging_region_release(struct paging_region **root, unsigned long start, unsigned long bytes);
+
+// Returns the region that contains virtual_address, or 0 if it is not reserved
+struct paging_region *paging_region_find(struct paging_region *root, unsigned long virtual_address);
+
+// Prints all regions to the console
+void paging_region_debug(struct paging_region *root);
+
+// Iterates the regions in order of their start address. Pass 0 to get the first region
+struct paging_region *paging_region_iterate(struct paging_region *root, struct paging_region *previous);
@@ -0,0 +1,39 @@
+#pragma once
+#include "kokos/paging.h"
+
+// Note on swapping:
+// When physical memory runs low, cold pages of PAGING_FLAG_SWAPPABLE mappings are compressed (see lz.h) into a store in RAM and their physical page is freed.
+// The page entry of a swapped out page is not present, but it is not zero: bits 62:12 contain the address of the compressed data (divided by 8)
+// and the permission and cache bits are kept. The page fault handler decompresses the page again when it is accessed.
+// Cold pages are found by scanning the accessed bits of the page entries: each scan clears the bit and the age of pages that were not accessed
+// since the previous scan (memory_physical_page.age) is incremented. Pages with the highest age are swapped out first (an approximation of LRU).
+// The compressed store packs the data of multiple pages into each store page, a store page is freed when all its data is freed.
+
+// The amount of milliseconds paging_swap_worker waits between scans
+#define PAGING_SWAP_INTERVAL 500
+// Pages are swapped out when less than 1 / PAGING_SWAP_LOW_WATERMARK of the physical memory is free
+#define PAGING_SWAP_LOW_WATERMARK 16
+// Pages are swapped out until 1 / PAGING_SWAP_HIGH_WATERMARK of the physical memory is free
+#define PAGING_SWAP_HIGH_WATERMARK 8
+// Pages that do not compress to this size are not worth swapping out
+#define PAGING_SWAP_MAX_COMPRESSED 3072
+// The amount of pages that are kept aside for the store, they are used when a page must be swapped out while no memory is available
+#define PAGING_SWAP_RESERVE_PAGES 8
+
+// Returns 1 if entry is the page entry of a swapped out page
+#define PAGING_SWAP_IS_ENTRY(entry) ((entry) && !((entry) & PAGING_ENTRY_FLAG_PRESENT))
+
+// Swaps out up to pages cold pages, starting with the least recently used ones. Returns the amount of pages that were freed
+unsigned long paging_swap_reclaim(unsigned long pages);
+
+// Decompresses the swapped out page of entry into page and frees the compressed data. Returns 1 on success
+int paging_swap_load(unsigned long entry, void *page);
+
+// Frees the compressed data of the swapped out page of entry, call this when a swap entry is removed
+void paging_swap_free(unsigned long entry);
+
+// Enables swapping and swaps out cold pages in the background when physical memory runs low, start this using scheduler_execute
+void paging_swap_worker();
+
+// Prints the swap statistics
+void paging_swap_debug();
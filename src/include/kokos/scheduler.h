@@ -2,54 +2,205 @@
 #include "kokos/idt.h"
 #include "kokos/paging.h"
 #include "kokos/apic.h"
+#include "kokos/scheduler_fair.h"
+#include "kokos/scheduler_deadline.h"
+#include "kokos/scheduler_wheel.h"
 
-#define SCHEDULER_TIMER_INTERVAL 10000
+// Note on processes and threads:
+// A process is an address space (its page table) and the resources that belong to it, a thread is what the scheduler runs: its stack, saved registers,
+// FPU state and scheduling state. A process has one or more threads, scheduler_execute starts a process with one thread and scheduler_execute_thread
+// starts another thread in the process of the current thread. Switching between threads of the same process does not write cr3, so the TLB is kept.
+// Kernel threads (scheduler_execute_kernel) do not have a process: their stack is in the identity mapped memory, which is mapped in every address space,
+// so they run in the address space that was loaded before them (lazy TLB) and switching to them never writes cr3. cpu->current_process is the process
+// whose address space is loaded, which is not the process of the current thread when a kernel thread runs, TLB flush requests are sent based on it.
 
-// See schedule.asm
-struct scheduler_saved_registers
-{
-    unsigned long r11;
-    unsigned long r10;
-    unsigned long r9;
-    unsigned long r8;
-    unsigned long rsi;
-    unsigned long rdi;
-    unsigned long rdx;
-    unsigned long rcx;
-    unsigned long rbx;
-    unsigned long rax;
-    unsigned long rbp;
-};
+// Note on load balancing:
+// Every cpu has its own run queue (see scheduler_fair.h and scheduler_deadline.h), new threads are added to the least busy cpu.
+// A cpu without threads steals a waiting thread from the busiest cpu on every scheduler interrupt, and every SCHEDULER_BALANCE_INTERVAL interrupts each cpu
+// takes a thread from the busiest cpu if that cpu runs at least SCHEDULER_IMBALANCE more threads. Busy cpus wake up tickless cpus that should do this. Moving a thread costs its cached data,
+// so threads that ran recently (cache hot) and threads that were migrated recently are left where they are.
+// Placement follows the cpu topology (see cpu_topology.h): between cpus that run the same amount of threads, the one whose core (then last level cache,
+// then package) runs the least threads is chosen, so threads get a core of their own before SMT siblings are shared. An idle cpu steals from the nearest cpu with waiting threads.
 
-struct scheduler_interrupt_frame
-{
-    struct scheduler_saved_registers registers;
-    struct idt_stack_frame base;
-};
+// Note on affinity and isolation:
+// Every process has an affinity: a cpu mask (see CPU_MASK) of the cpus its threads may run on, its threads copy it when they are created. scheduler_execute_on starts a process
+// with a specific affinity, the other ways to start a process allow every cpu. Threads are only placed on and migrated to cpus in their affinity.
+// Isolated cpus (see scheduler_set_isolated) are kept free of general work, for example for polling loops: threads are only placed on them when their affinity
+// contains nothing but isolated cpus, and they never take threads from other cpus while balancing. Other cpus can still take threads away from them.
+
+// Note on the scheduler timer:
+// The local APIC timer is used in TSC-deadline mode when the cpu supports it (it interrupts when the time stamp counter reaches the programmed value),
+// otherwise in one-shot mode with a count that is calibrated against the time stamp counter. It is programmed to the next event of the cpu: the end of the slice of the running thread when others
+// are waiting, the end of the budget of the running deadline thread or the start of the next period of a deadline thread. When there is no event
+// (the cpu is idle, or it runs a single thread) the timer is stopped, so the cpu is not interrupted at all. Other cpus then wake it up (see idle_wake) when
+// they add a thread to it, or when it should take threads from them (see scheduler_kick_balancer).
+
+// Note on context switches:
+// Every thread runs on its own stack. The scheduler interrupt runs on the stack of the interrupted thread, schedule.asm saves the caller-saved registers there.
+// A thread is switched out by scheduler_switch (also in schedule.asm): it pushes the callee-saved registers, stores the stack pointer in the thread,
+// loads the page table (when it changes) and stack of the next thread and returns where the next thread was switched out.
+// So every thread that is not running is waiting in scheduler_switch, called from the scheduler interrupt (it continues by returning from the interrupt)
+// or from scheduler_yield (it continues in the code that called scheduler_yield, without an interrupt frame). New threads continue in scheduler_start.
+// The scheduler_lock of the cpu is held during the switch, the code that continues after scheduler_switch releases it.
+// The time from the start of scheduling until the next thread runs is counted per cpu, see scheduler_debug.
+// TODO compare this with the interrupt frame switch that was used before scheduler_switch (it needs the same counters), no numbers were measured yet
+
+// Note on sleeping and waiting:
+// A thread that sleeps (scheduler_sleep) or waits on a wait queue (scheduler_wait) is blocked: it is removed from the run queue of its cpu and does not run
+// until it is woken up, by a timer in the timer wheel of its cpu (see scheduler_wheel.h) or by scheduler_wake_one/scheduler_wake_all. A woken thread is placed
+// in the fair run queue with sleeper credit (see scheduler_fair_place), so threads that mostly sleep run soon after they wake up.
+// Only fair threads can block, the idle thread must always be able to run and deadline threads wait using scheduler_wait_period.
+
+// Note on scheduler time:
+// The intervals below and the times passed to the scheduler functions are in nanoseconds, they are converted to time stamp counter cycles (see time.h)
+// where they are used. The run queues, the timer wheel and the scheduler timer work in time stamp counter cycles, so scheduling never converts the current time.
+
+// The interrupt vector of the scheduler, used by the local APIC timer and by other cpus that want this cpu to schedule
+#define SCHEDULER_VECTOR 0x23
+// The amount of time stamp counter cycles the timer runs while it is calibrated, only used when the TSC-deadline mode is not supported
+#define SCHEDULER_TIMER_CALIBRATION 10000000ul
+// Events closer than this amount of nanoseconds are handled this amount of nanoseconds later, so the cpu is not flooded with interrupts
+#define SCHEDULER_TIMER_MINIMUM 10000ul
+// The amount of scheduler interrupts between two load balancing attempts of a cpu
+#define SCHEDULER_BALANCE_INTERVAL 32
+// A busy cpu only takes a thread from another cpu if that cpu runs at least this amount of threads more, moving one thread between cpus that differ by 1 would only swap the imbalance
+#define SCHEDULER_IMBALANCE 2
+// A thread that stopped running less than this amount of nanoseconds ago is cache hot and is not migrated
+#define SCHEDULER_CACHE_HOT_TIME 500000ul
+// A thread is not migrated again within this amount of nanoseconds, so it does not bounce between cpus
+#define SCHEDULER_MIGRATION_COST 5000000ul
+// The size of the stack of a thread of a process
+#define SCHEDULER_STACK_SIZE (4096ul * 8ul)
+// The amount of pages of the stack of a kernel thread, memory_physical_allocate_consecutive hands out at least 64 pages
+#define SCHEDULER_KERNEL_STACK_PAGES 64ul
+
+// The thread is running or in a run queue
+#define SCHEDULER_THREAD_RUNNABLE 0
+// The thread sleeps or waits on a wait queue, it is not in a run queue
+#define SCHEDULER_THREAD_BLOCKED 1
+
+// Threads scheduled by scheduler_execute, scheduler_execute_thread and scheduler_execute_kernel, see scheduler_fair.h
+#define SCHEDULER_POLICY_FAIR 0
+// Periodic real-time threads scheduled by scheduler_execute_deadline, see scheduler_deadline.h
+#define SCHEDULER_POLICY_DEADLINE 1
+
+struct cpu;
 
 struct scheduler_process
 {
     // The id of this process
     unsigned long id;
-    // Pointer to the next process
-    struct scheduler_process *next;
-    // Pointer to the previous process
-    struct scheduler_process *previous;
+    // Pointer to the next process in the list of all processes, see scheduler_process_iterate
+    struct scheduler_process *all_next;
     // Pointer to the pages table used by this process
     struct paging_context paging_context;
     // Virtual address to the local apic
     struct apic *local_apic;
+    // The amount of threads of this process
+    unsigned long thread_count;
+    // The cpus the threads of this process may run on, see the note on affinity and isolation
+    unsigned long affinity;
+};
 
-    // TODO move to thread struct
-    unsigned long saved_rflags;
-    // Address of the current instruction where it left off
-    void *saved_instruction_pointer;
-    // Address of the stack
+struct scheduler_thread
+{
+    // The id of this thread
+    unsigned long id;
+    // Pointer to the next thread in the list of all threads, see scheduler_thread_iterate
+    struct scheduler_thread *all_next;
+    // The process this thread belongs to, 0 for a kernel thread
+    struct scheduler_process *process;
+    // The time stamp counter when this thread last stopped running, 0 if it never ran
+    unsigned long last_run;
+    // The time stamp counter when this thread was last moved to another cpu
+    unsigned long last_migration;
+    // One of SCHEDULER_POLICY_*, the run queue this thread is in
+    int policy;
+    // One of SCHEDULER_THREAD_*
+    int state;
+    // The cpu whose run queue this thread is in, it only changes while the scheduler_lock of both cpus is held
+    struct cpu *cpu;
+    // The cpus this thread may run on, the affinity of its process or every cpu for a kernel thread
+    unsigned long affinity;
+    // Wakes up this thread when it sleeps, see scheduler_sleep
+    struct scheduler_wheel_timer sleep_timer;
+    // Pointer to the next thread in the wait queue this thread waits on
+    struct scheduler_thread *wait_next;
+    // The position of this thread in the fair run queue of its cpu
+    struct scheduler_fair_entity fair;
+    // The budget and period of a deadline thread
+    struct scheduler_deadline_entity deadline;
+    // The stack pointer of this thread when it was switched out, its callee-saved registers and the address to continue at are on the stack (see scheduler_switch)
     void *saved_stack_pointer;
-    // Saved registers during a task switch
-    struct scheduler_saved_registers saved_registers;
+    // The function a new thread starts at, see scheduler_start
+    void (*entrypoint)();
+    // The saved FPU/SSE/AVX registers, loaded when the thread uses them, see fpu.h
+    void *fpu_state;
+};
+
+// A list of threads that wait for something, see scheduler_wait. Initialize it to zeros
+struct scheduler_wait_queue
+{
+    // Held while the list is changed
+    int lock;
+    // The waiting threads, in the order they started waiting
+    struct scheduler_thread *first;
+    struct scheduler_thread *last;
 };
 
 void scheduler_initialize();
 
-void scheduler_execute(void (*scheduler_entrypoint)());
\ No newline at end of file
+// Starts a new process with one thread that runs scheduler_entrypoint, on the cpu that runs the least threads
+void scheduler_execute(void (*scheduler_entrypoint)());
+
+// Starts a new process with one thread that runs scheduler_entrypoint, its threads only run on the cpus in cpu_mask (see the note on affinity and isolation).
+// Pinning it to isolated cpus dedicates them to it. Returns 1 on success, 0 if cpu_mask contains no started cpu or no memory is available
+int scheduler_execute_on(unsigned long cpu_mask, void (*scheduler_entrypoint)());
+
+// Starts a new thread that runs scheduler_entrypoint in the process of the current thread, it shares its address space.
+// When called from a kernel thread, a kernel thread is started. Returns 1 on success, 0 if no memory is available
+int scheduler_execute_thread(void (*scheduler_entrypoint)());
+
+// Starts a new kernel thread that runs scheduler_entrypoint, it has no address space of its own and runs in the one that is loaded (see the note on processes and threads).
+// Only use it for code that does not depend on the address space, like workers that go through the address spaces of all processes. Returns 1 on success, 0 if no memory is available
+int scheduler_execute_kernel(void (*scheduler_entrypoint)());
+
+// Starts a new periodic real-time process that runs scheduler_entrypoint, it gets runtime nanoseconds every period nanoseconds (see scheduler_deadline.h).
+// Returns 1 on success, 0 if no cpu has enough time left to guarantee its deadlines
+int scheduler_execute_deadline(void (*scheduler_entrypoint)(), unsigned long runtime, unsigned long period);
+
+// Ends the job of the current deadline thread, it continues at the start of its next period
+void scheduler_wait_period();
+
+// Gives up the cpu, another thread runs if one is waiting. The current thread continues when it is scheduled again
+void scheduler_yield();
+
+// Blocks the current thread for at least nanoseconds, it does not use the cpu meanwhile. Returns 1 on success, 0 if the current thread cannot block
+// (see the note on sleeping and waiting), then it did not sleep
+int scheduler_sleep(unsigned long nanoseconds);
+
+// Blocks the current thread until it is woken up using queue. Returns 1 on success, 0 if the current thread cannot block
+int scheduler_wait(struct scheduler_wait_queue *queue);
+
+// Wakes up the thread that waits the longest on queue. Returns 1 if a thread was woken up, 0 if no thread was waiting
+int scheduler_wake_one(struct scheduler_wait_queue *queue);
+
+// Wakes up every thread that waits on queue and returns the amount of threads that were woken up
+unsigned long scheduler_wake_all(struct scheduler_wait_queue *queue);
+
+// Isolates the cpus in cpu_mask and stops isolating the other cpus, see the note on affinity and isolation. Isolate cpus before pinning processes to them,
+// threads that already run on them are not moved away right away, other cpus take them over when they balance
+void scheduler_set_isolated(unsigned long cpu_mask);
+
+// Sets the nice value of the current thread, a lower nice value gives it a larger share of the cpu (see scheduler_fair.h).
+// Returns 1 on success, 0 if nice is not in SCHEDULER_FAIR_NICE_MINIMUM ... SCHEDULER_FAIR_NICE_MAXIMUM
+int scheduler_set_nice(int nice);
+
+// Iterates every process started using scheduler_execute or scheduler_execute_deadline, on every cpu. Pass 0 to get the first process
+struct scheduler_process *scheduler_process_iterate(struct scheduler_process *previous);
+
+// Iterates every thread, including kernel threads but not the idle threads. Pass 0 to get the first thread
+struct scheduler_thread *scheduler_thread_iterate(struct scheduler_thread *previous);
+
+// Prints the amount of threads, steals, migrations, the average context switch time and the amount of address space switches of every cpu and the deadline misses of every deadline thread
+void scheduler_debug();
\ No newline at end of file
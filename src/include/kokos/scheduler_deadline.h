@@ -0,0 +1,82 @@
+#pragma once
+
+// Note on deadline scheduling:
+// Periodic real-time threads (sampling, device polling...) are scheduled using earliest deadline first (EDF), like SCHED_DEADLINE in Linux.
+// A deadline thread has a runtime budget per period: each period it runs one job, which must be done (see scheduler_wait_period) before the end of the period.
+// Deadline threads always run before fair threads, the ready thread with the earliest deadline runs first.
+// A job that uses up its runtime is throttled until its next period, so a misbehaving thread cannot take more than its budget (constant bandwidth).
+// Admission control only accepts a new deadline thread on a cpu if the sum of runtime / period of its deadline threads stays below SCHEDULER_DEADLINE_MAX_UTILIZATION,
+// then EDF can meet every deadline and the remaining time is left for fair threads. Deadline threads are never migrated.
+// A job that was not done at the end of its period is a deadline miss, they are counted per thread, see scheduler_debug.
+// All times are in time stamp counter cycles (scheduler_execute_deadline converts the nanoseconds it gets), the scheduler timer is programmed to the next budget end or period start.
+
+// Utilization is a fixed point number, this is a utilization of 1 (a whole cpu)
+#define SCHEDULER_DEADLINE_UNIT (1ul << 20)
+// The maximum utilization of the deadline threads of one cpu
+#define SCHEDULER_DEADLINE_MAX_UTILIZATION (SCHEDULER_DEADLINE_UNIT * 95 / 100)
+
+// The job of the period is ready to run
+#define SCHEDULER_DEADLINE_STATE_READY 0
+// The job used up its runtime and waits for the next period
+#define SCHEDULER_DEADLINE_STATE_THROTTLED 1
+// The job is done and waits for the next period
+#define SCHEDULER_DEADLINE_STATE_DONE 2
+
+struct scheduler_thread;
+
+// The deadline scheduling information of a thread
+struct scheduler_deadline_entity
+{
+    // The runtime budget of each period
+    unsigned long runtime;
+    unsigned long period;
+    // The runtime that is left in the current period
+    unsigned long remaining;
+    // The end of the current period, this is also the start of the next period
+    unsigned long absolute_deadline;
+    // The time stamp counter when the runtime of this thread was last subtracted from remaining
+    unsigned long exec_start;
+    // One of SCHEDULER_DEADLINE_STATE_*
+    int state;
+    // The amount of jobs that were started
+    unsigned long jobs;
+    // The amount of jobs that were not done before their deadline
+    unsigned long misses;
+    // Pointer to the next thread in the ready or waiting list
+    struct scheduler_thread *next;
+};
+
+// The deadline run queue of a cpu, it is only used while the scheduler_lock of the cpu is held
+struct scheduler_deadline_queue
+{
+    // The ready threads sorted by absolute deadline, the running deadline thread stays in this list
+    struct scheduler_thread *ready;
+    // The throttled and done threads, waiting for their next period
+    struct scheduler_thread *waiting;
+    // The sum of runtime / period of the deadline threads of this cpu, see SCHEDULER_DEADLINE_UNIT
+    unsigned long utilization;
+};
+
+// Returns the utilization of a thread with this runtime and period, see SCHEDULER_DEADLINE_UNIT
+unsigned long scheduler_deadline_utilization(unsigned long runtime, unsigned long period);
+
+// Reserves the utilization of a new deadline thread on queue. Returns 1 if it was admitted, 0 if the deadlines of queue could not be guaranteed anymore
+int scheduler_deadline_admit(struct scheduler_deadline_queue *queue, unsigned long runtime, unsigned long period);
+
+// Adds an admitted thread to queue, its first period starts now
+void scheduler_deadline_start(struct scheduler_deadline_queue *queue, struct scheduler_thread *thread, unsigned long runtime, unsigned long period, unsigned long now);
+
+// Subtracts the time current ran since the last update from its runtime and throttles it when its runtime is used up. Pass 0 if no deadline thread is running
+void scheduler_deadline_update(struct scheduler_deadline_queue *queue, struct scheduler_thread *current, unsigned long now);
+
+// Starts the next period of the waiting threads whose period ended and counts the deadline misses
+void scheduler_deadline_release(struct scheduler_deadline_queue *queue, unsigned long now);
+
+// Marks the job of thread as done, it becomes ready again at the start of its next period
+void scheduler_deadline_done(struct scheduler_deadline_queue *queue, struct scheduler_thread *thread);
+
+// Returns the ready thread with the earliest deadline, or 0 if no deadline thread is ready
+struct scheduler_thread *scheduler_deadline_first(struct scheduler_deadline_queue *queue);
+
+// Returns the time stamp counter at which the next period of a waiting thread starts, or 0 if no thread is waiting
+unsigned long scheduler_deadline_next_release(struct scheduler_deadline_queue *queue);
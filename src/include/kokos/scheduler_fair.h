@@ -0,0 +1,83 @@
+#pragma once
+
+// Note on fair scheduling:
+// Threads are scheduled like CFS in Linux. Each thread has a virtual runtime: the time it ran, scaled by SCHEDULER_FAIR_NICE_0_WEIGHT / its weight,
+// so threads with a higher weight (a lower nice value) age slower and get more cpu time. Each cpu keeps its waiting threads in an AVL tree sorted
+// by virtual runtime and runs the leftmost one, which got the least cpu time. The running thread is not in the tree, it is preempted when it used up
+// its slice (its share of SCHEDULER_FAIR_LATENCY) and another thread has a lower virtual runtime.
+// min_vruntime follows the lowest virtual runtime of the cpu and never decreases. New threads start at min_vruntime, so they cannot take the cpu
+// for a long time, and threads that wake up are placed at most SCHEDULER_FAIR_SLEEPER_CREDIT before it. Threads that mostly sleep (latency sensitive ones)
+// therefore run before cpu bound threads when they wake up, but they cannot save up credit by sleeping for a long time.
+// Virtual runtimes are in time stamp counter cycles, the intervals below are in nanoseconds.
+
+// The weight of a thread with nice value 0
+#define SCHEDULER_FAIR_NICE_0_WEIGHT 1024
+#define SCHEDULER_FAIR_NICE_MINIMUM -20
+#define SCHEDULER_FAIR_NICE_MAXIMUM 19
+// The period in which every waiting thread should run once, it is divided between the threads by weight
+#define SCHEDULER_FAIR_LATENCY 6000000ul
+// The minimum time a thread runs before it is preempted, so the slices do not get too small when there are many threads
+#define SCHEDULER_FAIR_MINIMUM_GRANULARITY 750000ul
+// The maximum amount of virtual runtime a waking thread is placed before min_vruntime
+#define SCHEDULER_FAIR_SLEEPER_CREDIT 3000000ul
+
+struct scheduler_thread;
+
+// The fair scheduling information of a thread
+struct scheduler_fair_entity
+{
+    // The weighted time this thread ran, the key of the tree
+    unsigned long vruntime;
+    // The weight of this thread, derived from nice
+    unsigned long weight;
+    int nice;
+    // The time stamp counter when the runtime of this thread was last added to vruntime
+    unsigned long exec_start;
+    // The time stamp counter when this thread started running
+    unsigned long slice_start;
+    struct scheduler_thread *left;
+    struct scheduler_thread *right;
+    // The height of this node in the tree, a leaf has height 1
+    int height;
+};
+
+// The fair run queue of a cpu, it is only used while the scheduler_lock of the cpu is held
+struct scheduler_fair_queue
+{
+    // The waiting threads, sorted by vruntime
+    struct scheduler_thread *root;
+    // The lowest virtual runtime on this cpu, only grows
+    unsigned long min_vruntime;
+    // The sum of the weights of the threads in the tree
+    unsigned long load;
+};
+
+// Sets the nice value (SCHEDULER_FAIR_NICE_MINIMUM ... SCHEDULER_FAIR_NICE_MAXIMUM) and the weight of thread, it must not be in a tree
+void scheduler_fair_set_nice(struct scheduler_thread *thread, int nice);
+
+// Sets the virtual runtime of a thread that is added to queue. A new thread starts at min_vruntime, a sleeper that wakes up gets up to SCHEDULER_FAIR_SLEEPER_CREDIT
+void scheduler_fair_place(struct scheduler_fair_queue *queue, struct scheduler_thread *thread, int sleeper);
+
+// Adds thread to the tree of queue
+void scheduler_fair_enqueue(struct scheduler_fair_queue *queue, struct scheduler_thread *thread);
+
+// Removes thread from the tree of queue
+void scheduler_fair_dequeue(struct scheduler_fair_queue *queue, struct scheduler_thread *thread);
+
+// Moves a thread that was removed from the tree of from to the time line of to, pass it to scheduler_fair_enqueue afterwards
+void scheduler_fair_migrate(struct scheduler_fair_queue *from, struct scheduler_fair_queue *to, struct scheduler_thread *thread);
+
+// Returns the waiting thread with the lowest virtual runtime, or 0 if the tree is empty
+struct scheduler_thread *scheduler_fair_first(struct scheduler_fair_queue *queue);
+
+// Iterates the waiting threads in order of their virtual runtime. Pass 0 to get the first thread
+struct scheduler_thread *scheduler_fair_iterate(struct scheduler_fair_queue *queue, struct scheduler_thread *previous);
+
+// Adds the time current ran since the last update to its virtual runtime and updates min_vruntime. Pass 0 for current if the cpu is idle
+void scheduler_fair_update(struct scheduler_fair_queue *queue, struct scheduler_thread *current, unsigned long now);
+
+// Returns the time stamp counter at which the slice of current ends
+unsigned long scheduler_fair_slice_end(struct scheduler_fair_queue *queue, struct scheduler_thread *current);
+
+// Returns 1 if current used up its slice and a waiting thread should run instead
+int scheduler_fair_should_preempt(struct scheduler_fair_queue *queue, struct scheduler_thread *current, unsigned long now);
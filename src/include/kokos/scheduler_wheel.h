@@ -0,0 +1,50 @@
+#pragma once
+
+// Note on the timer wheel:
+// Every cpu keeps its timers (like the timers of sleeping threads, see scheduler_sleep) in a hierarchical timer wheel, so adding a timer and running the
+// expired ones does not depend on the amount of timers. Time is divided in ticks of SCHEDULER_WHEEL_TICK time stamp counter cycles. Level 0 has a slot
+// for each of the next SCHEDULER_WHEEL_SLOTS ticks, each slot of level 1 covers SCHEDULER_WHEEL_SLOTS ticks, each slot of level 2 covers SCHEDULER_WHEEL_SLOTS
+// slots of level 1 and so on. A timer is added to the lowest level that reaches its expiry. When the wheel passes the start of a slot of a higher level,
+// the timers of that slot are cascaded: added again, so they move to a lower level. The timers in the current slot of level 0 are expired.
+// Timers never expire early, but they can expire up to one tick late. Timers further away than the highest level are cascaded until they are in reach.
+// The wheel of a cpu is only used while its scheduler_lock is held, the scheduler runs the expired timers and programs the scheduler timer to the next expiry.
+
+// The amount of time stamp counter cycles of one tick, must be a power of two
+#define SCHEDULER_WHEEL_TICK (1ul << 18)
+// The amount of slots per level, each slot of a level covers this amount of slots of the level below it
+#define SCHEDULER_WHEEL_SLOT_BITS 6
+#define SCHEDULER_WHEEL_SLOTS (1ul << SCHEDULER_WHEEL_SLOT_BITS)
+#define SCHEDULER_WHEEL_LEVELS 4
+
+struct scheduler_wheel_timer
+{
+    // The time stamp counter at which function is called
+    unsigned long expires;
+    // Called with the scheduler_lock of the cpu held, the timer is not in the wheel anymore and can be added again
+    void (*function)(struct scheduler_wheel_timer *timer);
+    // Passed to function using the timer
+    void *data;
+    // Pointer to the next timer in the same slot
+    struct scheduler_wheel_timer *next;
+};
+
+struct scheduler_wheel
+{
+    // The next tick that has not been processed yet
+    unsigned long tick;
+    // The amount of timers in each level, used to skip empty levels
+    unsigned int level_timers[SCHEDULER_WHEEL_LEVELS];
+    struct scheduler_wheel_timer *slots[SCHEDULER_WHEEL_LEVELS][SCHEDULER_WHEEL_SLOTS];
+};
+
+// Initializes an empty wheel, its first tick is the tick of now
+void scheduler_wheel_initialize(struct scheduler_wheel *wheel, unsigned long now);
+
+// Adds a timer, set its expires, function and data first. A timer that already expired is called at the next scheduler_wheel_run
+void scheduler_wheel_add(struct scheduler_wheel *wheel, struct scheduler_wheel_timer *timer);
+
+// Calls the functions of every timer that expired at now, and cascades the timers of higher levels whose slot started
+void scheduler_wheel_run(struct scheduler_wheel *wheel, unsigned long now);
+
+// Returns the time stamp counter at which scheduler_wheel_run must be called next (a timer expires or a slot is cascaded), or 0 if the wheel is empty
+unsigned long scheduler_wheel_next_event(struct scheduler_wheel *wheel);
@@ -0,0 +1,82 @@
+#pragma once
+#include "kokos/acpi.h"
+
+// Note on time keeping:
+// The kernel measures time using the time stamp counter (TSC) of the cpu, it is the cheapest clock to read (a single rdtsc, no port or memory access).
+// Its frequency is not reported reliably by the cpu, so time_initialize measures it against a timer with a known frequency: the HPET (found using
+// the ACPI 'HPET' table), the ACPI power management timer (found using the FADT) or, when both are missing, channel 2 of the PIT. Until then
+// TIME_DEFAULT_FREQUENCY is assumed, which makes early waits too long rather than too short.
+// The TSC only measures time when it is invariant (CPUID 0x80000007): it then runs at a constant rate in every power state and is synchronized between cpus.
+// Without an invariant TSC the frequency can change with the clock of the cpu, time_initialize warns about it but still uses it.
+// Cycles are converted to nanoseconds (and back) using a fixed point multiplication, no division. The conversion values are published using a sequence
+// number (like a seqlock in Linux): the writer makes it odd while it changes them, readers retry when it was odd or changed while they read. Readers never
+// write shared memory or take a lock, so time_now_ns can be used from interrupt handlers and on every cpu at the same time.
+// Kernel intervals (sleep times, scheduler slices...) are specified in nanoseconds and converted to cycles using time_ns_to_cycles.
+
+// The time stamp counter frequency assumed before time_initialize
+#define TIME_DEFAULT_FREQUENCY 10000000000ul
+// The amount of milliseconds the time stamp counter is measured against the reference timer
+#define TIME_CALIBRATION_MILLISECONDS 50ul
+// The fixed point conversion values are multiplied by 2^TIME_SHIFT
+#define TIME_SHIFT 32
+
+// The frequency of the ACPI power management timer, its counter is 24 bits or 32 bits wide (see TIME_FADT_TIMER_32_BIT)
+#define TIME_PM_TIMER_FREQUENCY 3579545ul
+// Bit of struct acpi_fadt.flags that indicates the power management timer counter is 32 bits wide
+#define TIME_FADT_TIMER_32_BIT (1u << 8)
+
+// The frequency of the programmable interval timer
+#define TIME_PIT_FREQUENCY 1193182ul
+#define TIME_PIT_CHANNEL_2_PORT 0x42
+#define TIME_PIT_COMMAND_PORT 0x43
+// Bit 0 gates PIT channel 2, bit 1 connects it to the speaker and bit 5 reads its output
+#define TIME_PIT_CONTROL_PORT 0x61
+
+// The signature that identifies the HPET structure, ascii "HPET" in a packed int. To be used with the acpi_get_table function
+#define TIME_HPET_SIGNATURE 0x54455048
+// Offsets of the HPET registers
+#define TIME_HPET_CAPABILITIES 0x00
+#define TIME_HPET_CONFIGURATION 0x10
+#define TIME_HPET_COUNTER 0xF0
+// Bit of the configuration register that makes the main counter run
+#define TIME_HPET_ENABLE 1ul
+// Bit of the capabilities register that indicates the main counter is 64 bits wide
+#define TIME_HPET_64_BIT (1ul << 13)
+
+// The clock the time stamp counter was calibrated against
+#define TIME_SOURCE_NONE 0
+#define TIME_SOURCE_HPET 1
+#define TIME_SOURCE_PM_TIMER 2
+#define TIME_SOURCE_PIT 3
+
+// The HPET ACPI table describes the High Precision Event Timer
+// https://wiki.osdev.org/HPET
+struct time_hpet_table
+{
+    struct acpi_sdt base;
+    unsigned int event_timer_block_id;
+    // The physical address of the registers, address_space is 0 for memory
+    struct acpi_fadt_address address;
+    unsigned char hpet_number;
+    unsigned short minimum_tick;
+    unsigned char page_protection;
+} ATTRIBUTE_PACKED;
+
+// Measures the time stamp counter frequency using the HPET or the power management timer described by the ACPI tables in rsdt,
+// or using the PIT when rsdt is 0 or has neither. Must be called once, on the boot processor with interrupts enabled or disabled. Returns 1 on success, 0 if every clock failed
+int time_initialize(const struct acpi_rsdt *rsdt);
+
+// Returns the amount of nanoseconds since the time stamp counter was reset (at power on), lock-free
+unsigned long time_now_ns();
+
+// Converts an amount of nanoseconds to time stamp counter cycles
+unsigned long time_ns_to_cycles(unsigned long nanoseconds);
+
+// Converts an amount of time stamp counter cycles to nanoseconds
+unsigned long time_cycles_to_ns(unsigned long cycles);
+
+// Returns the time stamp counter frequency in cycles per second
+unsigned long time_frequency();
+
+// Prints the time stamp counter frequency, the clock it was measured against and whether it is invariant
+void time_debug();
@@ -1,35 +1,61 @@
 global scheduler_interrupt
+global scheduler_switch
 extern scheduler_handle_interrupt
 
 bits 64
 section .text
 
+; The scheduler interrupt runs on the stack of the interrupted thread. Only the registers that scheduler_handle_interrupt may change
+; (the caller-saved ones) are saved here, the callee-saved registers are saved by scheduler_switch when the thread is switched out
 scheduler_interrupt:
-    push rbp    ; rsp + 80
-    push rax    ; rsp + 72
-    push rbx    ; rsp + 64 Test: will be preserved?
-    push rcx    ; rsp + 56
-    push rdx    ; rsp + 48
-    push rdi    ; rsp + 40
-    push rsi    ; rsp + 32
-    push r8     ; rsp + 24
-    push r9     ; rsp + 16
-    push r10    ; rsp + 8
-    push r11    ; rsp    
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
 
-    mov rdi, rsp
-    cld 
+    ; The cpu aligned the stack to 16 bytes before pushing the 5 values of the interrupt frame, after 9 more pushes it is aligned again for the call
+    cld
     call scheduler_handle_interrupt
 
     pop r11
     pop r10
     pop r9
     pop r8
-    pop rsi
     pop rdi
+    pop rsi
     pop rdx
     pop rcx
-    pop rbx ; Test: will be preserved?
     pop rax
+    iretq
+
+; void scheduler_switch(void **saved_stack_pointer (rdi), void *stack_pointer (rsi), void *level4_table (rdx))
+; Saves the callee-saved registers on the current stack, stores the stack pointer in *saved_stack_pointer, switches to the page table (unless level4_table is 0,
+; then the loaded page table is kept) and stack of the next thread and returns to where that thread called scheduler_switch (or to scheduler_start for a new thread).
+; Interrupts must be disabled. The current stack may not be mapped in the page table of the next thread, so the stack is not used between the cr3 and rsp writes
+scheduler_switch:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+
+    test rdx, rdx
+    jz .keep_page_table
+    mov cr3, rdx
+.keep_page_table:
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
     pop rbp
-    iretq
\ No newline at end of file
+    pop rbx
+    ret